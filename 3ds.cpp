@@ -11,6 +11,8 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
+#include <string.h>
+
 #include "3ds.h"
 
 C3DS::C3DS(void)
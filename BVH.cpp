@@ -1,139 +1,186 @@
 #include "BVH.h"
 
-void BoundingBox::buildPlanes(Vector &highestV, Vector &lowestV)
+#include <algorithm>
+
+// =================================================================================
+
+#define _RT_BVH_SAH_BINS 12
+#define _RT_BVH_MAX_LEAF_SIZE 4
+#define _RT_BVH_MAX_DEPTH 64
+
+// Relative costs used by the surface area heuristic
+#define _RT_BVH_TRAVERSAL_COST 1.0f
+#define _RT_BVH_INTERSECTION_COST 2.0f
+
+static float vectorAxis(const Vector & v, unsigned int axis)
 {
-	Vector xLen(lowestV.x - highestV.x, 0.0f, 0.0f);
-	Vector yLen(0.0f, lowestV.y - highestV.y, 0.0f);
-	Vector zLen(0.0f, 0.0f, lowestV.z - highestV.z);
-
-	Vector center = (lowestV + highestV) / 2.0f;
-	Vector test;
-
-	// front side
-	BoxPlane front;
-	Vector fronttopRight = highestV;
-	Vector fronttopLeft = highestV + xLen;
-	Vector frontbottomLeft = fronttopLeft + yLen;
-	Vector frontbottomRight = highestV + yLen;
-	front.corner = fronttopRight;
-	test = (front.corner - center).Normalize();
-	front.normal = (fronttopLeft - fronttopRight).Cross(frontbottomRight - fronttopRight).Normalize();
-
-	if (test.Dot(front.normal) < 0.0f)
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+void BVH::build(const std::vector<AABB> & primitiveBounds)
+{
+	nodes.clear();
+	primitiveIndices.clear();
+
+	if (primitiveBounds.empty())
 	{
-		front.normal = front.normal * -1.0f;
+		return;
 	}
-	findHighestLowestValues(fronttopLeft, fronttopRight, frontbottomLeft, frontbottomRight, front);
-
-	// back side
-	BoxPlane back;
-	Vector backtopRight = highestV + zLen;
-	Vector backtopLeft = backtopRight + xLen;
-	Vector backbottomLeft = backtopLeft + yLen;
-	Vector backbottomRight = backtopRight + yLen;
-	back.corner = backtopRight;
-	back.normal = (backtopLeft - backtopRight).Cross(backbottomRight - backtopRight).Normalize();
-	test = (back.corner - center).Normalize();
-	if (test.Dot(back.normal) < 0.0f)
+
+	std::vector<Vector> centroids;
+	centroids.reserve(primitiveBounds.size());
+	primitiveIndices.reserve(primitiveBounds.size());
+	for (unsigned int i = 0; i < primitiveBounds.size(); i++)
 	{
-		back.normal = back.normal * -1.0f;
+		centroids.push_back(primitiveBounds[i].centroid());
+		primitiveIndices.push_back(i);
 	}
-	findHighestLowestValues(backtopRight, backtopLeft, backbottomLeft, backbottomRight, back);
-
-	// left side
-	BoxPlane left;
-	Vector lefttopRight = highestV + xLen;
-	Vector lefttopLeft = lefttopRight + zLen;
-	Vector leftbottomRight = lefttopRight + yLen;
-	Vector leftbottomLeft = lefttopLeft + yLen;
-	left.corner = lefttopRight;
-	left.normal = (lefttopLeft - lefttopRight).Cross(leftbottomRight - lefttopRight).Normalize();
-	test = (left.corner - center).Normalize();
-	if (test.Dot(left.normal) < 0.0f)
+
+	// A binary tree with N leaves has at most 2N - 1 nodes
+	nodes.reserve(primitiveBounds.size() * 2);
+	nodes.push_back(BVHNode());
+	buildRecursive(primitiveBounds, centroids, 0, 0, (unsigned int)primitiveBounds.size(), 0);
+}
+
+void BVH::buildRecursive(const std::vector<AABB> & bounds, const std::vector<Vector> & centroids, unsigned int nodeIndex, unsigned int start, unsigned int end, unsigned int depth)
+{
+	AABB nodeBounds, centroidBounds;
+	for (unsigned int i = start; i < end; i++)
 	{
-		left.normal = left.normal * -1.0f;
+		nodeBounds.expand(bounds[primitiveIndices[i]]);
+		centroidBounds.expand(centroids[primitiveIndices[i]]);
 	}
-	findHighestLowestValues(lefttopRight, lefttopLeft, leftbottomLeft, leftbottomRight, left);
-
-	// right side
-	BoxPlane right;
-	Vector righttopRight = highestV + zLen;
-	Vector righttopLeft = highestV;
-	Vector rightbottomRight = righttopRight + yLen;
-	Vector rightbottomLeft = righttopLeft + yLen;
-	right.corner = righttopRight;
-	right.normal = (righttopLeft - righttopRight).Cross(rightbottomRight - righttopRight).Normalize();
-	test = (right.corner - center).Normalize();
-	if (test.Dot(right.normal) < 0.0f)
+
+	BVHNode & node = nodes[nodeIndex];
+	node.bounds = nodeBounds;
+	node.offset = start;
+	node.count = (unsigned short)(end - start);
+	node.axis = 0;
+
+	unsigned int count = end - start;
+	if (count <= _RT_BVH_MAX_LEAF_SIZE)
 	{
-		right.normal = right.normal * -1.0f;
+		return;
 	}
-	findHighestLowestValues(righttopLeft, righttopRight, rightbottomLeft, rightbottomRight, right);
-
-	// top side
-	BoxPlane top;
-	Vector toptopRight = highestV + xLen;
-	Vector toptopLeft = toptopRight + zLen;
-	Vector topbottomRight = highestV;
-	Vector topbottomLeft = highestV + zLen;
-	top.corner = toptopRight;
-	top.normal = (toptopLeft - toptopRight).Cross(topbottomRight - toptopRight).Normalize();
-	test = (top.corner - center).Normalize();
-	if (test.Dot(top.normal) < 0.0f)
+
+	// Split along the widest centroid extent
+	unsigned int axis = 0;
+	float axisExtent = centroidBounds.highest[0] - centroidBounds.lowest[0];
+	for (unsigned int a = 1; a < 3; a++)
 	{
-		top.normal = top.normal * -1.0f;
+		float extent = centroidBounds.highest[a] - centroidBounds.lowest[a];
+		if (extent > axisExtent)
+		{
+			axis = a;
+			axisExtent = extent;
+		}
 	}
-	findHighestLowestValues(toptopRight, toptopLeft, topbottomLeft, topbottomRight, top);
-
-	// bottom side
-	BoxPlane bottom;
-	Vector bottomtopRight = toptopRight + yLen;
-	Vector bottomtopLeft = toptopLeft + yLen;
-	Vector bottombottomLeft = topbottomLeft + yLen;
-	Vector bottombottomRight = topbottomRight + yLen;
-	bottom.corner = bottomtopRight;
-	bottom.normal = (bottomtopLeft - bottomtopRight).Cross(bottombottomRight - bottomtopRight).Normalize();
-	test = (bottom.corner - center).Normalize();
-	if (test.Dot(bottom.normal) < 0.0f)
+
+	float axisLowest = centroidBounds.lowest[axis];
+
+	// All centroids on the same point, no plane will separate them
+	if (axisExtent <= 0.0f && count <= _RT_BVH_MAX_LEAF_SIZE * 4)
 	{
-		bottom.normal = bottom.normal * -1.0f;
+		return;
 	}
-	findHighestLowestValues(bottomtopRight, bottomtopLeft, bottombottomLeft, bottombottomRight, bottom);
-
-	planes.push_back(front);
-	planes.push_back(back);
-	planes.push_back(left);
-	planes.push_back(right);
-	planes.push_back(top);
-	planes.push_back(bottom);
-}
 
-void BoundingBox::findHighestLowestValues(Vector &a, Vector &b, Vector &c, Vector &d, BoxPlane & plane)
-{
-	plane.hx = a.x;
-	plane.hy = a.y;
-	plane.hz = a.z;
-	plane.lx = a.x;
-	plane.ly = a.y;
-	plane.lz = a.z;
+	unsigned int mid = start + count / 2;
+	bool sahSplit = false;
+
+	if (axisExtent > 0.0f && depth < _RT_BVH_MAX_DEPTH)
+	{
+		// Binned SAH: project the centroids in buckets along the axis and evaluate
+		// the cost of splitting after each bucket
+		AABB binBounds[_RT_BVH_SAH_BINS];
+		unsigned int binCount[_RT_BVH_SAH_BINS] = { 0 };
+
+		float binScale = float(_RT_BVH_SAH_BINS) * (1.0f - FLT_EPSILON) / axisExtent;
+		for (unsigned int i = start; i < end; i++)
+		{
+			unsigned int index = primitiveIndices[i];
+			unsigned int bin = (unsigned int)((vectorAxis(centroids[index], axis) - axisLowest) * binScale);
+			binCount[bin]++;
+			binBounds[bin].expand(bounds[index]);
+		}
+
+		// Sweep from the right to get the area and primitive count of every right partition
+		float rightArea[_RT_BVH_SAH_BINS];
+		unsigned int rightCount[_RT_BVH_SAH_BINS];
+		AABB accumulated;
+		unsigned int accumulatedCount = 0;
+		for (unsigned int i = _RT_BVH_SAH_BINS - 1; i > 0; i--)
+		{
+			accumulated.expand(binBounds[i]);
+			accumulatedCount += binCount[i];
+			rightArea[i] = accumulated.surfaceArea();
+			rightCount[i] = accumulatedCount;
+		}
+
+		float invNodeArea = 1.0f / nodeBounds.surfaceArea();
+		float bestCost = FLT_MAX;
+		unsigned int bestSplit = 0;
+
+		accumulated = AABB();
+		accumulatedCount = 0;
+		for (unsigned int i = 0; i < _RT_BVH_SAH_BINS - 1; i++)
+		{
+			accumulated.expand(binBounds[i]);
+			accumulatedCount += binCount[i];
+
+			if (accumulatedCount == 0 || rightCount[i + 1] == 0)
+				continue;
 
-	std::vector<Vector> rest({ b, c, d });
+			float cost = _RT_BVH_TRAVERSAL_COST + _RT_BVH_INTERSECTION_COST * invNodeArea *
+				(float(accumulatedCount) * accumulated.surfaceArea() + float(rightCount[i + 1]) * rightArea[i + 1]);
 
-	for (Vector & v : rest)
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = i;
+			}
+		}
+
+		// Splitting is not worth it, keep a (small) leaf
+		float leafCost = _RT_BVH_INTERSECTION_COST * float(count);
+		if (leafCost <= bestCost && count <= _RT_BVH_MAX_LEAF_SIZE * 4)
+		{
+			return;
+		}
+
+		unsigned int * first = &primitiveIndices[0] + start;
+		unsigned int * last = &primitiveIndices[0] + end;
+		unsigned int * midPtr = std::partition(first, last, [&](unsigned int index)
+		{
+			unsigned int bin = (unsigned int)((vectorAxis(centroids[index], axis) - axisLowest) * binScale);
+			return bin <= bestSplit;
+		});
+
+		mid = start + (unsigned int)(midPtr - first);
+		sahSplit = mid > start && mid < end;
+	}
+
+	if (!sahSplit)
 	{
-		if (v.x > plane.hx)
-			plane.hx = v.x;
-		else if (v.x < plane.lx)
-			plane.lx = v.x;
-
-		if (v.y > plane.hy)
-			plane.hy = v.y;
-		else if (v.y < plane.ly)
-			plane.ly = v.y;
-
-		if (v.z > plane.hz)
-			plane.hz = v.z;
-		else if (v.z < plane.lz)
-			plane.lz = v.z;
+		// Too deep or degenerated, fall back to an object median split
+		mid = start + count / 2;
+		std::nth_element(&primitiveIndices[0] + start, &primitiveIndices[0] + mid, &primitiveIndices[0] + end,
+			[&](unsigned int a, unsigned int b)
+		{
+			return vectorAxis(centroids[a], axis) < vectorAxis(centroids[b], axis);
+		});
 	}
-}
\ No newline at end of file
+
+	// The first child is always stored right after its parent
+	unsigned int leftChild = (unsigned int)nodes.size();
+	nodes.push_back(BVHNode());
+	buildRecursive(bounds, centroids, leftChild, start, mid, depth + 1);
+
+	unsigned int rightChild = (unsigned int)nodes.size();
+	nodes.push_back(BVHNode());
+	buildRecursive(bounds, centroids, rightChild, mid, end, depth + 1);
+
+	// nodes may have been reallocated by the children
+	nodes[nodeIndex].offset = rightChild;
+	nodes[nodeIndex].count = 0;
+	nodes[nodeIndex].axis = (unsigned short)axis;
+}
@@ -2,16 +2,95 @@
 
 #include <vector>
 #include <iostream>
+#include <float.h>
 
 #include "Utils.h"
 #include "Ray.h"
 
-struct BoxPlane {
-	Vector corner;
-	float hx, hy, hz;
-	float lx, ly, lz;
-	Vector normal;
-} typedef BoxPlane;
+inline float minValue(float a, float b) { return a < b ? a : b; }
+inline float maxValue(float a, float b) { return a > b ? a : b; }
+
+// Ray data shared by every box test of a traversal
+struct AABBRay
+{
+	float origin[3];
+	float invDirection[3];
+
+	AABBRay(const Ray & ray)
+	{
+		const Vector & o = ray.getOrigin();
+		const Vector & d = ray.getDirection();
+		origin[0] = o.x; origin[1] = o.y; origin[2] = o.z;
+		invDirection[0] = 1.0f / d.x; invDirection[1] = 1.0f / d.y; invDirection[2] = 1.0f / d.z;
+	}
+};
+
+// Axis aligned bounding box
+struct AABB
+{
+	float lowest[3];
+	float highest[3];
+
+	AABB()
+	{
+		lowest[0] = lowest[1] = lowest[2] = FLT_MAX;
+		highest[0] = highest[1] = highest[2] = -FLT_MAX;
+	}
+
+	AABB(const Vector & lowestV, const Vector & highestV)
+	{
+		lowest[0] = lowestV.x; lowest[1] = lowestV.y; lowest[2] = lowestV.z;
+		highest[0] = highestV.x; highest[1] = highestV.y; highest[2] = highestV.z;
+	}
+
+	void expand(const Vector & p)
+	{
+		lowest[0] = minValue(lowest[0], p.x); lowest[1] = minValue(lowest[1], p.y); lowest[2] = minValue(lowest[2], p.z);
+		highest[0] = maxValue(highest[0], p.x); highest[1] = maxValue(highest[1], p.y); highest[2] = maxValue(highest[2], p.z);
+	}
+
+	void expand(const AABB & box)
+	{
+		for (unsigned int a = 0; a < 3; a++)
+		{
+			lowest[a] = minValue(lowest[a], box.lowest[a]);
+			highest[a] = maxValue(highest[a], box.highest[a]);
+		}
+	}
+
+	Vector getLowest() const { return Vector(lowest[0], lowest[1], lowest[2]); }
+	Vector getHighest() const { return Vector(highest[0], highest[1], highest[2]); }
+
+	Vector centroid() const
+	{
+		return Vector((lowest[0] + highest[0]) * 0.5f, (lowest[1] + highest[1]) * 0.5f, (lowest[2] + highest[2]) * 0.5f);
+	}
+
+	float surfaceArea() const
+	{
+		float dx = highest[0] - lowest[0];
+		float dy = highest[1] - lowest[1];
+		float dz = highest[2] - lowest[2];
+		return 2.0f * (dx * dy + dy * dz + dz * dx);
+	}
+
+	// Slab test. Returns whether the ray overlaps the box inside [0, tMax],
+	// and the entry / exit distances (clamped to that interval)
+	bool testIntersect(const AABBRay & ray, float tMax, float & tEntry, float & tExit) const
+	{
+		float tx0 = (lowest[0] - ray.origin[0]) * ray.invDirection[0];
+		float tx1 = (highest[0] - ray.origin[0]) * ray.invDirection[0];
+		float ty0 = (lowest[1] - ray.origin[1]) * ray.invDirection[1];
+		float ty1 = (highest[1] - ray.origin[1]) * ray.invDirection[1];
+		float tz0 = (lowest[2] - ray.origin[2]) * ray.invDirection[2];
+		float tz1 = (highest[2] - ray.origin[2]) * ray.invDirection[2];
+
+		tEntry = maxValue(maxValue(minValue(tx0, tx1), minValue(ty0, ty1)), maxValue(minValue(tz0, tz1), 0.0f));
+		tExit = minValue(minValue(maxValue(tx0, tx1), maxValue(ty0, ty1)), minValue(maxValue(tz0, tz1), tMax));
+
+		return tEntry <= tExit;
+	}
+};
 
 class BoundingVolume
 {
@@ -94,7 +173,7 @@ public:
 class BoundingBox : public BoundingVolume
 {
 private:
-	std::vector<BoxPlane> planes;
+	AABB box;
 public:
 	BoundingBox() : BoundingVolume() {
 
@@ -102,56 +181,127 @@ public:
 
 	void setCorners(Vector highestV, Vector lowestV)
 	{
-		planes.reserve(6);
-		buildPlanes(highestV, lowestV);
-		parent = new BoundingSphere();
-		parent->setCorners(highestV, lowestV);
+		box = AABB(lowestV, highestV);
 	}
 
 	bool testIntersect(const Ray & ray)
 	{
-		if (!parent->testIntersect(ray))
+		float tEntry, tExit;
+		return box.testIntersect(AABBRay(ray), FLT_MAX, tEntry, tExit);
+	}
+};
+
+// =====================================================================================================
+// Bounding volume hierarchy
+
+struct BVHNode
+{
+	AABB bounds;
+	unsigned int offset;	// Leaf: first entry in the primitive index list. Interior: index of the second child
+	unsigned short count;	// Number of primitives in a leaf, 0 for interior nodes
+	unsigned short axis;	// Split axis, used to visit the children front to back
+} typedef BVHNode;
+
+/*
+BVH Class - Binary hierarchy of axis aligned boxes built with the surface area heuristic
+
+Works over primitive indices only, so the owner keeps its own primitive storage and
+performs the actual primitive test on the traverse() callback
+*/
+class BVH
+{
+private:
+	std::vector<BVHNode> nodes;
+	std::vector<unsigned int> primitiveIndices;
+
+public:
+	BVH() {}
+
+	void build(const std::vector<AABB> & primitiveBounds);
+	bool isEmpty() const { return nodes.empty(); }
+	unsigned int getNumNodes() const { return (unsigned int)nodes.size(); }
+	size_t getMemoryUsage() const { return nodes.capacity() * sizeof(BVHNode) + primitiveIndices.capacity() * sizeof(unsigned int); }
+
+	// Visits the leaves hit by the ray in front to back order. For every primitive in a visited leaf,
+	// test(primitiveIndex, ray) is called, which must return true and shrink the ray tMax on a closer hit.
+	// Nodes farther than the ray tMax are skipped
+	template<class PrimitiveTest>
+	bool traverse(Ray & ray, PrimitiveTest & test) const
+	{
+		return visit<false>(ray, test);
+	}
+
+	// Any hit query over the segment (tMin, maxDistance). test(primitiveIndex, segment) returns whether
+	// the primitive blocks the segment, and the traversal stops at the first one that does
+	template<class OcclusionTest>
+	bool occluded(const Ray & ray, float maxDistance, OcclusionTest & test) const
+	{
+		Ray segment(ray);
+		segment.setTMax(maxDistance);
+		return visit<true>(segment, test);
+	}
+
+private:
+	void buildRecursive(const std::vector<AABB> & bounds, const std::vector<Vector> & centroids, unsigned int nodeIndex, unsigned int start, unsigned int end, unsigned int depth);
+
+	template<bool AnyHit, class PrimitiveTest>
+	bool visit(Ray & ray, PrimitiveTest & test) const
+	{
+		if (nodes.empty())
 		{
 			return false;
 		}
 
-		Vector o = ray.getOrigin();
-		Vector d = ray.getDirection();
-		for (BoxPlane & plane : planes)
-		{
-			Vector n = plane.normal;
-			float dotNR;
+		AABBRay boxRay(ray);
+		bool dirIsNegative[3] = { boxRay.invDirection[0] < 0.0f, boxRay.invDirection[1] < 0.0f, boxRay.invDirection[2] < 0.0f };
+		float tEntry, tExit;
 
-			if ((dotNR = n.Dot(d)) != 0.0f)
+		bool hit = false;
+		unsigned int stack[128];
+		unsigned int stackSize = 0;
+		unsigned int current = 0;
+
+		while (true)
+		{
+			const BVHNode & node = nodes[current];
+			_RT_COUNT_STAT(nodeTests);
+			if (node.bounds.testIntersect(boxRay, ray.getTMax(), tEntry, tExit))
 			{
-				float nc = n.Dot(o);
-				float np = n.Dot(plane.corner);
-				float planeIntersectResult = -(nc - np) / dotNR;
-				if (planeIntersectResult > 0.0f)
+				if (node.count > 0)
 				{
-					Vector hittedPoint = o + (d * planeIntersectResult);
-					float x = hittedPoint.x + _RT_BIAS;
-					float y = hittedPoint.y + _RT_BIAS;
-					float z = hittedPoint.z + _RT_BIAS;
-
-					float minx = hittedPoint.x - _RT_BIAS;
-					float miny = hittedPoint.y - _RT_BIAS;
-					float minz = hittedPoint.z - _RT_BIAS;
-					
-					if (x >= plane.lx && minx <= plane.hx
-						&& y >= plane.ly && miny <= plane.hy
-						&& z >= plane.lz && minz <= plane.hz)
+					for (unsigned int i = 0; i < node.count; i++)
 					{
-						return true;
+						if (test(primitiveIndices[node.offset + i], ray))
+						{
+							if (AnyHit)
+								return true;
+							hit = true;
+						}
 					}
+
+					if (stackSize == 0)
+						break;
+					current = stack[--stackSize];
+				}
+				else if (dirIsNegative[node.axis])
+				{
+					stack[stackSize++] = current + 1;
+					current = node.offset;
+				}
+				else
+				{
+					stack[stackSize++] = node.offset;
+					current = current + 1;
 				}
 			}
+			else
+			{
+				if (stackSize == 0)
+					break;
+				current = stack[--stackSize];
+			}
 		}
 
-		return false;
+		return hit;
 	}
-
-private:
-	void buildPlanes(Vector &highestV, Vector &lowestV);
-	void findHighestLowestValues(Vector &a, Vector &b, Vector &c, Vector &d, BoxPlane & plane);
-};
\ No newline at end of file
+};
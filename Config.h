@@ -2,30 +2,57 @@
 
 //#define _RT_DEBUG
 #define _RT_MEASURE_PERFORMANCE
+//#define _RT_COUNT_INTERSECTIONS // Count BVH node and primitive tests (slows down rendering)
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+// Sample counts, bounces, bias, threads and tiles below are the defaults of RenderSettings, which scene files
+// and the command line can change
 #define _RT_SUPERSAMPLING_SAMPLES 100
 
-#define _RT_RAND_PRECISSION 10000
-
-#define _RT_PROCESS_PER_PIXEL // Somehow is faster than processing batches of pixels O_o
-
 #define _RT_USE_MULTITHREAD
-#ifndef _RT_PROCESS_PER_PIXEL
-#define _RT_PROCESS_PIXEL_BATCH_SIZE_X 4
-#define _RT_PROCESS_PIXEL_BATCH_SIZE_Y 4
-#endif
+#define _RT_THREAD_COUNT 0 // 0 for one per hardware thread
+#define _RT_TILE_SIZE 16 // The image is split in square tiles of this many pixels per side, rendered by one task each
 
 #define _RT_MAX_BOUNCES 4
 #define _RT_RUSSIAN_ROULETE_MIN_BOUNCE 3
 #define _RT_RUSSIAN_ROULETE_MIN_DIELECTRIC_BOUNCE 4
+#define _RT_RUSSIAN_ROULETE_MAX_SURVIVAL 0.95f // Bounds the length of paths between bright diffuse surfaces
 
 #define _RT_PATHTRACER_PIXEL_SAMPLES 200
 #define _RT_PATHTRACER_BOUNCES 1000
 #define _RT_PATHTRACER_RR_BOUNCES 6
 #define _RT_PATHTRACER_RR_REFLEX_TRANSMISSION_BOUNCES 2
+#define _RT_PATHTRACER_DIMENSIONS_PER_BOUNCE 8 // Sampler dimensions reserved for the random decisions of a bounce
+#define _RT_PATHTRACER_NEXT_EVENT_ESTIMATION // Sample a light at every diffuse vertex, weighted against BSDF sampling with MIS
+#define _RT_WAVEFRONT_BATCH_SIZE 4096 // Camera samples of a tile the wavefront path tracer traces together, when it takes them all at once
+
+// Adaptive sampling for the path tracer and the supersampling ray tracer: from the variance of a few pilot
+// samples, every pixel takes as many as it needs for the standard error of its luminance to fall below the
+// threshold (relative to the luminance itself). Path tracing takes up to _RT_ADAPTIVE_MAX_SAMPLES instead
+// of _RT_PATHTRACER_PIXEL_SAMPLES, supersampling keeps _RT_SUPERSAMPLING_SAMPLES as the maximum
+// It pays off in scenes with rare bright paths (many small lights, dark regions lit by a few of them);
+// where the noise is already even, it mostly trades a lower average error for less noisy worst pixels
+//#define _RT_ADAPTIVE_SAMPLING
+#define _RT_ADAPTIVE_PILOT_SAMPLES 16 // Only estimate the variance, they are not part of the image
+#define _RT_ADAPTIVE_MIN_SAMPLES 16
+#define _RT_ADAPTIVE_MAX_SAMPLES 1024
+#define _RT_ADAPTIVE_BATCH_SAMPLES 16 // Sample counts are rounded up to a multiple of this
+#define _RT_ADAPTIVE_TILE_SIZE 8 // Pixels are never given less samples than the error of their tile asks for
+#define _RT_ADAPTIVE_ERROR_THRESHOLD 0.08f
+
+// Progressive rendering for the path tracer and the supersampling ray tracer: the image is rendered in passes
+// of one sample per pixel, accumulated as they end, so it can be shown while it converges. Rendering stops after
+// the samples per pixel of the tracer (or _RT_PROGRESSIVE_MAX_SAMPLES), or before a pass that would end past the
+// time budget. With the same number of samples, the image is the same as the one of a render in a single pass
+#define _RT_PROGRESSIVE_RENDERING
+#define _RT_PROGRESSIVE_MAX_SAMPLES 0 // 0 to take the samples per pixel of the tracer
+#define _RT_PROGRESSIVE_TIME_BUDGET_MS 0 // 0 for no time limit
+
+#ifdef _RT_ADAPTIVE_SAMPLING
+#undef _RT_PROGRESSIVE_RENDERING // Adaptive renders choose the samples of every pixel before taking them
+#endif
 
 #define _RT_BIAS 0.001f
 
@@ -40,3 +67,9 @@
 #define _RT_MC_BOUNCES_SAMPLES 4
 
 #define _RT_USE_BB
+
+// Per model bounding volume hierarchy over its triangles (SAH built at load time)
+#define _RT_USE_BVH
+
+// Hierarchy over the lights, to choose them by their estimated contribution instead of uniformly
+#define _RT_USE_LIGHT_BVH
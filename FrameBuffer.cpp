@@ -0,0 +1,43 @@
+#include "FrameBuffer.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+void FrameBuffer::resize(unsigned int newWidth, unsigned int newHeight)
+{
+	unsigned int newStride = (newWidth + PIXELS_PER_CACHE_LINE - 1) / PIXELS_PER_CACHE_LINE * PIXELS_PER_CACHE_LINE;
+	if (pixels == NULL || newWidth != width || newHeight != height)
+	{
+		release();
+
+		// malloc only promises the alignment of the basic types, so the pixels start at the first cache line inside
+		size_t size = size_t(newStride) * newHeight * CHANNELS * sizeof(float);
+		allocation = malloc(size + CACHE_LINE_SIZE - 1);
+		uintptr_t address = reinterpret_cast<uintptr_t>(allocation);
+		pixels = reinterpret_cast<float *>((address + CACHE_LINE_SIZE - 1) & ~uintptr_t(CACHE_LINE_SIZE - 1));
+
+		width = newWidth;
+		height = newHeight;
+		stride = newStride;
+	}
+
+	for (unsigned int y = 0; y < height; y++)
+	{
+		float * row = getRow(y);
+		for (unsigned int x = 0; x < stride; x++)
+		{
+			row[x * CHANNELS + 0] = 0.0f;
+			row[x * CHANNELS + 1] = 0.0f;
+			row[x * CHANNELS + 2] = 0.0f;
+			row[x * CHANNELS + 3] = 1.0f;
+		}
+	}
+}
+
+void FrameBuffer::release()
+{
+	free(allocation);
+	allocation = NULL;
+	pixels = NULL;
+	width = height = stride = 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+FrameBuffer Class - RGBA float image in a single cache aligned allocation
+
+Rows go from the bottom one up, as OpenGL draws them, and every row is padded to a whole number of
+cache lines. Tiles as wide as a multiple of PIXELS_PER_CACHE_LINE never share a cache line, so their
+workers write them without locks. The window and the image writers read the pixels in place
+*/
+class FrameBuffer
+{
+public:
+	static const unsigned int CHANNELS = 4;
+	static const unsigned int CACHE_LINE_SIZE = 64;
+	static const unsigned int PIXELS_PER_CACHE_LINE = CACHE_LINE_SIZE / (CHANNELS * sizeof(float));
+
+private:
+	void * allocation;
+	float * pixels;			// Aligned to a cache line inside the allocation
+	unsigned int width, height;
+	unsigned int stride;	// Pixels from a row to the next
+
+public:
+	FrameBuffer() :allocation(NULL), pixels(NULL), width(0), height(0), stride(0) {}
+	~FrameBuffer() { release(); }
+
+	FrameBuffer(const FrameBuffer &) = delete;
+	FrameBuffer & operator = (const FrameBuffer &) = delete;
+
+	// Reallocates the buffer if the size changes. Every pixel is cleared to opaque black
+	void resize(unsigned int newWidth, unsigned int newHeight);
+	void release();
+
+	bool isEmpty() const { return pixels == NULL; }
+	unsigned int getWidth() const { return width; }
+	unsigned int getHeight() const { return height; }
+	unsigned int getStride() const { return stride; }
+
+	const float * getRow(unsigned int y) const { return &pixels[y * stride * CHANNELS]; }
+	float * getRow(unsigned int y) { return &pixels[y * stride * CHANNELS]; }
+
+	void setPixel(unsigned int x, unsigned int y, const Vector & color)
+	{
+		float * pixel = &pixels[(y * stride + x) * CHANNELS];
+		pixel[0] = color.x;
+		pixel[1] = color.y;
+		pixel[2] = color.z;
+		pixel[3] = 1.0f;
+	}
+
+	Vector getPixel(unsigned int x, unsigned int y) const
+	{
+		const float * pixel = &pixels[(y * stride + x) * CHANNELS];
+		return Vector(pixel[0], pixel[1], pixel[2]);
+	}
+};
@@ -0,0 +1,330 @@
+#include "LightBVH.h"
+
+#include <algorithm>
+
+// =================================================================================
+
+// Largest float below 1
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+static float vectorAxis(const Vector & v, unsigned int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of both angles
+static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+	return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+
+static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+	return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+static float safeAcos(float value)
+{
+	return acosf(clampValue(value, -1.0f, 1.0f));
+}
+
+DirectionCone DirectionCone::Union(const DirectionCone & a, const DirectionCone & b)
+{
+	if (a.cosTheta <= -1.0f || b.cosTheta <= -1.0f)
+	{
+		return EntireSphere();
+	}
+
+	// Two sided, so b can be taken around whichever of its axes is closer to the one of a
+	Vector aAxis = a.axis;
+	Vector bAxis = b.axis;
+	if (aAxis.Dot(bAxis) < 0.0f)
+	{
+		bAxis = bAxis * -1.0f;
+	}
+
+	float thetaA = safeAcos(a.cosTheta);
+	float thetaB = safeAcos(b.cosTheta);
+	float thetaD = safeAcos(aAxis.Dot(bAxis));
+	if (minValue(thetaD + thetaB, float(M_PI)) <= thetaA)
+	{
+		return a;
+	}
+	if (minValue(thetaD + thetaA, float(M_PI)) <= thetaB)
+	{
+		return DirectionCone(bAxis, b.cosTheta);
+	}
+
+	// A two sided cone wider than a hemisphere holds every direction
+	float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+	if (thetaO >= float(M_PI) * 0.5f)
+	{
+		return EntireSphere();
+	}
+
+	// Rotate the axis of a towards the one of b, around their common perpendicular
+	Vector rotationAxis = aAxis.Cross(bAxis);
+	if (rotationAxis.Dot(rotationAxis) == 0.0f)
+	{
+		return EntireSphere();
+	}
+	rotationAxis.Normalize();
+
+	float thetaR = thetaO - thetaA;
+	Vector axis = aAxis * cosf(thetaR) + rotationAxis.Cross(aAxis) * sinf(thetaR);
+	return DirectionCone(axis.Normalize(), cosf(thetaO));
+}
+
+LightBounds LightBounds::Union(const LightBounds & a, const LightBounds & b)
+{
+	if (a.power <= 0.0f)
+	{
+		return b;
+	}
+	if (b.power <= 0.0f)
+	{
+		return a;
+	}
+
+	LightBounds result = a;
+	result.bounds.expand(b.bounds);
+	result.normals = DirectionCone::Union(a.normals, b.normals);
+	result.power += b.power;
+	return result;
+}
+
+// =================================================================================
+
+void LightBVH::LightNode::setBounds(const LightBounds & lightBounds)
+{
+	center = lightBounds.bounds.centroid();
+	radius = 0.5f * (lightBounds.bounds.getHighest() - lightBounds.bounds.getLowest()).Magnitude();
+	normals = lightBounds.normals;
+	power = lightBounds.power;
+}
+
+float LightBVH::LightNode::importance(const Vector & point, const Vector & normal) const
+{
+	if (power <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	// The lights are seen as their bounding sphere
+	Vector fromCenter = point;
+	fromCenter = fromCenter - center;
+	float squaredDistance = fromCenter.Dot(fromCenter);
+	float squaredRadius = radius * radius;
+
+	// Close enough, there is no useful bound on the angles
+	if (squaredDistance <= squaredRadius)
+	{
+		return squaredRadius > 0.0f ? power / squaredRadius : power;
+	}
+
+	float distance = sqrtf(squaredDistance);
+	float sinThetaB = radius / distance;
+	float cosThetaB = sqrtf(1.0f - sinThetaB * sinThetaB);
+
+	// Angle between the light normals and the point, reduced by the spread of the normals and
+	// by the sphere size. Emission is two sided and Lambertian
+	float cosThetaW = fabsf(normals.axis.Dot(fromCenter)) / distance;
+	float sinThetaW = sqrtf(maxValue(0.0f, 1.0f - cosThetaW * cosThetaW));
+	float cosThetaO = normals.cosTheta;
+	float sinThetaO = sqrtf(maxValue(0.0f, 1.0f - cosThetaO * cosThetaO));
+	float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+	float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+	float cosEmission = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+	if (cosEmission <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	// Same for the surface normal at the point, towards the lights
+	float cosReception = 1.0f;
+	if (normal.Dot(normal) > 0.0f)
+	{
+		float cosThetaI = -normal.Dot(fromCenter) / distance;
+		float sinThetaI = sqrtf(maxValue(0.0f, 1.0f - cosThetaI * cosThetaI));
+		cosReception = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+		if (cosReception <= 0.0f)
+		{
+			return 0.0f;
+		}
+	}
+
+	return power * cosEmission * cosReception / squaredDistance;
+}
+
+// =================================================================================
+
+void LightBVH::build(const std::vector<LightBounds> & lights)
+{
+	nodes.clear();
+	bitTrails.assign(lights.size(), 0);
+
+	std::vector<unsigned int> indices;
+	for (unsigned int i = 0; i < lights.size(); i++)
+	{
+		if (lights[i].power > 0.0f)
+		{
+			indices.push_back(i);
+		}
+	}
+
+	if (indices.empty())
+	{
+		return;
+	}
+
+	nodes.reserve(indices.size() * 2);
+	nodes.push_back(LightNode());
+	buildRecursive(lights, indices, 0, 0, (unsigned int)indices.size(), 0, 0);
+}
+
+LightBounds LightBVH::buildRecursive(const std::vector<LightBounds> & lights, std::vector<unsigned int> & indices, unsigned int nodeIndex, unsigned int start, unsigned int end, uint64_t bitTrail, unsigned int depth)
+{
+	if (end - start == 1)
+	{
+		LightNode & leaf = nodes[nodeIndex];
+		leaf.setBounds(lights[indices[start]]);
+		leaf.offset = indices[start];
+		leaf.isLeaf = true;
+		bitTrails[indices[start]] = bitTrail;
+		return lights[indices[start]];
+	}
+
+	// Object median along the widest centroid extent. Keeps the tree balanced, so the
+	// trail of any light fits in 64 bits
+	AABB centroidBounds;
+	for (unsigned int i = start; i < end; i++)
+	{
+		centroidBounds.expand(lights[indices[i]].bounds.centroid());
+	}
+
+	unsigned int axis = 0;
+	float axisExtent = centroidBounds.highest[0] - centroidBounds.lowest[0];
+	for (unsigned int a = 1; a < 3; a++)
+	{
+		float extent = centroidBounds.highest[a] - centroidBounds.lowest[a];
+		if (extent > axisExtent)
+		{
+			axis = a;
+			axisExtent = extent;
+		}
+	}
+
+	unsigned int mid = start + (end - start) / 2;
+	std::nth_element(&indices[0] + start, &indices[0] + mid, &indices[0] + end,
+		[&](unsigned int a, unsigned int b)
+	{
+		return vectorAxis(lights[a].bounds.centroid(), axis) < vectorAxis(lights[b].bounds.centroid(), axis);
+	});
+
+	// The first child is always stored right after its parent
+	unsigned int leftChild = (unsigned int)nodes.size();
+	nodes.push_back(LightNode());
+	LightBounds leftBounds = buildRecursive(lights, indices, leftChild, start, mid, bitTrail, depth + 1);
+
+	unsigned int rightChild = (unsigned int)nodes.size();
+	nodes.push_back(LightNode());
+	LightBounds rightBounds = buildRecursive(lights, indices, rightChild, mid, end, bitTrail | (uint64_t(1) << depth), depth + 1);
+
+	// nodes may have been reallocated by the children
+	LightBounds nodeBounds = LightBounds::Union(leftBounds, rightBounds);
+	LightNode & node = nodes[nodeIndex];
+	node.setBounds(nodeBounds);
+	node.offset = rightChild;
+	node.isLeaf = false;
+	return nodeBounds;
+}
+
+bool LightBVH::sample(const Vector & point, const Vector & normal, float u, unsigned int & light, float & pmf) const
+{
+	if (nodes.empty())
+	{
+		return false;
+	}
+
+	pmf = 1.0f;
+	unsigned int current = 0;
+	while (!nodes[current].isLeaf)
+	{
+		float leftImportance = nodes[current + 1].importance(point, normal);
+		float rightImportance = nodes[nodes[current].offset].importance(point, normal);
+		if (leftImportance + rightImportance <= 0.0f)
+		{
+			return false;
+		}
+
+		// Choose a child and rescale u to [0, 1) inside the chosen interval, so it can be used again below
+		float leftProbability = leftImportance / (leftImportance + rightImportance);
+		if (u < leftProbability)
+		{
+			current = current + 1;
+			pmf *= leftProbability;
+			u = u / leftProbability;
+		}
+		else
+		{
+			current = nodes[current].offset;
+			pmf *= 1.0f - leftProbability;
+			u = (u - leftProbability) / (1.0f - leftProbability);
+		}
+		u = u < ONE_MINUS_EPSILON ? u : ONE_MINUS_EPSILON;
+	}
+
+	// A single light is the root itself, and has not been checked yet
+	if (current == 0 && nodes[0].importance(point, normal) <= 0.0f)
+	{
+		return false;
+	}
+
+	light = nodes[current].offset;
+	return true;
+}
+
+float LightBVH::pmf(const Vector & point, const Vector & normal, unsigned int light) const
+{
+	if (nodes.empty() || light >= bitTrails.size())
+	{
+		return 0.0f;
+	}
+
+	uint64_t bitTrail = bitTrails[light];
+	float pmf = 1.0f;
+	unsigned int current = 0;
+	while (!nodes[current].isLeaf)
+	{
+		float leftImportance = nodes[current + 1].importance(point, normal);
+		float rightImportance = nodes[nodes[current].offset].importance(point, normal);
+		if (leftImportance + rightImportance <= 0.0f)
+		{
+			return 0.0f;
+		}
+
+		if (bitTrail & 1)
+		{
+			current = nodes[current].offset;
+			pmf *= rightImportance / (leftImportance + rightImportance);
+		}
+		else
+		{
+			current = current + 1;
+			pmf *= leftImportance / (leftImportance + rightImportance);
+		}
+		bitTrail >>= 1;
+	}
+
+	// Lights without power are not in the tree, so their trail ends somewhere else
+	if (nodes[current].offset != light)
+	{
+		return 0.0f;
+	}
+
+	if (current == 0 && nodes[0].importance(point, normal) <= 0.0f)
+	{
+		return 0.0f;
+	}
+	return pmf;
+}
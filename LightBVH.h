@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "Utils.h"
+#include "BVH.h"
+
+// Cone of directions around an axis. Emitters are two sided, so a cone also holds the opposite directions
+struct DirectionCone
+{
+	Vector axis;
+	float cosTheta;		// Cosine of the half angle. -1 for every direction
+
+	DirectionCone() :axis(0.0f, 1.0f, 0.0f), cosTheta(-1.0f) {}
+	DirectionCone(const Vector & axis, float cosTheta) :axis(axis), cosTheta(cosTheta) {}
+
+	static DirectionCone EntireSphere() { return DirectionCone(); }
+
+	// Smallest cone holding both cones (and their opposite directions)
+	static DirectionCone Union(const DirectionCone & a, const DirectionCone & b);
+};
+
+// Extent, surface orientation and emitted power of a light, or of a group of lights
+struct LightBounds
+{
+	AABB bounds;
+	DirectionCone normals;	// Normals of the emitting surfaces
+	float power;
+
+	LightBounds() :power(0.0f) {}
+	LightBounds(const AABB & bounds, const DirectionCone & normals, float power) :bounds(bounds), normals(normals), power(power) {}
+
+	static LightBounds Union(const LightBounds & a, const LightBounds & b);
+};
+
+/*
+LightBVH Class - Binary hierarchy over the scene lights, used to choose lights by their estimated contribution
+
+Every node bounds the position and surface normals of the lights below it and sums their power.
+A light is chosen walking down from the root, taking each child with probability proportional to
+its importance for the shading point: power over squared distance, scaled by conservative bounds
+of the cosines at the light (Lambertian emission) and at the shading point. The cost depends on the
+tree depth instead of the number of lights, and lights that can't reach the point are never chosen
+*/
+class LightBVH
+{
+private:
+	struct LightNode
+	{
+		Vector center;			// Bounding sphere of the node lights
+		float radius;
+		DirectionCone normals;
+		float power;
+		unsigned int offset;	// Leaf: index of the light. Interior: index of the second child
+		bool isLeaf;
+
+		void setBounds(const LightBounds & lightBounds);
+
+		// Upper bound (up to a constant) of the light reaching a point. With a non zero normal,
+		// lights that are entirely behind the surface get no importance
+		float importance(const Vector & point, const Vector & normal) const;
+	};
+
+	std::vector<LightNode> nodes;
+	std::vector<uint64_t> bitTrails;	// Per light, the child taken at every level down to its leaf (lowest bit first)
+
+public:
+	LightBVH() {}
+
+	// Lights without power are left out, and never chosen
+	void build(const std::vector<LightBounds> & lights);
+	bool isEmpty() const { return nodes.empty(); }
+
+	// Chooses a light for the point from one uniform number in [0, 1), giving the probability of choosing it.
+	// Returns false if no light can reach the point
+	bool sample(const Vector & point, const Vector & normal, float u, unsigned int & light, float & pmf) const;
+
+	// Probability of sample choosing the given light for the point
+	float pmf(const Vector & point, const Vector & normal, unsigned int light) const;
+
+private:
+	LightBounds buildRecursive(const std::vector<LightBounds> & lights, std::vector<unsigned int> & indices, unsigned int nodeIndex, unsigned int start, unsigned int end, uint64_t bitTrail, unsigned int depth);
+};
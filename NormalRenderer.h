@@ -107,7 +107,7 @@ public:
 			Camera sceneCam = m_pScene->GetCamera ();
 			glMatrixMode(GL_PROJECTION);
 			glLoadIdentity();
-			gluPerspective (sceneCam.GetFOV (), (GLdouble)Scene::WINDOW_WIDTH/Scene::WINDOW_HEIGHT, sceneCam.GetNearClip (), sceneCam.GetFarClip ());
+			gluPerspective (sceneCam.GetFOV (), (GLdouble)m_pScene->GetSettings ().width/m_pScene->GetSettings ().height, sceneCam.GetNearClip (), sceneCam.GetFarClip ());
 			glMatrixMode(GL_MODELVIEW);
 			glLoadIdentity();
 
@@ -193,7 +193,7 @@ public:
 					glScalef (((SceneModel *)sceneObj)->scale.x, ((SceneModel *)sceneObj)->scale.y, ((SceneModel *)sceneObj)->scale.z);
 		
 					// Set the Material (For a model, the material is uniform throughout all triangles
-					SceneMaterial *sceneMat = ((SceneModel *)sceneObj)->GetTriangle(0)->material[0]; // m_pScene->GetMaterial(((SceneModel *)sceneObj)->GetTriangle(0)->material[0]);
+					SceneMaterial *sceneMat = ((SceneModel *)sceneObj)->material;
 					glColor3fv ((GLfloat *)&sceneMat->diffuse);
 					glMaterialfv (GL_FRONT_AND_BACK, GL_SPECULAR, (GLfloat *)&sceneMat->specular);
 					glMaterialf(GL_FRONT, GL_SHININESS, sceneMat->shininess);
@@ -201,22 +201,30 @@ public:
 					// Draw the Model
 					glBegin (GL_TRIANGLES);
 
-					unsigned int numTris = ((SceneModel *)sceneObj)->GetNumTriangles ();
+					const TriangleMesh & mesh = ((SceneModel *)sceneObj)->GetMesh ();
+					unsigned int numTris = mesh.GetNumTriangles ();
 					for (unsigned int n = 0; n < numTris; n++)
 					{
-						SceneTriangle *sceneTri = ((SceneModel *)sceneObj)->GetTriangle (n);
-
-						glTexCoord2f (sceneTri->u[0], sceneTri->v[0]);
-						glNormal3f (sceneTri->normal[0].x, sceneTri->normal[0].y, sceneTri->normal[0].z);
-						glVertex3f (sceneTri->vertex[0].x, sceneTri->vertex[0].y, sceneTri->vertex[0].z);
-
-						glTexCoord2f (sceneTri->u[1], sceneTri->v[1]);
-						glNormal3f (sceneTri->normal[1].x, sceneTri->normal[1].y, sceneTri->normal[1].z);
-						glVertex3f (sceneTri->vertex[1].x, sceneTri->vertex[1].y, sceneTri->vertex[1].z);
-
-						glTexCoord2f (sceneTri->u[2], sceneTri->v[2]);
-						glNormal3f (sceneTri->normal[2].x, sceneTri->normal[2].y, sceneTri->normal[2].z);
-						glVertex3f (sceneTri->vertex[2].x, sceneTri->vertex[2].y, sceneTri->vertex[2].z);
+						// Flat shaded meshes have no normals
+						Vector faceNormal;
+						if (mesh.normals.empty ())
+						{
+							faceNormal = mesh.interpolateNormal (n, 0.0f, 0.0f);
+						}
+
+						for (unsigned int corner = 0; corner < 3; corner++)
+						{
+							unsigned int vertexIndex = mesh.indices[n * 3 + corner];
+							const Vector & vertex = mesh.positions[vertexIndex];
+							const Vector & normal = mesh.normals.empty () ? faceNormal : mesh.normals[vertexIndex];
+
+							if (!mesh.texCoords.empty ())
+							{
+								glTexCoord2f (mesh.texCoords[vertexIndex].u, mesh.texCoords[vertexIndex].v);
+							}
+							glNormal3f (normal.x, normal.y, normal.z);
+							glVertex3f (vertex.x, vertex.y, vertex.z);
+						}
 					}
 
 					glEnd ();
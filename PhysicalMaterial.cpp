@@ -1,4 +1,4 @@
-#include "PhysicalMaterial.h"
+﻿#include "PhysicalMaterial.h"
 
 #include "Config.h"
 #include <algorithm>
@@ -17,49 +17,51 @@ Vector MatteMaterial::computeDiffuseRadiance(HitInfo & hitInfo)
 	return hitInfo.hittedMaterial.diffuse / float(M_PI);
 }
 
-bool MatteMaterial::sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf)
+bool MatteMaterial::sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf, PathSampler & sampler)
 {
 	Vector zVector = hitInfo.hitNormal;
 	Vector yVector, xVector;
 	ComputeOrthoNormalBasis(zVector, yVector, xVector);
 
-	Vector sample = sampler.sampleHemiSphere();
+	// Cosine weighted direction, the local y axis is the normal
+	Vector sample = sampler.sampleCosineHemiSphere();
 	Vector scatteredDir = WorldUniformHemiSample(sample, zVector, yVector, xVector).Normalize();
+	float cosTheta = sample.y;
 
-	scatteredRay = Ray(hitInfo.hitPoint + scatteredDir * _RT_BIAS, scatteredDir, hitInfo.inRay.getDepth() + 1);
-	scatteredRay.setWeight(fabs(zVector.Dot(scatteredDir)));
-	// cosine weight hemisphere PDF = cos / PI
-	// diffuse-diffuse sampling PDF = 1 / 2*PI
-	// since rendering equation has cos, both terms cancel
+	scatteredRay = Ray(hitInfo.hitPoint + scatteredDir * hitInfo.rayBias, scatteredDir, hitInfo.inRay.getDepth() + 1);
 
-	// OPTIMIZATION: Cancel PI term with diffuse reflectance term
-	pdf = 1.0f / (2.0f * float(M_PI));
-	result = computeDiffuseRadiance(hitInfo);
-	return true;
+	// The path keeps diffuse / PI * cos / pdf = diffuse of its energy, so it survives the
+	// russian roulette with the albedo as probability
+	const Vector & albedo = hitInfo.hittedMaterial.diffuse;
+	float maxAlbedo = albedo.x > albedo.y ? (albedo.x > albedo.z ? albedo.x : albedo.z) : (albedo.y > albedo.z ? albedo.y : albedo.z);
+	scatteredRay.setWeight(clampValue(maxAlbedo, 0.0f, hitInfo.maxSurvival));
+
+	// Result is BRDF * cos, so result / pdf is just the diffuse reflectance
+	pdf = cosTheta / float(M_PI);
+	result = computeDiffuseRadiance(hitInfo) * cosTheta;
+	scatteredRay.setScatterPdf(pdf, hitInfo.hitNormal);
+	return pdf > 0.0f;
 }
 
-void MatteMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult)
+void MatteMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler)
 {
-	Vector zVector = hitInfo.hitNormal;
-	Vector yVector, xVector;
-	ComputeOrthoNormalBasis(zVector, yVector, xVector);
-
-	Vector sample = sampler.sampleHemiSphere();
-	Vector scatteredDir = WorldUniformHemiSample(sample, zVector, yVector, xVector).Normalize();
-
-	reflectRay = Ray(hitInfo.hitPoint + scatteredDir * _RT_BIAS, scatteredDir, hitInfo.inRay.getDepth() + 1);
-	reflectRay.setWeight(fabs(zVector.Dot(scatteredDir)));
-	// cosine weight hemisphere PDF = cos / PI
-	// diffuse-diffuse sampling PDF = 1 / 2*PI
-	// since rendering equation has cos, both terms cancel
-
-	// OPTIMIZATION: Cancel PI term with diffuse reflectance term
-	RPdf = 1.0f / (2.0f * float(M_PI));
-	Rresult = computeDiffuseRadiance(hitInfo);
+	sampleDiffuseRadiance(hitInfo, reflectRay, Rresult, RPdf, sampler);
 	kr = 1.0f;
 	kt = 0.0f;
 }
 
+Vector MatteMaterial::evaluateBSDF(HitInfo & hitInfo, Vector & dir)
+{
+	float cosTheta = hitInfo.hitNormal.Dot(dir);
+	return cosTheta > 0.0f ? computeDiffuseRadiance(hitInfo) * cosTheta : Vector();
+}
+
+float MatteMaterial::evaluatePdf(HitInfo & hitInfo, Vector & dir)
+{
+	float cosTheta = hitInfo.hitNormal.Dot(dir);
+	return cosTheta > 0.0f ? cosTheta / float(M_PI) : 0.0f;
+}
+
 // ======================================================================================
 
 void MetallicMaterial::scatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, Ray &refractRay, float &kt)
@@ -68,7 +70,7 @@ void MetallicMaterial::scatterReflexionAndRefraction(HitInfo & hitInfo, Ray & re
 	kr = 1.0f;
 	Vector invRayDir(hitInfo.inRay.getDirection());
 	Vector reflectedDir = invRayDir.reflect(hitInfo.hitNormal);
-	reflectRay = Ray(hitInfo.hitPoint + reflectedDir * _RT_BIAS, reflectedDir, hitInfo.inRay.getDepth() + 1);
+	reflectRay = Ray(hitInfo.hitPoint + reflectedDir * hitInfo.rayBias, reflectedDir, hitInfo.inRay.getDepth() + 1);
 }
 
 void MetallicMaterial::sampleScatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf)
@@ -77,19 +79,19 @@ void MetallicMaterial::sampleScatterReflexionAndRefraction(HitInfo & hitInfo, Ra
 	kr = 1.0f;
 	Vector invRayDir(hitInfo.inRay.getDirection());
 	Vector reflectedDir = invRayDir.reflect(hitInfo.hitNormal);
-	reflectRay = Ray(hitInfo.hitPoint + reflectedDir * _RT_BIAS, reflectedDir, hitInfo.inRay.getDepth() + 1);
+	reflectRay = Ray(hitInfo.hitPoint + reflectedDir * hitInfo.rayBias, reflectedDir, hitInfo.inRay.getDepth() + 1);
 	RPdf = 1.0f;
 	TPdf = 0.0f;
 }
 
-void MetallicMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult)
+void MetallicMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler)
 {
 	kt = 0.0f;
 	kr = 1.0f;
 	Vector invRayDir(hitInfo.inRay.getDirection());
 	Vector reflectedDir = invRayDir.reflect(hitInfo.hitNormal);
 	Rresult = hitInfo.hittedMaterial.reflective;
-	reflectRay = Ray(hitInfo.hitPoint + reflectedDir * _RT_BIAS, reflectedDir, hitInfo.inRay.getDepth() + 1);
+	reflectRay = Ray(hitInfo.hitPoint + reflectedDir * hitInfo.rayBias, reflectedDir, hitInfo.inRay.getDepth() + 1);
 	RPdf = 1.0f;
 	TPdf = 0.0f;
 }
@@ -107,14 +109,14 @@ void GlassMaterial::scatterReflexionAndRefraction(HitInfo & hitInfo, Ray & refle
 
 	if (kt > 0.0f)
 	{
-		refractRay = Ray(hitInfo.hitPoint + refracted * _RT_BIAS, refracted, hitInfo.inRay.getDepth() + 1);
+		refractRay = Ray(hitInfo.hitPoint + refracted * hitInfo.rayBias, refracted, hitInfo.inRay.getDepth() + 1);
 	}
 
 	if (kr > 0.0f)
 	{
 		Vector invRayDir(hitInfo.inRay.getDirection());
 		Vector reflectedDir = invRayDir.reflect(hitInfo.hitNormal);
-		reflectRay = Ray(hitInfo.hitPoint + hitInfo.hitNormal * _RT_BIAS, reflectedDir, hitInfo.inRay.getDepth() + 1);
+		reflectRay = Ray(hitInfo.hitPoint + hitInfo.hitNormal * hitInfo.rayBias, reflectedDir, hitInfo.inRay.getDepth() + 1);
 	}
 }
 
@@ -132,21 +134,21 @@ void GlassMaterial::sampleScatterReflexionAndRefraction(HitInfo & hitInfo, Ray &
 	if (kt > 0.0f)
 	{
 		TPdf = kt;
-		Vector transOrigin = outside ? hitInfo.hitPoint - (hitInfo.hitNormal * _RT_BIAS) : hitInfo.hitPoint + (hitInfo.hitNormal * _RT_BIAS);
+		Vector transOrigin = outside ? hitInfo.hitPoint - (hitInfo.hitNormal * hitInfo.rayBias) : hitInfo.hitPoint + (hitInfo.hitNormal * hitInfo.rayBias);
 		refractRay = Ray(transOrigin, refracted, hitInfo.inRay.getDepth() + 1);
 	}
 
 	if (kr > 0.0f)
 	{
 		RPdf = kr;
-		Vector reflOrigin = outside ? hitInfo.hitPoint + (hitInfo.hitNormal * _RT_BIAS) : hitInfo.hitPoint - (hitInfo.hitNormal * _RT_BIAS);
+		Vector reflOrigin = outside ? hitInfo.hitPoint + (hitInfo.hitNormal * hitInfo.rayBias) : hitInfo.hitPoint - (hitInfo.hitNormal * hitInfo.rayBias);
 		Vector invRayDir(hitInfo.inRay.getDirection());
 		Vector reflectedDir = invRayDir.reflect(hitInfo.hitNormal);
 		reflectRay = Ray(reflOrigin, reflectedDir, hitInfo.inRay.getDepth() + 1);
 	}
 }
 
-void GlassMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult)
+void GlassMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler)
 {
 	Vector refracted;
 	float percentage;
@@ -160,14 +162,14 @@ void GlassMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &k
 	if (kt > 0.0f)
 	{
 		TPdf = kt;
-		Vector transOrigin = outside ? hitInfo.hitPoint - (hitInfo.hitNormal * _RT_BIAS) : hitInfo.hitPoint + (hitInfo.hitNormal * _RT_BIAS);
+		Vector transOrigin = outside ? hitInfo.hitPoint - (hitInfo.hitNormal * hitInfo.rayBias) : hitInfo.hitPoint + (hitInfo.hitNormal * hitInfo.rayBias);
 		refractRay = Ray(transOrigin, refracted, hitInfo.inRay.getDepth() + 1);
 	}
 
 	if (kr > 0.0f)
 	{
 		RPdf = kr;
-		Vector reflOrigin = outside ? hitInfo.hitPoint + (hitInfo.hitNormal * _RT_BIAS) : hitInfo.hitPoint - (hitInfo.hitNormal * _RT_BIAS);
+		Vector reflOrigin = outside ? hitInfo.hitPoint + (hitInfo.hitNormal * hitInfo.rayBias) : hitInfo.hitPoint - (hitInfo.hitNormal * hitInfo.rayBias);
 		Vector invRayDir(hitInfo.inRay.getDirection());
 		Vector reflectedDir = invRayDir.reflect(hitInfo.hitNormal);
 		reflectRay = Ray(reflOrigin, reflectedDir, hitInfo.inRay.getDepth() + 1);
@@ -249,119 +251,153 @@ Vector RoughMaterial::computeAmbientRadiance(HitInfo & hitInfo)
 	return hitInfo.hittedMaterial.diffuse;
 }
 
+// Below this GGX is too close to a perfect mirror to be evaluated in float
+static const float MIN_GGX_ALPHA = 0.001f;
+
+// Lower bound for the probability of sampling each lobe, so neither of them is left to a few samples
+static const float MIN_LOBE_PROBABILITY = 0.25f;
+
 Vector RoughMaterial::computeDiffuseRadiance(HitInfo & hitInfo)
 {
-	Vector diffuseTerm =  hitInfo.hittedMaterial.diffuse / float(M_PI);
-
-	Vector n = hitInfo.hitNormal;
-	Vector l = hitInfo.lightVector;
 	Vector v = Vector(hitInfo.inRay.getDirection()) * -1.0f;
-	Vector h = (l + v).Normalize();
-	float roughness = hitInfo.hittedMaterial.roughness;
-
-	float F = conductorFresnel(l, h, hitInfo.hittedMaterial.refraction_index.x); // m o h
-	float G = geometricSmithSchlick(v, h, n, l, roughness); // m o h
-	float D = distributionBeckman(h, n, roughness); // m o h
+	return evaluateBRDF(hitInfo, v, hitInfo.lightVector);
+}
 
-	float bottom = 4.0f * std::max(0.0f, n.Dot(l)) * std::max(0.0f, n.Dot(v));
-	
-	float fr = 0.0f;
-	if (bottom > 0.0f)
+bool RoughMaterial::sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf, PathSampler & sampler)
+{
+	Vector scatteredDir;
+	if (!sampleDirection(hitInfo, scatteredDir, result, pdf, sampler))
 	{
-		fr = std::max((F * G * D) / bottom, 0.0f);
+		result = Vector();
+		return false;
 	}
 
-	// Energy conservation
-	float diffuseFresnelV = 1.0f - F;
+	scatteredRay = Ray(hitInfo.hitPoint + scatteredDir * hitInfo.rayBias, scatteredDir, hitInfo.inRay.getDepth() + 1);
 
-	return diffuseTerm * diffuseFresnelV + Vector(1.0f, 1.0f, 1.0f) * fr;
+	// Survives the russian roulette with the fraction of energy the path keeps
+	Vector throughput = result / pdf;
+	float maxThroughput = std::max(throughput.x, std::max(throughput.y, throughput.z));
+	scatteredRay.setWeight(clampValue(maxThroughput, 0.0f, hitInfo.maxSurvival));
+	scatteredRay.setScatterPdf(pdf, hitInfo.hitNormal);
+	return true;
 }
 
-bool RoughMaterial::sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf)
+void RoughMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler)
 {
-	float roughness = hitInfo.hittedMaterial.roughness;
-
-	Vector v = hitInfo.inRay.getDirection();
-	Vector invV = v * -1.0f;
-	Vector n = hitInfo.hitNormal;
-	Vector m = sampleMicrofacetNormal(n, roughness);
-	Vector l = hitInfo.lightVector;
-	Vector h = (m + invV).Normalize();
+	// Directions below the surface reflect nothing, and are not followed
+	kr = sampleDiffuseRadiance(hitInfo, reflectRay, Rresult, RPdf, sampler) ? 1.0f : 0.0f;
+	kt = 0.0f;
+}
 
-	Vector scatteredDir = v.reflect(m);
+Vector RoughMaterial::evaluateBSDF(HitInfo & hitInfo, Vector & dir)
+{
+	Vector v = Vector(hitInfo.inRay.getDirection()) * -1.0f;
+	float cosTheta = hitInfo.hitNormal.Dot(dir);
+	return cosTheta > 0.0f ? evaluateBRDF(hitInfo, v, dir) * cosTheta : Vector();
+}
 
-	float F = conductorFresnel(scatteredDir, h, hitInfo.hittedMaterial.refraction_index.x);
-	float G = geometricSmithSchlick(invV, h, n, scatteredDir, roughness);
-	
-	float bottom = clampValue(4.0f * n.Dot(scatteredDir) * n.Dot(invV), 0.0f, 1.0f);
+float RoughMaterial::evaluatePdf(HitInfo & hitInfo, Vector & dir)
+{
+	Vector v = Vector(hitInfo.inRay.getDirection()) * -1.0f;
+	Vector n = hitInfo.hitNormal;
+	float cosTheta = n.Dot(dir);
+	if (cosTheta <= 0.0f || n.Dot(v) <= 0.0f)
+	{
+		return 0.0f;
+	}
 
-	float cos = clampValue(m.Dot(n), 0.0f, 1.0f);
-	float sin = sqrtf(1.0f - cos*cos);
+	float specular = specularProbability(hitInfo, v);
+	return specular * specularPdf(hitInfo, v, dir) + (1.0f - specular) * cosTheta / float(M_PI);
+}
 
-	float fr = 0.0f;
-	if (bottom > 0.0f)
+Vector RoughMaterial::evaluateBRDF(HitInfo & hitInfo, Vector v, Vector l)
+{
+	Vector n = hitInfo.hitNormal;
+	float cosnl = n.Dot(l);
+	float cosnv = n.Dot(v);
+	if (cosnl <= 0.0f || cosnv <= 0.0f)
 	{
-		fr = std::max((F * G * sin) / bottom, 0.0f);
+		return Vector();
 	}
 
-	// Energy conservation
-	float diffuseFresnelV = 1.0f - conductorFresnel(scatteredDir, n, hitInfo.hittedMaterial.refraction_index.x);
+	Vector h = (l + v).Normalize();
+	float alpha = std::max(hitInfo.hittedMaterial.roughness, MIN_GGX_ALPHA);
 
-	result = hitInfo.hittedMaterial.diffuse * diffuseFresnelV + Vector(1.0f, 1.0f, 1.0f) * fr;
+	float F = conductorFresnel(l, h, hitInfo.hittedMaterial.refraction_index.x); // m o h
+	float G = geometricSmithGGX(v, h, n, alpha) * geometricSmithGGX(l, h, n, alpha); // m o h
+	float D = distributionGGX(h, n, alpha); // m o h
 
-	//std::cout << result.x << ", " << result.y << ", " << result.z << std::endl;
+	float fr = (F * G * D) / (4.0f * cosnl * cosnv);
 
-	scatteredRay = Ray(hitInfo.hitPoint + scatteredDir * _RT_BIAS, scatteredDir, hitInfo.inRay.getDepth() + 1);
-	scatteredRay.setWeight(fabs(m.Dot(scatteredDir)));
-	
-	//pdf = 1.0f / roughness;
-	pdf = fabs(m.Dot(n));
+	// Energy conservation
+	float diffuseFresnelV = 1.0f - F;
 
-	return pdf > 0.0f;
+	Vector diffuseTerm = hitInfo.hittedMaterial.diffuse / float(M_PI);
+	return diffuseTerm * diffuseFresnelV + Vector(1.0f, 1.0f, 1.0f) * fr;
 }
 
-void RoughMaterial::sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult)
+float RoughMaterial::specularProbability(HitInfo & hitInfo, Vector v)
 {
-	float roughness = hitInfo.hittedMaterial.roughness;
-
-	Vector v = hitInfo.inRay.getDirection();
-	Vector invV = v * -1.0f;
-	Vector n = hitInfo.hitNormal;
-	Vector m = sampleMicrofacetNormal(n, roughness);
-	Vector l = hitInfo.lightVector;
-	Vector h = (m + invV).Normalize();
-
-	Vector scatteredDir = v.reflect(m);
-
-	float F = conductorFresnel(scatteredDir, h, hitInfo.hittedMaterial.refraction_index.x);
-	float G = geometricSmithSchlick(invV, h, n, scatteredDir, roughness);
+	// Expected share of the specular lobe, from the fresnel term seen from v
+	const Vector & diffuse = hitInfo.hittedMaterial.diffuse;
+	float maxDiffuse = std::max(diffuse.x, std::max(diffuse.y, diffuse.z));
+	float F = conductorFresnel(v, hitInfo.hitNormal, hitInfo.hittedMaterial.refraction_index.x);
 
-	float bottom = clampValue(4.0f * n.Dot(scatteredDir) * n.Dot(invV), 0.0f, 1.0f);
-
-	float cos = clampValue(m.Dot(n), 0.0f, 1.0f);
-	float sin = sqrtf(1.0f - cos * cos);
-
-	float fr = 0.0f;
-	if (bottom > 0.0f)
+	float diffuseWeight = (1.0f - F) * maxDiffuse;
+	if (diffuseWeight <= 0.0f)
 	{
-		fr = std::max((F * G * sin) / bottom, 0.0f);
+		return 1.0f;
 	}
+	return clampValue(F / (F + diffuseWeight), MIN_LOBE_PROBABILITY, 1.0f - MIN_LOBE_PROBABILITY);
+}
 
-	// Energy conservation
-	float diffuseFresnelV = 1.0f - conductorFresnel(scatteredDir, n, hitInfo.hittedMaterial.refraction_index.x);
+float RoughMaterial::specularPdf(HitInfo & hitInfo, Vector v, Vector l)
+{
+	// Visible normal pdf D_v(h) = G1(v) * D(h) * (v o h) / (n o v), over the jacobian of the reflection 4 (v o h)
+	Vector n = hitInfo.hitNormal;
+	Vector h = (l + v).Normalize();
+	float alpha = std::max(hitInfo.hittedMaterial.roughness, MIN_GGX_ALPHA);
 
-	Rresult = hitInfo.hittedMaterial.diffuse * diffuseFresnelV + Vector(1.0f, 1.0f, 1.0f) * fr;
+	return geometricSmithGGX(v, h, n, alpha) * distributionGGX(h, n, alpha) / (4.0f * n.Dot(v));
+}
 
-	//std::cout << result.x << ", " << result.y << ", " << result.z << std::endl;
+bool RoughMaterial::sampleDirection(HitInfo & hitInfo, Vector & dir, Vector & result, float & pdf, PathSampler & sampler)
+{
+	Vector v = hitInfo.inRay.getDirection();
+	Vector invV = v * -1.0f;
+	Vector n = hitInfo.hitNormal;
+	if (n.Dot(invV) <= 0.0f)
+	{
+		return false;
+	}
 
-	reflectRay = Ray(hitInfo.hitPoint + scatteredDir * _RT_BIAS, scatteredDir, hitInfo.inRay.getDepth() + 1);
-	reflectRay.setWeight(fabs(m.Dot(scatteredDir)));
+	// One 2D sample for both lobes: the first number chooses the lobe, and is rescaled to [0, 1) inside it
+	float a, b;
+	sampler.sample2D(a, b);
+	float specular = specularProbability(hitInfo, invV);
 
-	//pdf = 1.0f / roughness;
-	RPdf = fabs(m.Dot(n));
+	if (a < specular)
+	{
+		float alpha = std::max(hitInfo.hittedMaterial.roughness, MIN_GGX_ALPHA);
+		Vector m = sampleVisibleNormal(invV, n, alpha, a / specular, b);
+		dir = v.reflect(m).Normalize();
+	}
+	else
+	{
+		float u = (a - specular) / (1.0f - specular);
+		float sinTheta = sqrtf(u);
+		float phi = 2.0f * float(M_PI) * b;
+
+		Vector yVector, xVector;
+		ComputeOrthoNormalBasis(n, yVector, xVector);
+		Vector local(sinTheta * cosf(phi), sqrtf(1.0f - u), sinTheta * sinf(phi));
+		dir = WorldUniformHemiSample(local, n, yVector, xVector).Normalize();
+	}
 
-	kt = 0.0f;
-	kr = 1.0f;
+	// Result is BRDF * cos, with the pdf of both lobes together
+	result = evaluateBSDF(hitInfo, dir);
+	pdf = evaluatePdf(hitInfo, dir);
+	return pdf > 0.0f && (result.x > 0.0f || result.y > 0.0f || result.z > 0.0f);
 }
 
 float RoughMaterial::computeXi(float a)
@@ -369,27 +405,19 @@ float RoughMaterial::computeXi(float a)
 	return a > 0.0f? 1.0f : 0.0f;
 }
 
-float RoughMaterial::geometricSmithSchlick(Vector v, Vector h, Vector n, Vector l, float roughness)
+float RoughMaterial::geometricSmithGGX(Vector w, Vector h, Vector n, float alpha)
 {
-	float cosnv = n.Dot(v);
-	float cosnl = n.Dot(l);
-	float coshv = h.Dot(v);
-	float coshl = h.Dot(l);
-
-	float clampCosNv = std::max(0.0f, cosnv);
-
-	float tannv = tanf(acosf(clampCosNv));
-
-	float a = 1.0f / (roughness * tannv);
-
-	// Shlick aproximation
-	float result = 1.0f;
-	if (a < 1.6f)
+	float cosnw = n.Dot(w);
+	float coshw = h.Dot(w);
+	if (cosnw <= 0.0f)
 	{
-		result = (3.535f*a + 2.181f*a*a) / (1.0f + 2.276f*a + 2.577f*a*a);
+		return 0.0f;
 	}
 
-	return (computeXi(coshl / cosnl) * result) * (computeXi(coshv / cosnv) * result);
+	float cos2 = cosnw * cosnw;
+	float tan2 = (1.0f - cos2) / cos2;
+
+	return computeXi(coshw / cosnw) * 2.0f / (1.0f + sqrtf(1.0f + alpha * alpha * tan2));
 }
 
 float RoughMaterial::conductorFresnel(Vector l, Vector h, float ior)
@@ -402,42 +430,58 @@ float RoughMaterial::conductorFresnel(Vector l, Vector h, float ior)
 	return R0 + (1.0f - R0)*cosTheta*cosTheta*cosTheta*cosTheta*cosTheta;
 }
 
-float RoughMaterial::distributionBeckman(Vector h, Vector n, float roughness)
+float RoughMaterial::distributionGGX(Vector h, Vector n, float alpha)
 {
-	float dotnh = std::max(0.0f, (n.Dot(h)));
-	
-	if (dotnh == 0.0f)
-		return 0.0f;
-
-	if (roughness <= 0.0f)
+	float dotnh = n.Dot(h);
+	if (dotnh <= 0.0f)
 		return 0.0f;
 
-	float dotnh2 = dotnh * dotnh;
-	float m2 = roughness * roughness;
-	float expValue = (dotnh2 - 1.0f) / (m2*dotnh2);
+	float alpha2 = alpha * alpha;
+	float denominator = dotnh * dotnh * (alpha2 - 1.0f) + 1.0f;
 
-	float e = std::exp(expValue);
-	
-	return e / (float(M_PI)*m2*dotnh2*dotnh2);
+	return alpha2 / (float(M_PI) * denominator * denominator);
 }
 
-Vector RoughMaterial::sampleMicrofacetNormal(Vector n, float roughness)
+// Heitz, "Sampling the GGX Distribution of Visible Normals", JCGT 2018. Works in the frame of
+// ComputeOrthoNormalBasis, with n as the z axis
+Vector RoughMaterial::sampleVisibleNormal(Vector v, Vector n, float alpha, float a, float b)
 {
-	float a = sampler.sampleRect();
-	float b = sampler.sampleRect();
-
-	float theta = atan(sqrtf(-(roughness*roughness)*log(1.0f - a)));
-	float phi = 2.0f * float(M_PI) * b;
-
-	float sinTheta = sinf(theta);
-	float x = sinTheta * cosf(phi);
-	float z = sinTheta * sinf(phi);
-
-	Vector local(x, a, z);
-
 	Vector yVector, xVector;
 	ComputeOrthoNormalBasis(n, yVector, xVector);
 
+	// Stretch the view direction, so the distribution becomes an hemisphere of radius one
+	float vx = alpha * v.Dot(xVector);
+	float vy = alpha * v.Dot(yVector);
+	float vz = v.Dot(n);
+	float vLength = sqrtf(vx * vx + vy * vy + vz * vz);
+	vx /= vLength; vy /= vLength; vz /= vLength;
+
+	// Basis around the stretched view direction
+	float lengthXY = vx * vx + vy * vy;
+	float t1x = 1.0f, t1y = 0.0f;
+	if (lengthXY > 0.0f)
+	{
+		float invLength = 1.0f / sqrtf(lengthXY);
+		t1x = -vy * invLength;
+		t1y = vx * invLength;
+	}
+	float t2x = -vz * t1y, t2y = vz * t1x, t2z = vx * t1y - vy * t1x;
+
+	// Uniform point in the projected disk, squeezed into the visible half of it
+	float r = sqrtf(a);
+	float phi = 2.0f * float(M_PI) * b;
+	float p1 = r * cosf(phi);
+	float p2 = r * sinf(phi);
+	float s = 0.5f * (1.0f + vz);
+	p2 = (1.0f - s) * sqrtf(1.0f - p1 * p1) + s * p2;
+	float p3 = sqrtf(std::max(0.0f, 1.0f - p1 * p1 - p2 * p2));
+
+	// Back to the hemisphere, and unstretched
+	float mx = alpha * (p1 * t1x + p2 * t2x + p3 * vx);
+	float my = alpha * (p1 * t1y + p2 * t2y + p3 * vy);
+	float mz = std::max(0.0f, p2 * t2z + p3 * vz);
+
+	Vector local(mx, mz, my);
 	return WorldUniformHemiSample(local, n, yVector, xVector).Normalize();
 }
 
@@ -467,6 +511,7 @@ void PhysicalMaterialTable::registerMaterial(PhysicalMaterial * material)
 	std::map<std::string, PhysicalMaterial *>::iterator it = table.find(material->getName());
 	if (it == table.end())
 	{
+		material->id = (unsigned int)(table.size());
 		table[material->getName()] = material;
 	}
 }
@@ -11,38 +11,51 @@
 
 class PhysicalMaterial
 {
+	friend class PhysicalMaterialTable;
 private:
 	std::string name;
+	unsigned int id;	// Order in which it was registered in the material table
 public:
-	PhysicalMaterial(std::string name) :name(name) {}
+	PhysicalMaterial(std::string name) :name(name), id(0) {}
 
 	std::string getName() { return name; }
+	unsigned int getId() const { return id; }
 
 	virtual Vector computeAmbientRadiance(HitInfo & hitInfo) { return Vector(); }
 
 	virtual Vector computeDiffuseRadiance(HitInfo & hitInfo) { return Vector(); }
 	virtual void scatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, Ray &refractRay, float &kt) { kr = 0.0f; kt = 0.0f; }
 
-	virtual bool sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf) { result = Vector(); return false; }
+	virtual bool sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf, PathSampler & sampler) { result = Vector(); return false; }
 	virtual void sampleScatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf) { kr = 0.0f; kt = 0.0f; }
 	
-	virtual void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &TResult) { kr = 0.0f, kt = 0.0f; }
+	virtual void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &TResult, PathSampler & sampler) { kr = 0.0f, kt = 0.0f; }
+
+	// Whether the BSDF can be evaluated for any pair of directions, which next event estimation needs.
+	// Specular materials can't, so lights are only reached from them by scattered rays
+	virtual bool hasBSDFEvaluation() { return false; }
+
+	// BSDF * cos towards the given (normalized) direction, and the solid angle pdf of sampleMaterial choosing it
+	virtual Vector evaluateBSDF(HitInfo & hitInfo, Vector & dir) { return Vector(); }
+	virtual float evaluatePdf(HitInfo & hitInfo, Vector & dir) { return 0.0f; }
 };
 
 // =====================================================================================================
 // Lambertian implementation
 class MatteMaterial : public PhysicalMaterial
 {
-private:
-	FloatSampler sampler;
 public:
 	MatteMaterial(std::string name = "Matte") :PhysicalMaterial(name) { }
 	
 	Vector computeAmbientRadiance(HitInfo & hitInfo);
 	Vector computeDiffuseRadiance(HitInfo & hitInfo);
-	bool sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf);
+	bool sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf, PathSampler & sampler);
 
-	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult);
+	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler);
+
+	bool hasBSDFEvaluation() { return true; }
+	Vector evaluateBSDF(HitInfo & hitInfo, Vector & dir);
+	float evaluatePdf(HitInfo & hitInfo, Vector & dir);
 };
 
 // =====================================================================================================
@@ -55,7 +68,7 @@ public:
 	void scatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, Ray &refractRay, float &kt);
 	void sampleScatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf);
 
-	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult);
+	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler);
 };
 
 // =====================================================================================================
@@ -68,7 +81,7 @@ public:
 	void scatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, Ray &refractRay, float &kt);
 	void sampleScatterReflexionAndRefraction(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf);
 
-	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult);
+	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler);
 private:
 	bool computeSnellRefractedDirection(float inIOR, float outIOR, Vector inDir, Vector hitNormal, Vector & outDir);
 	float computeFresnelReflectedEnergy(float iIOR, Vector inDir, Vector inNormal, float oIOR, Vector outDir, Vector outNormal);
@@ -79,31 +92,44 @@ private:
 // Microfacets implementation for conductors using GGX
 class RoughMaterial : public PhysicalMaterial
 {
-private:
-	FloatSampler sampler;
 public:
 	RoughMaterial(std::string name = "Rough") : PhysicalMaterial(name) { }
 
 	Vector computeAmbientRadiance(HitInfo & hitInfo);
 	Vector computeDiffuseRadiance(HitInfo & hitInfo);
-	bool sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf);
-	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult);
+	bool sampleDiffuseRadiance(HitInfo & hitInfo, Ray & scatteredRay, Vector &result, float &pdf, PathSampler & sampler);
+	void sampleMaterial(HitInfo & hitInfo, Ray & reflectRay, float &kr, float &RPdf, Ray &refractRay, float &kt, float &TPdf, Vector &Rresult, Vector &Tresult, PathSampler & sampler);
+
+	bool hasBSDFEvaluation() { return true; }
+	Vector evaluateBSDF(HitInfo & hitInfo, Vector & dir);
+	float evaluatePdf(HitInfo & hitInfo, Vector & dir);
 protected:
 	//χ(a) Equal to one if a > 0 and zero if a ≤ 0
 	float computeXi(float a);
 
 	//Geometry term component
-	// Gi (geometric term component, G = Gi(eyevector, microfacetNormal)*Gi(lightVector, microfacetNormal)
-	float geometricSmithSchlick(Vector v, Vector h, Vector n, Vector l, float roughness);
+	// G1 (Smith masking for GGX, G = G1(eyevector, microfacetNormal)*G1(lightVector, microfacetNormal)
+	float geometricSmithGGX(Vector w, Vector h, Vector n, float alpha);
 
 	// F (fresnel term, for conductors)
 	float conductorFresnel(Vector l, Vector h, float ior);
 
 	// D (Normal distribution, using GGX)
-	float distributionBeckman(Vector h, Vector n, float roughness);
+	float distributionGGX(Vector h, Vector n, float alpha);
 
-	// Samples a microfacet normal using uniform distribution
-	Vector sampleMicrofacetNormal(Vector n, float roughness);
+	// Samples a microfacet normal from the GGX normals visible from v, for two uniform numbers
+	Vector sampleVisibleNormal(Vector v, Vector n, float alpha, float a, float b);
+
+private:
+	// Diffuse + specular BRDF, for view and light directions pointing away from the surface
+	Vector evaluateBRDF(HitInfo & hitInfo, Vector v, Vector l);
+
+	// Directions are sampled from the visible GGX normals or from a cosine lobe, choosing one with this probability
+	float specularProbability(HitInfo & hitInfo, Vector v);
+	float specularPdf(HitInfo & hitInfo, Vector v, Vector l);
+
+	// Reflected direction, with BRDF * cos and the solid angle pdf of both lobes
+	bool sampleDirection(HitInfo & hitInfo, Vector & dir, Vector & result, float & pdf, PathSampler & sampler);
 };
 
 // =====================================================================================================
@@ -122,6 +148,9 @@ public:
 
 	PhysicalMaterial * getMaterialByName(std::string name);
 
+	// Materials have ids from 0 to getMaterialCount() - 1
+	unsigned int getMaterialCount() const { return (unsigned int)(table.size()); }
+
 private:
 	PhysicalMaterialTable();
 	void registerMaterial(PhysicalMaterial * newMaterial);
@@ -1,5 +1,8 @@
 #include "pic.h"
 
+#include <math.h>
+#include <stdlib.h>
+
 
 extern "C"
 {
@@ -18,6 +21,7 @@ Pic *pic_alloc( int nx, int ny, int bytes_per_pixel, Pic *opic )
     opic->m_width = nx;
     opic->m_height = ny;
     opic->m_channels = bytes_per_pixel;
+    opic->pix = (Pixel1 *)malloc( nx * ny * bytes_per_pixel );
 
     return opic;
 }
@@ -47,6 +51,52 @@ extern bool WriteJPEG( const char* i_path, const Pic* i_pic )
 }
 
 
+extern bool WritePNG( const char* i_path, const Pic* i_pic )
+{
+    return stbi_write_png( i_path, i_pic->m_width, i_pic->m_height, i_pic->m_channels, i_pic->pix, i_pic->m_width * i_pic->m_channels ) != 0;
+}
 
 
+extern bool WriteHDR( const char* i_path, int i_width, int i_height, const float* i_firstRow, int i_channels, int i_rowStride )
+{
+    FILE* file = fopen( i_path, "wb" );
+    if( file == NULL )
+    {
+        return false;
+    }
 
+    fprintf( file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", i_height, i_width );
+
+    /* Flat (not run length encoded) scanlines, converted one at a time */
+    unsigned char* rgbe = (unsigned char *)malloc( i_width * 4 );
+    bool written = true;
+    for( int y = 0; y < i_height && written; y++ )
+    {
+        const float* row = i_firstRow + (long)y * i_rowStride;
+        for( int x = 0; x < i_width; x++ )
+        {
+            const float* pixel = &row[ x * i_channels ];
+            float maxComponent = pixel[0] > pixel[1] ? pixel[0] : pixel[1];
+            maxComponent = pixel[2] > maxComponent ? pixel[2] : maxComponent;
+
+            unsigned char* encoded = &rgbe[ x * 4 ];
+            if( maxComponent < 1e-32f )
+            {
+                encoded[0] = encoded[1] = encoded[2] = encoded[3] = 0;
+            }
+            else
+            {
+                int exponent;
+                float normalize = (float)frexp( maxComponent, &exponent ) * 256.0f / maxComponent;
+                encoded[0] = (unsigned char)( pixel[0] > 0.0f ? pixel[0] * normalize : 0.0f );
+                encoded[1] = (unsigned char)( pixel[1] > 0.0f ? pixel[1] * normalize : 0.0f );
+                encoded[2] = (unsigned char)( pixel[2] > 0.0f ? pixel[2] * normalize : 0.0f );
+                encoded[3] = (unsigned char)( exponent + 128 );
+            }
+        }
+        written = fwrite( rgbe, 4, i_width, file ) == (size_t)i_width;
+    }
+
+    free( rgbe );
+    return fclose( file ) == 0 && written;
+}
@@ -1,31 +1,78 @@
 #pragma once
 
+#include <float.h>
+
 #include "Utils.h"
 #include "SceneMaterial.h"
 
+#ifdef _RT_COUNT_INTERSECTIONS
+#include <atomic>
+#endif
+
+/*
+Ray Class - Ray with a valid parametric interval [tMin, tMax]
+
+Intersection tests only accept hits inside the interval and shrink tMax on every hit,
+so once something has been hit, farther objects are rejected by distance
+*/
 class Ray
 {
 private:
 	Vector origin;
 	Vector direction;
 	unsigned int depth;
-	float cosineWeight;
+	float weight;			// Russian roulette survival probability, set by the material that scattered the ray (negative: unset)
+	float scatterPdf;		// Solid angle pdf of the direction, when sampled from a BSDF that lights can be weighted against (0: none)
+	Vector scatterNormal;	// Normal of the surface that scattered the ray, along with scatterPdf
 	float distance;
+	float tMin;
+	float tMax;
 public:
 
-	Ray() :origin(Vector()), direction(Vector()), depth(0), cosineWeight(-1.0f) {}
-	Ray(Vector origin, Vector direction) :origin(origin), direction(direction), depth(0), cosineWeight(-1.0f) {}
-	Ray(Vector origin, Vector direction, unsigned int depth) : origin(origin), direction(direction), depth(depth), cosineWeight(-1.0f) {}
+	Ray() :origin(Vector()), direction(Vector()), depth(0), weight(-1.0f), scatterPdf(0.0f), tMin(0.0f), tMax(FLT_MAX) {}
+	Ray(Vector origin, Vector direction) :origin(origin), direction(direction), depth(0), weight(-1.0f), scatterPdf(0.0f), tMin(0.0f), tMax(FLT_MAX) {}
+	Ray(Vector origin, Vector direction, unsigned int depth) : origin(origin), direction(direction), depth(depth), weight(-1.0f), scatterPdf(0.0f), tMin(0.0f), tMax(FLT_MAX) {}
 
-	void setWeight(float weight) { cosineWeight = weight; }
+	void setWeight(float w) { weight = w; }
+	void setScatterPdf(float pdf, const Vector & normal) { scatterPdf = pdf; scatterNormal = normal; }
 	const Vector & getOrigin() const { return origin; }
 	const Vector & getDirection() const { return direction; }
 	const unsigned int getDepth() const { return depth; }
-	const float getCosineWeight() const { return cosineWeight; }
+	const float getWeight() const { return weight; }
+	float getScatterPdf() const { return scatterPdf; }
+	const Vector & getScatterNormal() const { return scatterNormal; }
 	float getDistance() { return distance; }
 	void setDistance(float d) { distance = d; }
+
+	float getTMin() const { return tMin; }
+	float getTMax() const { return tMax; }
+	void setTMax(float t) { tMax = t; }
+	// - isInside - Whether the given ray parameter lies inside the valid interval
+	bool isInside(float t) const { return t > tMin && t < tMax; }
+};
+
+#ifdef _RT_COUNT_INTERSECTIONS
+/*
+IntersectionStats - Global intersection test counters, printed after every render
+*/
+struct IntersectionStats
+{
+	static std::atomic<unsigned long long> nodeTests;		// BVH node box tests
+	static std::atomic<unsigned long long> primitiveTests;	// Sphere and triangle tests
+	static std::atomic<unsigned long long> intervalRejects;	// Primitive tests rejected by the ray interval
+	static std::atomic<unsigned long long> primitiveHits;	// Hits that shrank the ray interval
+
+	static void reset();
+	static void print();
 };
 
+#define _RT_COUNT_STAT(stat) IntersectionStats::stat.fetch_add(1, std::memory_order_relaxed)
+#else
+#define _RT_COUNT_STAT(stat)
+#endif
+
+class SceneObject;
+
 struct HitInfo
 {
 	Ray inRay;
@@ -36,6 +83,9 @@ struct HitInfo
 	bool isLight;
 	Vector emission;
 	SceneMaterial hittedMaterial;
-	std::string physicalMaterial;
 	float u, v;
+	SceneObject * object;		// Object that was hit
+	unsigned int primitive;		// Triangle of the model that was hit
+	float rayBias;				// Offset of the rays the material scatters from the hit point
+	float maxSurvival;			// Cap of the russian roulette survival of the scattered rays
 } typedef HitInfo;
\ No newline at end of file
@@ -1,26 +1,11 @@
-#ifdef _OS_X_
-#include <OpenGL/gl.h>
-#include <OpenGL/glu.h>
-#include <GLUT/glut.h>	
-
-#elif defined(WIN32)
-#include <windows.h>
-#include "GL/gl.h"
-#include "GL/glu.h"
-#include "GL/glut.h"
-
-#else
-#include <GL/gl.h>
-#include <GL/glu.h>
-#include <GL/glut.h>
-#endif
-
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <iostream>
 #include <time.h>
+#include <string.h>
+#include <climits>
 
-#ifdef _RT_MEASURE_PERFORMANCE
+#if defined(_RT_MEASURE_PERFORMANCE) || defined(_RT_PROGRESSIVE_RENDERING)
 #include <chrono>
 #endif
 
@@ -30,31 +15,6 @@
 
 // =====================================================================
 
-void RayTrace::initializeBuffer()
-{
-	if (buffer == NULL)
-	{
-		buffer = new Vector*[Scene::WINDOW_HEIGHT];
-		for (int i = 0; i < Scene::WINDOW_HEIGHT; i++)
-		{
-			buffer[i] = new Vector[Scene::WINDOW_WIDTH];
-		}
-	}
-}
-
-void RayTrace::releaseBuffer()
-{
-	if (buffer != NULL)
-	{
-		for (int i = 0; i < Scene::WINDOW_HEIGHT; i++)
-		{
-			delete[] buffer[i];
-		}
-
-		delete[] buffer;
-	}
-}
-
 void RayTrace::initializeTracer()
 {
 	if (tracer != NULL)
@@ -62,22 +22,25 @@ void RayTrace::initializeTracer()
 		delete tracer;
 	}
 
-	switch (Scene::tracerType)
+	switch (settings.tracerType)
 	{
 	case TracerType::RAY_TRACE:
-		tracer = new RayTracer(&m_Scene);
+		tracer = new RayTracer(&m_Scene, settings);
 		break;
 	case TracerType::SUPER_SAMPLING_RAY_TRACE:
-		tracer = new SuperSamplingRayTracer(&m_Scene);
+		tracer = new SuperSamplingRayTracer(&m_Scene, settings);
 		break;
 	case TracerType::MONTE_CARLO_RAY_TRACE:
-		tracer = new MonteCarloRayTracer(&m_Scene);
+		tracer = new MonteCarloRayTracer(&m_Scene, settings);
 		break;
 	case TracerType::BB_RAY_TRACE:
-		tracer = new BBTracer(&m_Scene);
+		tracer = new BBTracer(&m_Scene, settings);
 		break;
 	case TracerType::PATH_TRACE:
-		tracer = new PathTracer(&m_Scene);
+		tracer = new PathTracer(&m_Scene, settings);
+		break;
+	case TracerType::WAVEFRONT_PATH_TRACE:
+		tracer = new WavefrontPathTracer(&m_Scene, settings);
 		break;
 	}
 }
@@ -88,108 +51,303 @@ void RayTrace::Render()
 	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
 #endif
 
+	settings = m_Scene.GetSettings();
+	pool.resize(settings.threadCount);
+
 	initializeTracer();
 	tracer->init();
 
-	completedPixels = 0;
-	screenSize = unsigned int(Scene::WINDOW_HEIGHT * Scene::WINDOW_WIDTH);
-	initializeBuffer();
-	
-	std::unique_lock<std::mutex> lock(mut);
+#ifdef _RT_COUNT_INTERSECTIONS
+	IntersectionStats::reset();
+#endif
+
+	screenSize = settings.width * settings.height;
+	initializeTiles();
 
-#ifdef _RT_PROCESS_PER_PIXEL
-	for (int i = 0; i < Scene::WINDOW_HEIGHT; i++)
+#ifdef _RT_PROGRESSIVE_RENDERING
 	{
-		for (int j = 0; j < Scene::WINDOW_WIDTH; j++)
-		{
-			pool.addTask(std::make_unique<RaytracePixelTask>(this, i, j));
-		}
+		// The window may be reading the image of the last render
+		std::unique_lock<std::mutex> imageLock(imageMutex);
+		completedPasses = 0;
+		frameBuffer.resize(settings.width, settings.height);
 	}
-#else
-	unsigned int xBatchSize = unsigned int(ceil(Scene::WINDOW_WIDTH / _RT_PROCESS_PIXEL_BATCH_SIZE_X));
-	unsigned int yBatchSize = unsigned int(ceil(Scene::WINDOW_HEIGHT / _RT_PROCESS_PIXEL_BATCH_SIZE_Y));
 
-#ifdef _RT_DEBUG
-	unsigned int numBatches = 0;
-#endif
-
-	for (unsigned int i = 0; i < yBatchSize; i++)
+	if (tracer->getPixelSamples() > 1)
 	{
-		for (unsigned int j = 0; j < xBatchSize; j++)
-		{
-			unsigned int xBatchStart = j * _RT_PROCESS_PIXEL_BATCH_SIZE_X;
-			xBatchStart = min(xBatchStart, Scene::WINDOW_WIDTH - 1);
-
-			unsigned int xBatchLen = xBatchStart + _RT_PROCESS_PIXEL_BATCH_SIZE_X > Scene::WINDOW_WIDTH? 
-				Scene::WINDOW_WIDTH - xBatchStart : _RT_PROCESS_PIXEL_BATCH_SIZE_X;
-			
-			unsigned int yBatchStart = i * _RT_PROCESS_PIXEL_BATCH_SIZE_Y;
-			yBatchStart = min(yBatchStart, Scene::WINDOW_HEIGHT - 1);
-			
-			unsigned int yBatchLen = yBatchStart + _RT_PROCESS_PIXEL_BATCH_SIZE_Y > Scene::WINDOW_HEIGHT? 
-				Scene::WINDOW_HEIGHT - yBatchStart : _RT_PROCESS_PIXEL_BATCH_SIZE_Y;
-			
-			pool.addTask(std::make_unique<RaytraceBatchTask>(this, xBatchStart, xBatchLen, yBatchStart, yBatchLen));
-
-#if _RT_DEBUG
-			numBatches++;
-#endif
-		}
+		renderPasses();
 	}
+	else
+	{
+		renderPixels();
 
-#if _RT_DEBUG
-	std::cout << "Num batches: " << numBatches << std::endl;
-#endif
-	
+		std::unique_lock<std::mutex> imageLock(imageMutex);
+		completedPasses = 1;
+	}
+#else
+	frameBuffer.resize(settings.width, settings.height);
+	renderPixels();
 #endif
 
-	monitor.wait(lock);
-
 #ifdef _RT_MEASURE_PERFORMANCE
 	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
 
 	std::cout << "Elapsed time: " << duration << " ms" << std::endl;
 #endif
+
+#ifdef _RT_ADAPTIVE_SAMPLING
+	if (!settings.sampleHeatmap.empty() &&
+		(settings.tracerType == TracerType::PATH_TRACE || settings.tracerType == TracerType::SUPER_SAMPLING_RAY_TRACE))
+	{
+		saveSampleHeatmap(settings.sampleHeatmap.c_str());
+	}
+#endif
+
+#ifdef _RT_COUNT_INTERSECTIONS
+	IntersectionStats::print();
+#endif
 }
 
-#ifndef _RT_PROCESS_PER_PIXEL
-void RayTrace::notifyThreadBatchEnd(unsigned int completedPix)
+// Splits the image in square tiles, in scanline order, so the contiguous blocks the pool gives to
+// every worker are compact regions of the image
+void RayTrace::initializeTiles()
 {
-	std::unique_lock<std::mutex> lock(mut);
-	completedPixels += completedPix;
-	if (completedPixels == (Scene::WINDOW_HEIGHT * Scene::WINDOW_WIDTH))
+	tiles.clear();
+	for (unsigned int y = 0; y < settings.height; y += settings.tileSize)
 	{
-		monitor.notify_one();
+		for (unsigned int x = 0; x < settings.width; x += settings.tileSize)
+		{
+			ImageTile tile;
+			tile.xStart = x;
+			tile.xEnd = x + settings.tileSize < settings.width ? x + settings.tileSize : settings.width;
+			tile.yStart = y;
+			tile.yEnd = y + settings.tileSize < settings.height ? y + settings.tileSize : settings.height;
+			tiles.push_back(tile);
+		}
 	}
-	lock.unlock();
-}
+
+#ifdef _RT_DEBUG
+	std::cout << "Num tiles: " << tiles.size() << std::endl;
 #endif
+}
 
-void RayTrace::addPixel(unsigned int x, unsigned int y, Vector color)
+void RayTrace::runTileTasks(std::vector<std::unique_ptr<Runnable>> & tasks)
 {
-	buffer[x][y] = color;
-#ifdef _RT_PROCESS_PER_PIXEL
 	std::unique_lock<std::mutex> lock(mut);
-	completedPixels++;
-	if (completedPixels == (Scene::WINDOW_HEIGHT * Scene::WINDOW_WIDTH))
+	completedTiles = 0;
+	pool.addTasks(tasks);
+	monitor.wait(lock, [this]() { return completedTiles == tiles.size(); });
+}
+
+void RayTrace::notifyTileEnd()
+{
+	if (completedTiles.fetch_add(1) + 1 == tiles.size())
 	{
+		// The lock makes sure the render thread is either waiting already or yet to check completedTiles
+		std::unique_lock<std::mutex> lock(mut);
 		monitor.notify_one();
 	}
-	lock.unlock();
-#endif
 }
 
-Vector ** RayTrace::getBuffer()
+// Every tile is rendered by a single task, which writes its pixels straight to the frame buffer
+void RayTrace::renderPixels()
+{
+	std::vector<std::unique_ptr<Runnable>> tasks;
+	for (const ImageTile & tile : tiles)
+	{
+		tasks.push_back(std::make_unique<RaytraceTileTask>(this, tile));
+	}
+	runTileTasks(tasks);
+}
+
+void RayTrace::renderTile(const ImageTile & tile)
 {
-	return buffer;
+	tracer->renderTile(tile, frameBuffer);
 }
 
+#ifdef _RT_PROGRESSIVE_RENDERING
+// Passes of the samples per pixel the tracer takes at once (usually one), with a task per tile. The image
+// is resolved after every pass, so it can be copied at any time. Passes count every sample they take, and
+// the samples are added in the same order doTrace adds them
+void RayTrace::renderPasses()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	unsigned int maxPasses = settings.progressiveMaxSamples > 0 ? settings.progressiveMaxSamples : tracer->getPixelSamples();
+	unsigned int passSamples = tracer->getPassSamples();
+	double timeBudget = double(settings.progressiveTimeBudgetMs);
+
+	accumulation.assign(settings.width * settings.height, Vector());
+
+	Clock::time_point start = Clock::now();
+	unsigned int passes = 0;
+	while (passes < maxPasses && !stopRequested)
+	{
+		Clock::time_point passStart = Clock::now();
+
+		unsigned int sampleCount = maxPasses - passes < passSamples ? maxPasses - passes : passSamples;
+
+		std::vector<std::unique_ptr<Runnable>> tasks;
+		for (const ImageTile & tile : tiles)
+		{
+			tasks.push_back(std::make_unique<RaytracePassTask>(this, tile, passes, sampleCount));
+		}
+		runTileTasks(tasks);
+
+		passes += sampleCount;
+		resolvePasses(passes);
+
+		// Passes take about the same time, so the next one is expected to take as long as this one
+		Clock::time_point now = Clock::now();
+		double elapsed = std::chrono::duration<double, std::milli>(now - start).count();
+		double passTime = std::chrono::duration<double, std::milli>(now - passStart).count();
+		if (timeBudget > 0.0 && elapsed + passTime > timeBudget)
+		{
+			break;
+		}
+	}
+
+	std::cout << "Progressive render: " << passes << " samples per pixel" << std::endl;
+}
+
+void RayTrace::resolvePasses(unsigned int passes)
+{
+	std::unique_lock<std::mutex> imageLock(imageMutex);
+	for (unsigned int i = 0; i < settings.height; i++)
+	{
+		for (unsigned int j = 0; j < settings.width; j++)
+		{
+			frameBuffer.setPixel(j, i, accumulation[i * settings.width + j] / float(passes));
+		}
+	}
+	completedPasses = passes;
+}
+
+void RayTrace::accumulateTile(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount)
+{
+	tracer->accumulateTileSamples(tile, firstSample, sampleCount, accumulation.data());
+}
+
+void RayTrace::startRender()
+{
+	stopRender();
+
+	rendering = true;
+	renderThread = std::thread([this]()
+	{
+		Render();
+		rendering = false;
+	});
+}
+
+void RayTrace::stopRender()
+{
+	stopRequested = true;
+	if (renderThread.joinable())
+	{
+		renderThread.join();
+	}
+	stopRequested = false;
+}
+
+#endif
+
 Vector RayTrace::calculatePixel(int screenX, int screenY)
 {
 	return tracer->doTrace(screenX, screenY);
 }
 
+bool RayTrace::saveImage(const char * filename)
+{
+	if (frameBuffer.isEmpty())
+	{
+		return false;
+	}
+
+	const char * extension = strrchr(filename, '.');
+	extension = extension != NULL ? extension : "";
+
+	unsigned int width = frameBuffer.getWidth();
+	unsigned int height = frameBuffer.getHeight();
+
+	// Image rows go from the top, screen rows from the bottom
+	if (strcmp(extension, ".hdr") == 0 || strcmp(extension, ".HDR") == 0)
+	{
+		int rowStride = int(frameBuffer.getStride() * FrameBuffer::CHANNELS);
+		return WriteHDR(filename, width, height, frameBuffer.getRow(height - 1), FrameBuffer::CHANNELS, -rowStride);
+	}
+
+	Pic * image = pic_alloc(width, height, 3, NULL);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		const float * pixels = frameBuffer.getRow(y);
+		Pixel1 * row = &image->pix[(height - 1 - y) * image->m_width * image->m_channels];
+		for (unsigned int x = 0; x < width; x++)
+		{
+			for (unsigned int c = 0; c < 3; c++)
+			{
+				row[x * 3 + c] = Pixel1(255.0f * clampValue(pixels[x * FrameBuffer::CHANNELS + c], 0.0f, 1.0f) + 0.5f);
+			}
+		}
+	}
+
+	bool saved = false;
+	if (strcmp(extension, ".png") == 0 || strcmp(extension, ".PNG") == 0)
+	{
+		saved = WritePNG(filename, image);
+	}
+	else
+	{
+		saved = WriteJPEG(filename, image);
+	}
+	pic_free(image);
+	delete image;
+
+	return saved;
+}
+
+void RayTrace::saveSampleHeatmap(const char * filename)
+{
+	unsigned int minCount = UINT_MAX, maxCount = 0;
+	double totalCount = 0.0;
+	for (unsigned int y = 0; y < settings.height; y++)
+	{
+		for (unsigned int x = 0; x < settings.width; x++)
+		{
+			unsigned int count = tracer->getSampleCount(x, y);
+			minCount = count < minCount ? count : minCount;
+			maxCount = count > maxCount ? count : maxCount;
+			totalCount += count;
+		}
+	}
+
+	std::cout << "Samples per pixel: " << minCount << " - " << maxCount << ", average "
+		<< totalCount / double(settings.width * settings.height) << std::endl;
+
+	Pic * heatmap = pic_alloc(settings.width, settings.height, 3, NULL);
+	float range = maxCount > minCount ? float(maxCount - minCount) : 1.0f;
+
+	// Image rows go from the top, screen rows from the bottom
+	for (unsigned int y = 0; y < settings.height; y++)
+	{
+		Pixel1 * row = &heatmap->pix[(settings.height - 1 - y) * heatmap->m_width * heatmap->m_channels];
+		for (unsigned int x = 0; x < settings.width; x++)
+		{
+			float t = float(tracer->getSampleCount(x, y) - minCount) / range;
+			row[x * 3 + 0] = Pixel1(255.0f * clampValue(2.0f * t - 1.0f, 0.0f, 1.0f));
+			row[x * 3 + 1] = Pixel1(255.0f * (1.0f - fabsf(2.0f * t - 1.0f)));
+			row[x * 3 + 2] = Pixel1(255.0f * clampValue(1.0f - 2.0f * t, 0.0f, 1.0f));
+		}
+	}
+
+	if (!WriteJPEG(filename, heatmap))
+	{
+		std::cout << "Error saving " << filename << std::endl;
+	}
+	pic_free(heatmap);
+	delete heatmap;
+}
+
 // =========================================================================
 // =========================================================================
 
@@ -225,30 +383,16 @@ Ray CameraWrapper::getRayForPixel(float t, float s)
 // =========================================================================
 // =========================================================================
 
-#ifdef _RT_PROCESS_PER_PIXEL
-void RaytracePixelTask::run()
+void RaytraceTileTask::run()
 {
-	tracer->addPixel(x, y, tracer->calculatePixel(y, x));
+	tracer->renderTile(tile);
+	tracer->notifyTileEnd();
 }
 
-// =========================================================================
-// =========================================================================
-
-#else
-
-void RaytraceBatchTask::run()
+#ifdef _RT_PROGRESSIVE_RENDERING
+void RaytracePassTask::run()
 {
-	unsigned int xEnd = xStart + xLen;
-	unsigned int yEnd = yStart + yLen;
-
-	for (unsigned int i = xStart; i < xEnd; i++)
-	{
-		for (unsigned int j = yStart; j < yEnd; j++)
-		{
-			tracer->addPixel(i, j, tracer->calculatePixel(j, i));
-		}
-	}
-
-	tracer->notifyThreadBatchEnd(xLen * yLen);
+	tracer->accumulateTile(tile, firstSample, sampleCount);
+	tracer->notifyTileEnd();
 }
 #endif
\ No newline at end of file
@@ -22,69 +22,119 @@
 #include "Threadpool.h"
 #include "Config.h"
 #include "Tracer.h"
+#include "FrameBuffer.h"
+
+#include <vector>
+#include <atomic>
 
 class RayTrace
 {
 private:
-	Vector ** buffer;
-	unsigned int completedPixels;
+	FrameBuffer frameBuffer;
 
 	ThreadPool pool;
 
 	unsigned int screenSize;
 
+	std::vector<ImageTile> tiles;
+	std::atomic<unsigned int> completedTiles;	// The last task to end wakes up the render thread
+
 	std::mutex mut;
 	std::condition_variable monitor;
 
 	Tracer * tracer;
+	RenderSettings settings;			// The ones of the scene, copied when a render starts
+
+#ifdef _RT_PROGRESSIVE_RENDERING
+	std::vector<Vector> accumulation;	// Sum of the samples of every pixel, row by row
+
+	std::mutex imageMutex;				// Guards frameBuffer and completedPasses while rendering in the background
+	unsigned int completedPasses;
+
+	std::thread renderThread;
+	std::atomic<bool> rendering;
+	std::atomic<bool> stopRequested;
+#endif
 public:
 	/* - Scene Variable for the Scene Definition - */
 	Scene m_Scene;
 
 	// -- Constructors & Destructors --
-	RayTrace(void):buffer(NULL),completedPixels(0) {  }
-	~RayTrace(void) { releaseBuffer(); }
+#ifdef _RT_PROGRESSIVE_RENDERING
+	RayTrace(void):completedTiles(0),tracer(NULL),completedPasses(0),rendering(false),stopRequested(false) {  }
+	~RayTrace(void) { stopRender(); delete tracer; }
+#else
+	RayTrace(void):completedTiles(0),tracer(NULL) {  }
+	~RayTrace(void) { delete tracer; }
+#endif
 
 	void Render();
-	Vector ** getBuffer();
-	void addPixel(unsigned int x, unsigned int y, Vector color);
+	const FrameBuffer & getFrameBuffer() const { return frameBuffer; }
 	Vector calculatePixel(int screenX, int screenY);
 
-#ifndef _RT_PROCESS_PER_PIXEL
-	void notifyThreadBatchEnd(unsigned int pix);
+	void renderTile(const ImageTile & tile);
+	void notifyTileEnd();
+
+#ifdef _RT_PROGRESSIVE_RENDERING
+	// Runs Render in a thread of its own, so the image can be read while it converges. A render
+	// that is still running is stopped first
+	void startRender();
+
+	// Asks the render to stop after its current pass, and waits for it
+	void stopRender();
+	bool isRendering() const { return rendering; }
+
+	// The frame buffer can be read in place while the image is locked, and holds the image of the last
+	// completed pass if there is one
+	std::unique_lock<std::mutex> lockImage() { return std::unique_lock<std::mutex>(imageMutex); }
+	unsigned int getCompletedPasses() const { return completedPasses; }
+
+	void accumulateTile(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount);
 #endif
 
+	// Writes the last rendered image, as a PNG, a JPEG or a Radiance HDR file depending on the extension of
+	// filename. PNG and JPEG images are clamped to [0, 1]. Returns false if it could not be written
+	bool saveImage(const char * filename);
+
+	// Writes the samples taken by every pixel in the last render as a JPEG, from blue (fewest) to red (most)
+	void saveSampleHeatmap(const char * filename);
+
 private:
-	void initializeBuffer();
-	void releaseBuffer();
 	void initializeTracer();
+	void initializeTiles();
+
+	// Runs the tasks in the pool, and waits for all of them to end
+	void runTileTasks(std::vector<std::unique_ptr<Runnable>> & tasks);
+	void renderPixels();
+#ifdef _RT_PROGRESSIVE_RENDERING
+	void renderPasses();
+	void resolvePasses(unsigned int passes);
+#endif
 };
 
-#ifdef _RT_PROCESS_PER_PIXEL
-class RaytracePixelTask : public Runnable
+// Every pixel of a tile
+class RaytraceTileTask : public Runnable
 {
 private:
 	RayTrace * tracer;
-	unsigned int x;
-	unsigned int y;
+	ImageTile tile;
 public:
-	RaytracePixelTask(RayTrace * tracer, unsigned int x, unsigned int y) :tracer(tracer), x(x), y(y) {}
+	RaytraceTileTask(RayTrace * tracer, const ImageTile & tile) :tracer(tracer), tile(tile) {}
 	void run();
 };
 
-#else
-class RaytraceBatchTask : public Runnable
+#ifdef _RT_PROGRESSIVE_RENDERING
+// The samples of a pass for every pixel of a tile
+class RaytracePassTask : public Runnable
 {
 private:
 	RayTrace * tracer;
-	unsigned int xStart;
-	unsigned int yStart;
-	unsigned int xLen;
-	unsigned int yLen;
-
+	ImageTile tile;
+	unsigned int firstSample;
+	unsigned int sampleCount;
 public:
-	RaytraceBatchTask(RayTrace * tracer, unsigned int xStart, unsigned int xLen, unsigned int yStart, unsigned int yLen)
-		:tracer(tracer),xStart(xStart), xLen(xLen), yStart(yStart), yLen(yLen) {}
+	RaytracePassTask(RayTrace * tracer, const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount) :
+		tracer(tracer), tile(tile), firstSample(firstSample), sampleCount(sampleCount) {}
 	void run();
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,204 @@
+#include "RenderSettings.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+
+// =================================================================================
+
+// Values that don't fit an unsigned int are rejected instead of wrapped
+static bool parseUnsigned(const char * value, unsigned int & result)
+{
+	char * end = NULL;
+	errno = 0;
+	long long parsed = strtoll(value, &end, 10);
+	if (end == value || *end != '\0' || errno == ERANGE || parsed < 0 || parsed > UINT_MAX)
+	{
+		return false;
+	}
+
+	result = (unsigned int)(parsed);
+	return true;
+}
+
+static bool parseFloat(const char * value, float & result)
+{
+	char * end = NULL;
+	float parsed = strtof(value, &end);
+	if (end == value || *end != '\0')
+	{
+		return false;
+	}
+
+	result = parsed;
+	return true;
+}
+
+// Config.h defaults, which a scene's render_settings element and the command line can override
+RenderSettings::RenderSettings() :
+	width(512), height(512),
+	tracerType(TracerType::RAY_TRACE),
+	supersamplingSamples(_RT_SUPERSAMPLING_SAMPLES),
+	monteCarloPixelSamples(_RT_MC_PIXEL_SAMPLES),
+	monteCarloBounceSamples(_RT_MC_BOUNCES_SAMPLES),
+	pathTracerSamples(_RT_PATHTRACER_PIXEL_SAMPLES),
+	maxBounces(_RT_MAX_BOUNCES),
+	russianRouletteMinBounce(_RT_RUSSIAN_ROULETE_MIN_BOUNCE),
+	russianRouletteMaxSurvival(_RT_RUSSIAN_ROULETE_MAX_SURVIVAL),
+	pathTracerBounces(_RT_PATHTRACER_BOUNCES),
+	pathTracerRussianRouletteBounces(_RT_PATHTRACER_RR_BOUNCES),
+	pathTracerReflexTransmissionBounces(_RT_PATHTRACER_RR_REFLEX_TRANSMISSION_BOUNCES),
+	wavefrontBatchSize(_RT_WAVEFRONT_BATCH_SIZE),
+	bias(_RT_BIAS),
+	threadCount(_RT_THREAD_COUNT),
+	tileSize(_RT_TILE_SIZE),
+	progressiveMaxSamples(_RT_PROGRESSIVE_MAX_SAMPLES),
+	progressiveTimeBudgetMs(_RT_PROGRESSIVE_TIME_BUDGET_MS),
+	adaptivePilotSamples(_RT_ADAPTIVE_PILOT_SAMPLES),
+	adaptiveMinSamples(_RT_ADAPTIVE_MIN_SAMPLES),
+	adaptiveMaxSamples(_RT_ADAPTIVE_MAX_SAMPLES),
+	adaptiveBatchSamples(_RT_ADAPTIVE_BATCH_SAMPLES),
+	adaptiveErrorThreshold(_RT_ADAPTIVE_ERROR_THRESHOLD)
+{
+}
+
+bool RenderSettings::set(const char * name, const char * value)
+{
+	if (strcmp(name, "tracer") == 0)
+	{
+		return parseTracerType(value, tracerType);
+	}
+	if (strcmp(name, "sampleHeatmap") == 0)
+	{
+		sampleHeatmap = value;
+		return true;
+	}
+
+	struct UnsignedSetting { const char * name; unsigned int * value; unsigned int minimum; };
+	UnsignedSetting unsignedSettings[] =
+	{
+		{ "width", &width, 1 },
+		{ "height", &height, 1 },
+		{ "supersamplingSamples", &supersamplingSamples, 1 },
+		{ "monteCarloPixelSamples", &monteCarloPixelSamples, 1 },
+		{ "monteCarloBounceSamples", &monteCarloBounceSamples, 1 },
+		{ "pathTracerSamples", &pathTracerSamples, 1 },
+		{ "maxBounces", &maxBounces, 0 },
+		{ "russianRouletteMinBounce", &russianRouletteMinBounce, 0 },
+		{ "pathTracerBounces", &pathTracerBounces, 0 },
+		{ "pathTracerRussianRouletteBounces", &pathTracerRussianRouletteBounces, 0 },
+		{ "pathTracerReflexTransmissionBounces", &pathTracerReflexTransmissionBounces, 0 },
+		{ "wavefrontBatchSize", &wavefrontBatchSize, 1 },
+		{ "threads", &threadCount, 0 },
+		{ "tileSize", &tileSize, 1 },
+		{ "progressiveMaxSamples", &progressiveMaxSamples, 0 },
+		{ "progressiveTimeBudgetMs", &progressiveTimeBudgetMs, 0 },
+		{ "adaptivePilotSamples", &adaptivePilotSamples, 2 },
+		{ "adaptiveMinSamples", &adaptiveMinSamples, 1 },
+		{ "adaptiveMaxSamples", &adaptiveMaxSamples, 1 },
+		{ "adaptiveBatchSamples", &adaptiveBatchSamples, 1 },
+	};
+
+	for (const UnsignedSetting & setting : unsignedSettings)
+	{
+		if (strcmp(name, setting.name) == 0)
+		{
+			unsigned int parsed;
+			if (!parseUnsigned(value, parsed) || parsed < setting.minimum)
+			{
+				return false;
+			}
+			*setting.value = parsed;
+			return true;
+		}
+	}
+
+	// Positive and up to maximum (NaN is neither). A survival probability above 1 never ends a path, but the
+	// path would still be divided by it
+	struct FloatSetting { const char * name; float * value; float maximum; };
+	FloatSetting floatSettings[] =
+	{
+		{ "russianRouletteMaxSurvival", &russianRouletteMaxSurvival, 1.0f },
+		{ "bias", &bias, FLT_MAX },
+		{ "adaptiveErrorThreshold", &adaptiveErrorThreshold, FLT_MAX },
+	};
+
+	for (const FloatSetting & setting : floatSettings)
+	{
+		if (strcmp(name, setting.name) == 0)
+		{
+			float parsed;
+			if (!parseFloat(value, parsed) || !(parsed > 0.0f && parsed <= setting.maximum))
+			{
+				return false;
+			}
+			*setting.value = parsed;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool RenderSettings::load(XMLNode & node)
+{
+	bool valid = true;
+	for (int i = 0; i < node.nAttribute(); i++)
+	{
+		if (!set(node.getAttributeName(i), node.getAttributeValue(i)))
+		{
+			printf ("Invalid render setting %s=\"%s\"\n", node.getAttributeName(i), node.getAttributeValue(i));
+			valid = false;
+		}
+	}
+	return valid;
+}
+
+void RenderSettings::print() const
+{
+	printf ("Render settings: %ux%u, tracer %s, %u thread(s), %ux%u tiles\n", width, height, tracerName(tracerType),
+		threadCount, tileSize, tileSize);
+	printf ("\tsamples: supersampling %u, monte carlo %u x %u, path tracer %u\n", supersamplingSamples,
+		monteCarloPixelSamples, monteCarloBounceSamples, pathTracerSamples);
+	printf ("\tbounces: %u (russian roulette from %u), path tracer %u (russian roulette from %u), bias %g\n", maxBounces,
+		russianRouletteMinBounce, pathTracerBounces, pathTracerRussianRouletteBounces, bias);
+}
+
+const char * RenderSettings::tracerName(TracerType type)
+{
+	switch (type)
+	{
+	case TracerType::RAY_TRACE:
+		return "rt";
+	case TracerType::SUPER_SAMPLING_RAY_TRACE:
+		return "ss";
+	case TracerType::MONTE_CARLO_RAY_TRACE:
+		return "mc";
+	case TracerType::BB_RAY_TRACE:
+		return "bb";
+	case TracerType::PATH_TRACE:
+		return "pt";
+	case TracerType::WAVEFRONT_PATH_TRACE:
+		return "wf";
+	}
+	return "";
+}
+
+bool RenderSettings::parseTracerType(const char * name, TracerType & type)
+{
+	const TracerType types[] = { TracerType::RAY_TRACE, TracerType::SUPER_SAMPLING_RAY_TRACE,
+		TracerType::MONTE_CARLO_RAY_TRACE, TracerType::BB_RAY_TRACE, TracerType::PATH_TRACE, TracerType::WAVEFRONT_PATH_TRACE };
+
+	for (TracerType candidate : types)
+	{
+		if (strcmp(name, tracerName(candidate)) == 0)
+		{
+			type = candidate;
+			return true;
+		}
+	}
+	return false;
+}
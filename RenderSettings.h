@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+
+#include "Config.h"
+#include "xmlParser.h"
+
+enum TracerType
+{
+	RAY_TRACE = 0,
+	SUPER_SAMPLING_RAY_TRACE = 1,
+	MONTE_CARLO_RAY_TRACE = 2,
+	BB_RAY_TRACE = 3,
+	PATH_TRACE = 4,
+	WAVEFRONT_PATH_TRACE = 5
+};
+
+/*
+RenderSettings Struct - Resolution, tracer and tuning values of a render, chosen at run time
+
+Every value starts from its default in Config.h. They can be changed by the render_settings element
+of the scene file, whose attributes have the same names as the settings, or one by one with set, e.g.
+from the command line:
+
+	<render_settings width="640" height="480" tracer="pt" pathTracerSamples="64" threads="8"/>
+
+Config.h keeps the features that are compiled in or out (BVH, NEE, adaptive and progressive rendering...)
+*/
+struct RenderSettings
+{
+	unsigned int width, height;
+	TracerType tracerType;
+
+	unsigned int supersamplingSamples;
+	unsigned int monteCarloPixelSamples;
+	unsigned int monteCarloBounceSamples;
+	unsigned int pathTracerSamples;
+
+	unsigned int maxBounces;							// Ray tracers
+	unsigned int russianRouletteMinBounce;
+	float russianRouletteMaxSurvival;					// Cap of the russian roulette survival probability, up to 1
+	unsigned int pathTracerBounces;
+	unsigned int pathTracerRussianRouletteBounces;
+	unsigned int pathTracerReflexTransmissionBounces;	// Bounces before one of reflection or transmission is chosen at random
+	unsigned int wavefrontBatchSize;					// Camera samples the wavefront path tracer traces together
+
+	float bias;											// Offset of secondary rays from the surface they leave
+
+	unsigned int threadCount;							// 0 for one per hardware thread
+	unsigned int tileSize;
+
+	unsigned int progressiveMaxSamples;					// 0 to take the samples per pixel of the tracer
+	unsigned int progressiveTimeBudgetMs;				// 0 for no time limit
+
+	unsigned int adaptivePilotSamples;
+	unsigned int adaptiveMinSamples;
+	unsigned int adaptiveMaxSamples;
+	unsigned int adaptiveBatchSamples;
+	float adaptiveErrorThreshold;
+	std::string sampleHeatmap;							// Image of the samples taken by every pixel of adaptive renders, written if set
+
+	RenderSettings();
+
+	// Changes the setting with the given name. Returns false if there is no such setting or the value is not valid
+	bool set(const char * name, const char * value);
+
+	// Every attribute of a render_settings element
+	bool load(XMLNode & node);
+
+	void print() const;
+
+	// Short name of a tracer (rt, ss, mc, bb, pt or wf)
+	static const char * tracerName(TracerType type);
+	static bool parseTracerType(const char * name, TracerType & type);
+};
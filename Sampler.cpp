@@ -1,23 +1,330 @@
 #include "Sampler.h"
 
-void IntegerSampler::sample1D(int &a)
+// =====================================================================
+// Low discrepancy helpers
+
+// Largest float below 1
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+// Enough primes for 64 Halton dimensions, two per PathSampler dimension
+static const unsigned int HALTON_PRIMES[] =
+{
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+	59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+	137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+	227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311,
+	313, 317, 331, 337, 347, 349, 353, 359, 367, 373, 379, 383, 389, 397, 401, 409,
+	419, 421, 431, 433, 439, 443, 449, 457, 461, 463, 467, 479, 487, 491, 499, 503,
+	509, 521, 523, 541, 547, 557, 563, 569, 571, 577, 587, 593, 599, 601, 607, 613,
+	617, 619, 631, 641, 643, 647, 653, 659, 661, 673, 677, 683, 691, 701, 709, 719
+};
+static const unsigned int HALTON_DIMENSIONS = (sizeof(HALTON_PRIMES) / sizeof(HALTON_PRIMES[0])) / 2;
+
+static uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static uint32_t reverseBits(uint32_t v)
+{
+	v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+	v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+	v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+	v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+	return (v >> 16) | (v << 16);
+}
+
+// Owen scrambling of a bit reversed value, where every bit only depends on the lower ones
+// (Burley, "Practical Hash-based Owen Scrambling", JCGT 2020)
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// Second Sobol dimension (the first one is just the bit reversed index). It is linear in the
+// bits of the index, so it is tabulated a byte at a time
+struct SobolSecondDimensionTable
+{
+	uint32_t bytes[4][256];
+
+	SobolSecondDimensionTable()
+	{
+		uint32_t directions[32];
+		directions[0] = 1u << 31;
+		for (int i = 1; i < 32; i++)
+		{
+			directions[i] = directions[i - 1] ^ (directions[i - 1] >> 1);
+		}
+
+		for (int byte = 0; byte < 4; byte++)
+		{
+			for (uint32_t value = 0; value < 256; value++)
+			{
+				uint32_t result = 0;
+				for (int bit = 0; bit < 8; bit++)
+				{
+					if (value & (1u << bit))
+					{
+						result ^= directions[byte * 8 + bit];
+					}
+				}
+				bytes[byte][value] = result;
+			}
+		}
+	}
+};
+
+static const SobolSecondDimensionTable SOBOL_SECOND_DIMENSION;
+
+static uint32_t sobolSecondDimension(uint32_t index)
+{
+	return SOBOL_SECOND_DIMENSION.bytes[0][index & 0xffu]
+		^ SOBOL_SECOND_DIMENSION.bytes[1][(index >> 8) & 0xffu]
+		^ SOBOL_SECOND_DIMENSION.bytes[2][(index >> 16) & 0xffu]
+		^ SOBOL_SECOND_DIMENSION.bytes[3][index >> 24];
+}
+
+static float toUnitFloat(uint32_t bits)
+{
+	return float(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// Radical inverse with every digit scrambled by a random linear permutation d -> (a * d + b) mod base
+// (Matousek), keeping the stratification of the sequence while breaking the correlation between
+// high dimensions. Digits are generated until they fall below float precision
+static float scrambledRadicalInverse(unsigned int base, uint32_t n, uint32_t seed)
+{
+	double invBase = 1.0 / double(base);
+	double factor = invBase;
+	double result = 0.0;
+
+	for (uint32_t digitIndex = 0; factor > 6e-8; digitIndex++)
+	{
+		// Bases are below 2^16, so both halves of one hash are enough
+		uint32_t hash = hash32(seed + digitIndex);
+		uint32_t a = 1u + (hash & 0xffffu) % (base - 1u);
+		uint32_t b = (hash >> 16) % base;
+
+		uint32_t digit = n % base;
+		n /= base;
+
+		result += double((a * digit + b) % base) * factor;
+		factor *= invBase;
+	}
+	return float(result);
+}
+
+// =====================================================================
+
+PathSampler::PathSampler(unsigned int pixelX, unsigned int pixelY, unsigned int sampleIndex, SamplerType type)
+	:type(type), sampleNumber(sampleIndex), dimension(0)
+{
+	uint64_t pixelKey = mixBits((uint64_t(pixelY) << 32) | uint64_t(pixelX));
+	generator.seed(pixelKey, sampleIndex);
+	pixelSeed = uint32_t(pixelKey >> 32);
+	reversedSampleNumber = type == SOBOL_SAMPLER ? reverseBits(sampleIndex) : 0u;
+}
+
+float PathSampler::sampleRect()
+{
+	unsigned int dim = dimension++;
+
+	switch (type)
+	{
+	case HALTON_SAMPLER:
+		if (dim < HALTON_DIMENSIONS)
+		{
+			return sampleHalton(2 * dim);
+		}
+		break;
+	case SOBOL_SAMPLER:
+	{
+		// Shuffle the sample order per dimension, so dimensions are not correlated. The Owen scrambled
+		// first Sobol dimension of the shuffled index is just reverseBits(laineKarrasPermutation(index))
+		uint32_t seed = sobolSeed(dim);
+		uint32_t index = reverseBits(laineKarrasPermutation(reversedSampleNumber, seed));
+		return toUnitFloat(reverseBits(laineKarrasPermutation(index, seed * 0x5bd1e995u)));
+	}
+	default:
+		break;
+	}
+
+	return generator.nextFloat();
+}
+
+void PathSampler::sample2D(float & a, float & b)
+{
+	unsigned int dim = dimension++;
+
+	switch (type)
+	{
+	case HALTON_SAMPLER:
+		if (dim < HALTON_DIMENSIONS)
+		{
+			a = sampleHalton(2 * dim);
+			b = sampleHalton(2 * dim + 1);
+			return;
+		}
+		break;
+	case SOBOL_SAMPLER:
+	{
+		uint32_t seed = sobolSeed(dim);
+		uint32_t index = reverseBits(laineKarrasPermutation(reversedSampleNumber, seed));
+		a = toUnitFloat(reverseBits(laineKarrasPermutation(index, seed * 0x5bd1e995u)));
+		b = toUnitFloat(nestedUniformScramble(sobolSecondDimension(index), seed * 0x68e31da5u));
+		return;
+	}
+	default:
+		break;
+	}
+
+	a = generator.nextFloat();
+	b = generator.nextFloat();
+}
+
+float PathSampler::sampleHalton(unsigned int primeIndex)
 {
-	a = distribution(generator);
+	// Different digit scrambling per pixel, so neighbour pixels do not repeat the same pattern
+	float value = scrambledRadicalInverse(HALTON_PRIMES[primeIndex], sampleNumber, hash32(pixelSeed ^ hash32(primeIndex)));
+	return value < ONE_MINUS_EPSILON ? value : ONE_MINUS_EPSILON;
 }
 
-void IntegerSampler::sample2D(int &a, int &b)
+uint32_t PathSampler::sobolSeed(unsigned int dim) const
 {
-	a = distribution(generator);
-	b = distribution(generator);
+	return hash32(pixelSeed + dim * 0x9e3779b9u);
 }
 
-void FloatSampler::sample1D(float &a)
+// =====================================================================
+
+Vector PathSampler::samplePlane()
 {
-	a = distribution(generator);
+	float a, b;
+	sample2D(a, b);
+	return Vector(a, b, 0.0f);
+}
+
+Vector PathSampler::sampleSphere()
+{
+	float a, b;
+	sample2D(a, b);
+
+	float theta = 2.0f * float(M_PI) * a;
+	float phi = acos(1 - 2 * b);
+	float x = sin(phi) * cosf(theta);
+	float y = sinf(phi) * sinf(theta);
+	float z = cosf(phi);
+
+	return Vector(x, y, z);
 }
 
-void FloatSampler::sample2D(float &a, float &b)
+// Direction around the y axis with pdf = cos / PI: a uniform point in the unit disk,
+// projected up to the hemisphere (Malley's method)
+Vector PathSampler::sampleCosineHemiSphere()
 {
-	a = distribution(generator);
-	b = distribution(generator);
+	float a, b;
+	sample2D(a, b);
+
+	float sinTheta = sqrtf(a);
+	float phi = 2.0f * float(M_PI) * b;
+	float x = sinTheta * cosf(phi);
+	float z = sinTheta * sinf(phi);
+
+	return Vector(x, sqrtf(1.0f - a), z);
+}
+
+// =====================================================================
+
+void AliasTable::build(const std::vector<float> & weights)
+{
+	const unsigned int count = (unsigned int)weights.size();
+	bins.assign(count, Bin());
+	probabilities.assign(count, 0.0f);
+	if (count == 0)
+	{
+		return;
+	}
+
+	double total = 0.0;
+	for (float weight : weights)
+	{
+		total += weight > 0.0f ? weight : 0.0f;
+	}
+
+	// Bins are scaled so the average is one. Those below it are filled up by the ones above
+	std::vector<double> scaled(count);
+	std::vector<unsigned int> small, large;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		double probability = total > 0.0 ? (weights[i] > 0.0f ? weights[i] / total : 0.0) : 1.0 / double(count);
+		probabilities[i] = float(probability);
+		scaled[i] = probability * double(count);
+		if (scaled[i] < 1.0)
+		{
+			small.push_back(i);
+		}
+		else
+		{
+			large.push_back(i);
+		}
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		unsigned int less = small.back();
+		small.pop_back();
+		unsigned int more = large.back();
+		large.pop_back();
+
+		bins[less].threshold = float(scaled[less]);
+		bins[less].alias = more;
+
+		scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+		if (scaled[more] < 1.0)
+		{
+			small.push_back(more);
+		}
+		else
+		{
+			large.push_back(more);
+		}
+	}
+
+	// Whatever is left is one up to rounding errors
+	for (unsigned int i : large)
+	{
+		bins[i].threshold = 1.0f;
+		bins[i].alias = i;
+	}
+	for (unsigned int i : small)
+	{
+		bins[i].threshold = 1.0f;
+		bins[i].alias = i;
+	}
+}
+
+unsigned int AliasTable::sample(float u, float v, float & pdf) const
+{
+	const unsigned int count = (unsigned int)bins.size();
+
+	unsigned int bin = (unsigned int)(u * float(count));
+	bin = bin < count ? bin : count - 1;
+
+	unsigned int index = v < bins[bin].threshold ? bin : bins[bin].alias;
+	pdf = probabilities[index];
+	return index;
 }
\ No newline at end of file
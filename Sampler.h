@@ -1,103 +1,156 @@
 #pragma once
 
-#include <random>
+#include <stdint.h>
+#include <vector>
 #define _USE_MATH_DEFINES
 #include <math.h>
 
 #include "Utils.h"
 
-template<class T>
-class Sampler
-{
-protected:
-	std::default_random_engine generator;
+/*
+PCG32 Class - Small and fast pseudo random generator (http://www.pcg-random.org)
 
-	T intervalStart;
-	T intervalEnd;
+64 bits of state and one increment that selects the stream. Copying it is cheap, so
+every path owns its own generator instead of sharing one between threads
+*/
+class PCG32
+{
+private:
+	uint64_t state;
+	uint64_t inc;
 public:
-	Sampler(T is, T ie)
-	{
-		intervalStart = is;
-		intervalEnd = ie;
-	}
+	PCG32() :state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}
 
-	Vector sampleSphere()
-	{
-		T a, b;
-		sample2D(a, b);
-
-		float theta = 2.0f * float(M_PI) * a;
-		float phi = acos(1 - 2 * b);
-		float x = sin(phi) * cosf(theta);
-		float y = sinf(phi) * sinf(theta);
-		float z = cosf(phi);
-
-		return Vector(x, y, z);
-	}
+	PCG32(uint64_t initState, uint64_t initSequence) { seed(initState, initSequence); }
 
-	Vector sampleHemiSphere()
+	void seed(uint64_t initState, uint64_t initSequence)
 	{
-		T a, b;
-		sample2D(a, b);
-
-		float sinTheta = sqrtf(1.0f - a * b);
-		float phi = 2.0f * float(M_PI) * b;
-		float x = sinTheta * cosf(phi);
-		float z = sinTheta * sinf(phi);
-
-		return Vector(x, a, z);
+		state = 0u;
+		inc = (initSequence << 1u) | 1u;
+		nextUInt();
+		state += initState;
+		nextUInt();
 	}
 
-	virtual Vector samplePlane()
+	uint32_t nextUInt()
 	{
-		T a, b;
-		sample2D(a, b);
-		return Vector(float(a), float(b), 0.0f);
+		uint64_t oldState = state;
+		state = oldState * 6364136223846793005ULL + inc;
+		uint32_t xorShifted = uint32_t(((oldState >> 18u) ^ oldState) >> 27u);
+		uint32_t rot = uint32_t(oldState >> 59u);
+		return (xorShifted >> rot) | (xorShifted << ((32u - rot) & 31u));
 	}
 
-	T sampleRect()
+	// Uniform float in [0, 1), using the 24 high bits
+	float nextFloat()
 	{
-		T a;
-		sample1D(a);
-		return a;
+		return float(nextUInt() >> 8) * (1.0f / 16777216.0f);
 	}
-protected:
-	virtual void sample1D(T &a) { };
-	virtual void sample2D(T &a, T &b) { };
 };
 
-class IntegerSampler : public Sampler<int>
+/*
+SamplerType - Sequence a PathSampler draws its numbers from. Selected per scene
+*/
+enum SamplerType
 {
-private:
-	std::uniform_int_distribution<int> distribution;
-public:
-	IntegerSampler(int istart = 0, int iend = 1) :Sampler(istart, iend)
-	{ 
-		distribution = std::uniform_int_distribution<int>(istart, iend);
-	}
-protected:
-	void sample1D(int &a);
-	void sample2D(int &a, int &b);
+	UNIFORM_SAMPLER = 0,	// Independent PCG32 numbers
+	HALTON_SAMPLER = 1,		// Halton sequence, with random digit scrambling per pixel
+	SOBOL_SAMPLER = 2		// Owen scrambled 2D Sobol points, padded with a different scrambling per dimension
 };
 
-class FloatSampler : public Sampler<float>
+/*
+PathSampler Class - Random numbers used by a single camera sample
+
+It is created on the stack by the tracer for every (pixel, sample index) pair and passed by
+reference to everything that samples along the path (materials, lights, shapes). Its sequence
+only depends on the pixel and the sample index, so an image is the same no matter how many
+threads render it or in which order the pixels are processed.
+
+Every sampleRect/sample2D call consumes one dimension. With the low discrepancy types, the
+samples of a pixel are stratified dimension by dimension, so the same decision must use the
+same dimension on every sample: tracers call startDimension at the beginning of each bounce.
+Dimensions beyond what the sequence supports fall back to PCG32
+*/
+class PathSampler
 {
 private:
-	std::uniform_real_distribution<float> distribution;
+	SamplerType type;
+	PCG32 generator;
+	uint32_t pixelSeed;
+	uint32_t sampleNumber;
+	uint32_t reversedSampleNumber;	// Sobol sample index, with its bits reversed
+	unsigned int dimension;
 public:
-	FloatSampler(float intervalStart = 0.0f, float intervalEnd = 1.0f) :Sampler(intervalStart, intervalEnd) 
+	PathSampler(unsigned int pixelX, unsigned int pixelY, unsigned int sampleIndex, SamplerType type = UNIFORM_SAMPLER);
+
+	// Next dimension to be used
+	void startDimension(unsigned int firstDimension) { dimension = firstDimension; }
+
+	// Uniform float in [0, 1)
+	float sampleRect();
+
+	// Uniform point in [0, 1)^2, stratified as a whole
+	void sample2D(float & a, float & b);
+
+	// Uniform integer in [0, count - 1]
+	unsigned int sampleIndex(unsigned int count)
+	{
+		if (type == UNIFORM_SAMPLER)
+		{
+			return (unsigned int)((uint64_t(generator.nextUInt()) * count) >> 32);
+		}
+		unsigned int index = (unsigned int)(sampleRect() * float(count));
+		return index < count ? index : count - 1;
+	}
+
+	Vector samplePlane();
+	Vector sampleSphere();
+	Vector sampleCosineHemiSphere();
+private:
+	float sampleHalton(unsigned int primeIndex);
+	uint32_t sobolSeed(unsigned int dim) const;
+
+	// Spreads consecutive pixel keys over the whole seed space (splitmix64 finalizer)
+	static uint64_t mixBits(uint64_t v)
 	{
-		distribution = std::uniform_real_distribution<float>(intervalStart, intervalEnd);
+		v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+		return v ^ (v >> 31);
 	}
-protected:
-	void sample1D(float &a);
-	void sample2D(float &a, float &b);
 };
 
-class MultiJitteredSampler : public Sampler<float>
+/*
+AliasTable Class - Chooses an index with probability proportional to its weight in O(1)
+
+Walker's alias method, built with Vose's algorithm: every bin keeps its own index with the
+probability of its threshold and gives its alias otherwise. One uniform number chooses the bin and
+another one the index inside it, so big tables don't leave the second choice without precision.
+Without any positive weight, indices are chosen uniformly
+*/
+class AliasTable
 {
 private:
-	std::uniform_real_distribution<float> distribution;
+	struct Bin
+	{
+		float threshold;		// Probability of keeping the bin index instead of its alias
+		unsigned int alias;
+	};
+
+	std::vector<Bin> bins;
+	std::vector<float> probabilities;
+public:
+	AliasTable() {}
+
+	void build(const std::vector<float> & weights);
+
+	unsigned int size(void) const { return (unsigned int)bins.size(); }
+
+	// Index for the uniform numbers u (the bin) and v (the bin or its alias) in [0, 1).
+	// Gives the probability of having chosen it
+	unsigned int sample(float u, float v, float & pdf) const;
+
+	// Probability of choosing the given index
+	float pdf(unsigned int index) const { return probabilities[index]; }
 };
 
 //http://www.cs.princeton.edu/~funk/tog02.pdf
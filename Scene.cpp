@@ -1,21 +1,6 @@
-#ifdef _OS_X_
-#include <OpenGL/gl.h>
-#include <OpenGL/glu.h>
-#include <GLUT/glut.h>	
-
-#elif defined(WIN32)
-#include <windows.h>
-#include "GL/gl.h"
-#include "GL/glu.h"
-#include "GL/glut.h"
-
-#else
-#include <GL/gl.h>
-#include <GL/glu.h>
-#include <GL/glut.h>
-#endif
-
+#include <string.h>
 #include <map>
+#include <unordered_map>
 
 #include "Scene.h"
 #include "Config.h"
@@ -46,6 +31,33 @@ bool Scene::Load (char *filename)
 	m_Background.color = ParseColor (tempNode.getChildNode("color"));
 	m_Background.ambientLight = ParseColor (tempNode.getChildNode("ambientLight"));
 
+	// Load the Render Settings (optional, the defaults of Config.h otherwise)
+	tempNode = sceneXML.getChildNode("render_settings");
+	if (!tempNode.isEmpty ())
+	{
+		m_Settings.load (tempNode);
+	}
+
+	// Load the Sampler (optional, uniform random numbers by default)
+	m_SamplerType = UNIFORM_SAMPLER;
+	tempNode = sceneXML.getChildNode("sampler");
+	if (!tempNode.isEmpty ())
+	{
+		const char * samplerType = CHECK_ATTR(tempNode.getAttribute("type"));
+		if (strcmp(samplerType, "halton") == 0)
+		{
+			m_SamplerType = HALTON_SAMPLER;
+		}
+		else if (strcmp(samplerType, "sobol") == 0)
+		{
+			m_SamplerType = SOBOL_SAMPLER;
+		}
+		else if (strcmp(samplerType, "uniform") != 0)
+		{
+			printf ("Unknown sampler type %s, using uniform\n", samplerType);
+		}
+	}
+
 	// Load the Lights
 	printf ("Loading Lights...\n");
 	tempNode = sceneXML.getChildNode("light_list");
@@ -85,12 +97,11 @@ bool Scene::Load (char *filename)
 			tempLight->attenuationQuadratic = atof(CHECK_ATTR(tempLightNode.getChildNode("attenuation").getAttribute ("quadratic")));
 			tempLight->position = ParseXYZ (tempLightNode.getChildNode("position"));
 			tempLight->id = atoi(CHECK_ATTR(tempLightNode.getChildNode("id").getAttribute("val")));
+			tempLight->index = (unsigned int)m_LightList.size ();
 			m_LightList.push_back (tempLight);
 		}
 	}
 
-	lightSampler = IntegerSampler(0, int(m_LightList.size() - 1));
-
 	// Load the Materials
 	printf ("Loading Materials...\n");
 	tempNode = sceneXML.getChildNode("material_list");
@@ -145,8 +156,9 @@ bool Scene::Load (char *filename)
 				tempSphere->rotation = ParseXYZ (tempObjectNode.getChildNode("rotation"));
 				tempSphere->position = ParseXYZ (tempObjectNode.getChildNode("position"));
 				tempSphere->center = ParseXYZ (tempObjectNode.getChildNode("center"));
-				tempSphere->physicalMaterial = (CHECK_ATTR(tempObjectNode.getChildNode("physicalMaterial").getAttribute("name")));
+				tempSphere->SetPhysicalMaterial(CHECK_ATTR(tempObjectNode.getChildNode("physicalMaterial").getAttribute("name")));
 				tempSphere->applyAffineTransformations();
+				tempSphere->computeArea();
 				m_ObjectList.push_back (tempSphere);
 
 				unsigned int lightSource = atoi(CHECK_ATTR(tempObjectNode.getAttribute("lightId")));
@@ -164,7 +176,7 @@ bool Scene::Load (char *filename)
 				tempTriangle->scale = ParseXYZ (tempObjectNode.getChildNode("scale"));
 				tempTriangle->rotation = ParseXYZ (tempObjectNode.getChildNode("rotation"));
 				tempTriangle->position = ParseXYZ (tempObjectNode.getChildNode("position"));
-				tempTriangle->physicalMaterial = (CHECK_ATTR(tempObjectNode.getChildNode("physicalMaterial").getAttribute("name")));
+				tempTriangle->SetPhysicalMaterial(CHECK_ATTR(tempObjectNode.getChildNode("physicalMaterial").getAttribute("name")));
 				
 				// Load Vertex 0
 				vertexNode = tempObjectNode.getChildNodeWithAttribute ("vertex", "index", "0");
@@ -215,196 +227,49 @@ bool Scene::Load (char *filename)
 				tempModel->scale = ParseXYZ (tempObjectNode.getChildNode("scale"));
 				tempModel->rotation = ParseXYZ (tempObjectNode.getChildNode("rotation"));
 				tempModel->position = ParseXYZ (tempObjectNode.getChildNode("position"));
-				tempModel->physicalMaterial = CHECK_ATTR(tempObjectNode.getChildNode("physicalMaterial").getAttribute("name"));
+				tempModel->SetPhysicalMaterial(CHECK_ATTR(tempObjectNode.getChildNode("physicalMaterial").getAttribute("name")));
 				
-				SceneMaterial * materialPtr = GetMaterial(material);
+				tempModel->material = GetMaterial(material);
 
-				// Check the file format
-				if (tempModel->filename.substr (tempModel->filename.length() - 4, 4) == ".3ds")
+				// Models using the same file share the loaded mesh
+				std::shared_ptr<TriangleMesh> & mesh = m_MeshCache[tempModel->filename];
+				bool instanced = (mesh != nullptr);
+				if (!instanced)
 				{
-					// Load the list of triangles from the .3ds
-					C3DS sceneObj;
-					if (!sceneObj.Create((char *)tempModel->filename.c_str()))
+					mesh = std::make_shared<TriangleMesh> ();
+					if (!LoadMesh (tempModel->filename, *mesh))
 					{
-						printf ("Error loading .3ds file\n");
 						return false;
 					}
-
-					for (unsigned int obj = 0; obj < (unsigned int)sceneObj.m_iNumMeshs; obj++)
-					{
-						for (unsigned int n = 0; n < (unsigned int)sceneObj.m_pMeshs[obj].iNumFaces; n++)
-						{
-							SceneTriangle tempTriangle;
-
-							Vector v1, v2, v3;
-							// Vert 1
-							v1.x = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[0]].x;
-							v1.y = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[0]].y;
-							v1.z = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[0]].z;
-							// Vert 2
-							v2.x = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[1]].x;
-							v2.y = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[1]].y;
-							v2.z = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[1]].z;
-							// Vert 3
-							v3.x = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[2]].x;
-							v3.y = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[2]].y;
-							v3.z = sceneObj.m_pMeshs[obj].pVerts[sceneObj.m_pMeshs[obj].pFaces[n].corner[2]].z;
-
-							// Normal
-							Vector normal = (v1 - v2).Cross(v3 - v2).Normalize();
-
-							// Load Vertex 0
-							tempTriangle.material[0] = materialPtr;
-							tempTriangle.vertex[0] = v1;
-							tempTriangle.normal[0] = normal;
-							// Texture Coords
-
-							if (sceneObj.m_pMeshs[obj].bTextCoords)
-							{
-								tempTriangle.u[0] = sceneObj.m_pMeshs[obj].pTexs[sceneObj.m_pMeshs[obj].pFaces[n].corner[0]].tu;
-								tempTriangle.v[0] = sceneObj.m_pMeshs[obj].pTexs[sceneObj.m_pMeshs[obj].pFaces[n].corner[0]].tv;
-							}
-							else
-							{
-								tempTriangle.u[0] = 0.0f;
-								tempTriangle.v[0] = 0.0f;
-							}
-
-							// Load Vertex 1
-							tempTriangle.material[1] = materialPtr;
-							tempTriangle.vertex[1] = v2;
-							tempTriangle.normal[1] = normal;
-							// Texture Coords
-							if (sceneObj.m_pMeshs[obj].bTextCoords)
-							{
-								tempTriangle.u[1] = sceneObj.m_pMeshs[obj].pTexs[sceneObj.m_pMeshs[obj].pFaces[n].corner[1]].tu;
-								tempTriangle.v[1] = sceneObj.m_pMeshs[obj].pTexs[sceneObj.m_pMeshs[obj].pFaces[n].corner[1]].tv;
-							}
-							else
-							{
-								tempTriangle.u[1] = 0.0f;
-								tempTriangle.v[1] = 0.0f;
-							}
-
-							// Load Vertex 2
-							tempTriangle.material[2] = materialPtr;
-							tempTriangle.vertex[2] = v3;
-							tempTriangle.normal[2] = normal;
-							// Texture Coords
-							if (sceneObj.m_pMeshs[obj].bTextCoords)
-							{
-								tempTriangle.u[2] = sceneObj.m_pMeshs[obj].pTexs[sceneObj.m_pMeshs[obj].pFaces[n].corner[2]].tu;
-								tempTriangle.v[2] = sceneObj.m_pMeshs[obj].pTexs[sceneObj.m_pMeshs[obj].pFaces[n].corner[2]].tv;
-							}
-							else
-							{
-								tempTriangle.u[2] = 0.0f;
-								tempTriangle.v[2] = 0.0f;
-							}
-
-							tempTriangle.physicalMaterial = tempModel->physicalMaterial;
-
-							tempModel->triangleList.push_back (tempTriangle);
-						}
-					}
-
-					sceneObj.Release();
-				}
-				else if (tempModel->filename.substr (tempModel->filename.length() - 4, 4) == ".obj")
-				{
-					// The following code is a modified version of code from the old RayTracer Code rt_trimesh.cpp
-					char line[MAX_LINE_LEN];
-					char command[MAX_LINE_LEN];
-					int position;
-					vector<Vector> vertices;
-					vector<Vector> normals;
-
-					std::ifstream infile (tempModel->filename.c_str());
-
-					if (infile.fail() )
-					{
-						printf ("Error loading .obj file\n");
-						return false;
-					}
-
-					while (infile.good ())
-					{
-						infile.getline (line, MAX_LINE_LEN);
-						ParseOBJCommand (line, MAX_LINE_LEN, command, position);
-
-						if (strcmp (command,"v")==0)
-						{
-							Vector pos = ParseOBJVector (&(line[position]));
-							vertices.push_back (pos);
-						}
-						else if (strcmp (command,"vn")==0)
-						{
-							Vector norm = ParseOBJVector (&(line[position]));
-							normals.push_back (norm);
-						}
-						else if (strcmp (command,"f")==0)
-						{
-							int num = 0; // number of edges
-							int v_index[3]; // vertex index
-							int n_index[3]; // normal index
-
-							if (!ParseOBJCoords (&(line[position]), num, v_index, n_index))
-							{
-								printf ("Error parsing faces in .obj file\n");
-								return false;
-							}
-
-							SceneTriangle tempTriangle;
-
-							// Load Vertex 0
-							tempTriangle.material[0] = materialPtr;
-							tempTriangle.vertex[0] = vertices[v_index[0]];
-							tempTriangle.normal[0] = normals[n_index[0]];
-							// Texture Coords
-							tempTriangle.u[0] = 0.0f;
-							tempTriangle.v[0] = 0.0f;
-
-							// Load Vertex 1
-							tempTriangle.material[1] = materialPtr;
-							tempTriangle.vertex[1] = vertices[v_index[1]];
-							tempTriangle.normal[1] = normals[n_index[1]];
-							// Texture Coords
-							tempTriangle.u[1] = 0.0f;
-							tempTriangle.v[1] = 0.0f;
-
-							// Load Vertex 2
-							tempTriangle.material[2] = materialPtr;
-							tempTriangle.vertex[2] = vertices[v_index[2]];
-							tempTriangle.normal[2] = normals[n_index[2]];
-							// Texture Coords
-							tempTriangle.u[2] = 0.0f;
-							tempTriangle.v[2] = 0.0f;
-
-							tempTriangle.physicalMaterial = tempModel->physicalMaterial;
-
-							tempModel->triangleList.push_back (tempTriangle);
-						}
-						else
-						{
-							//printf ("Ignoring command <%s> in obj file\n", command);
-						}
-					}
-					infile.close ();
-				}
-				else
-				{
-					printf ("Unsupported file format\n");
-					return false;
 				}
+				tempModel->mesh = mesh;
 
 				tempModel->applyAffineTransformations();
 #ifdef _RT_USE_BB
 				tempModel->initBoundingVolume(CHECK_ATTR(tempObjectNode.getChildNode("boundingVolume").getAttribute("type")));
+#endif
+#ifdef _RT_USE_BVH
+				tempModel->buildBVH();
 #endif
 				tempModel->computeArea();
-				tempModel->initSampler();
 				m_ObjectList.push_back (tempModel);
 
+				const TriangleMesh & modelMesh = tempModel->GetMesh();
+				if (!instanced)
+				{
+					printf ("\t%s: %u triangles, %u vertices, %.1f bytes/triangle\n", tempModel->filename.c_str(),
+						modelMesh.GetNumTriangles(), modelMesh.GetNumVertices(), float(modelMesh.getMemoryUsage()) / float(modelMesh.GetNumTriangles()));
+				}
+				else if (&modelMesh == mesh.get())
+				{
+					printf ("\t%s: instance, %u triangles shared\n", tempModel->filename.c_str(), modelMesh.GetNumTriangles());
+				}
+				else
+				{
+					printf ("\t%s: baked copy of the loaded mesh, %.1f bytes/triangle\n", tempModel->filename.c_str(),
+						float(modelMesh.getMemoryUsage()) / float(modelMesh.GetNumTriangles()));
+				}
+
 				unsigned int lightSource = atoi(CHECK_ATTR(tempObjectNode.getAttribute("lightId")));
 				if (lightSource > 0)
 				{
@@ -452,11 +317,175 @@ bool Scene::Load (char *filename)
 	m_Camera.SetTarget (ParseXYZ (tempNode.getChildNode("target")));
 	m_Camera.SetUp (ParseXYZ (tempNode.getChildNode("up")));
 
+#ifdef _RT_USE_BVH
+	printf ("Building object hierarchy...\n");
+	BuildObjectBVH ();
+#endif
+
+#ifdef _RT_USE_LIGHT_BVH
+	printf ("Building light hierarchy...\n");
+	BuildLightBVH ();
+#endif
+
 	printf ("Scene Loaded!\n");
 
 	return true;
 }
 
+#ifdef _RT_USE_BVH
+void Scene::BuildObjectBVH (void)
+{
+	std::vector<AABB> objectBounds;
+	objectBounds.reserve(m_ObjectList.size());
+	for (SceneObject * object : m_ObjectList)
+	{
+		objectBounds.push_back(object->computeWorldBounds());
+	}
+
+	m_ObjectBVH.build(objectBounds);
+}
+#endif
+
+#ifdef _RT_USE_LIGHT_BVH
+void Scene::BuildLightBVH (void)
+{
+	std::vector<LightBounds> lightBounds;
+	lightBounds.reserve(m_LightList.size());
+	for (SceneLight * light : m_LightList)
+	{
+		lightBounds.push_back(light->getLightBounds());
+	}
+
+	m_LightBVH.build(lightBounds);
+}
+#endif
+
+// Loads the triangles of a .3ds or .obj file into an indexed mesh, in the file space
+bool Scene::LoadMesh (const std::string & filename, TriangleMesh & mesh)
+{
+	// Check the file format
+	if (filename.substr (filename.length() - 4, 4) == ".3ds")
+	{
+		// Load the vertices and faces of every .3ds mesh. Faces are flat shaded
+		C3DS sceneObj;
+		if (!sceneObj.Create((char *)filename.c_str()))
+		{
+			printf ("Error loading .3ds file\n");
+			return false;
+		}
+
+		for (unsigned int obj = 0; obj < (unsigned int)sceneObj.m_iNumMeshs; obj++)
+		{
+			const unsigned int firstVertex = mesh.GetNumVertices();
+
+			for (unsigned int n = 0; n < (unsigned int)sceneObj.m_pMeshs[obj].iNumVerts; n++)
+			{
+				mesh.positions.push_back (Vector (sceneObj.m_pMeshs[obj].pVerts[n].x,
+					sceneObj.m_pMeshs[obj].pVerts[n].y,
+					sceneObj.m_pMeshs[obj].pVerts[n].z));
+
+				// Texture Coords
+				MeshTexCoord texCoord = { 0.0f, 0.0f };
+				if (sceneObj.m_pMeshs[obj].bTextCoords)
+				{
+					texCoord.u = sceneObj.m_pMeshs[obj].pTexs[n].tu;
+					texCoord.v = sceneObj.m_pMeshs[obj].pTexs[n].tv;
+				}
+				mesh.texCoords.push_back (texCoord);
+			}
+
+			for (unsigned int n = 0; n < (unsigned int)sceneObj.m_pMeshs[obj].iNumFaces; n++)
+			{
+				mesh.indices.push_back (firstVertex + sceneObj.m_pMeshs[obj].pFaces[n].corner[0]);
+				mesh.indices.push_back (firstVertex + sceneObj.m_pMeshs[obj].pFaces[n].corner[1]);
+				mesh.indices.push_back (firstVertex + sceneObj.m_pMeshs[obj].pFaces[n].corner[2]);
+			}
+		}
+
+		sceneObj.Release();
+	}
+	else if (filename.substr (filename.length() - 4, 4) == ".obj")
+	{
+		// The following code is a modified version of code from the old RayTracer Code rt_trimesh.cpp
+		char line[MAX_LINE_LEN];
+		char command[MAX_LINE_LEN];
+		int position;
+		vector<Vector> vertices;
+		vector<Vector> normals;
+
+		// Mesh vertex of every position/normal index pair already used by a face
+		std::unordered_map<unsigned long long, unsigned int> meshVertices;
+
+		std::ifstream infile (filename.c_str());
+
+		if (infile.fail() )
+		{
+			printf ("Error loading .obj file\n");
+			return false;
+		}
+
+		while (infile.good ())
+		{
+			infile.getline (line, MAX_LINE_LEN);
+			ParseOBJCommand (line, MAX_LINE_LEN, command, position);
+
+			if (strcmp (command,"v")==0)
+			{
+				Vector pos = ParseOBJVector (&(line[position]));
+				vertices.push_back (pos);
+			}
+			else if (strcmp (command,"vn")==0)
+			{
+				Vector norm = ParseOBJVector (&(line[position]));
+				normals.push_back (norm);
+			}
+			else if (strcmp (command,"f")==0)
+			{
+				int num = 0; // number of edges
+				int v_index[3]; // vertex index
+				int n_index[3]; // normal index
+
+				if (!ParseOBJCoords (&(line[position]), num, v_index, n_index))
+				{
+					printf ("Error parsing faces in .obj file\n");
+					return false;
+				}
+
+				for (unsigned int corner = 0; corner < 3; corner++)
+				{
+					unsigned long long key = ((unsigned long long)(unsigned int)v_index[corner] << 32) | (unsigned int)n_index[corner];
+					auto found = meshVertices.find (key);
+					if (found == meshVertices.end ())
+					{
+						found = meshVertices.insert (std::make_pair (key, mesh.GetNumVertices ())).first;
+						mesh.positions.push_back (vertices[v_index[corner]]);
+						mesh.normals.push_back (normals[n_index[corner]]);
+					}
+					mesh.indices.push_back (found->second);
+				}
+			}
+			else
+			{
+				//printf ("Ignoring command <%s> in obj file\n", command);
+			}
+		}
+		infile.close ();
+	}
+	else
+	{
+		printf ("Unsupported file format\n");
+		return false;
+	}
+
+	mesh.positions.shrink_to_fit ();
+	mesh.normals.shrink_to_fit ();
+	mesh.texCoords.shrink_to_fit ();
+	mesh.indices.shrink_to_fit ();
+	mesh.precompute ();
+
+	return true;
+}
+
 void Scene::ParseOBJCommand (char *line, int max, char *command, int &position)
 {
 	int i = 0;
@@ -21,6 +21,7 @@
 	Scene::GetDescription () - get the scene description string
 	Scene::GetAuthor () - get the scene author string
 	Scene::GetBackground () - get the scene background information
+	Scene::GetSettings () - get the render settings (resolution, tracer, samples...)
 	Scene::GetNumLights () - get the number of lights in the scene
 	Scene::GetLight (lightIndex) - get one of the lights in the scene
 	Scene::GetNumMaterials () - get the number of materials in the scene
@@ -51,6 +52,8 @@
 #include <stdlib.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
 #include <fstream>
 #include <time.h>
 
@@ -69,6 +72,7 @@
 #include "SceneObject.h"
 #include "SceneLight.h"
 #include "Sampler.h"
+#include "RenderSettings.h"
 
 // Max Line Length for OBJ File Loading
 #define MAX_LINE_LEN 1000
@@ -76,15 +80,6 @@
 #define CHECK_ATTR(a) (a == NULL ? "" : a)
 #define CHECK_ATTR2(a,b) (a == NULL ? b : a)
 
-enum TracerType
-{
-	RAY_TRACE = 0,
-	SUPER_SAMPLING_RAY_TRACE = 1,
-	MONTE_CARLO_RAY_TRACE = 2,
-	BB_RAY_TRACE = 3,
-	PATH_TRACE = 4
-};
-
 /*
 	SceneBackground Class - The Background properties of a ray-trace scene
 
@@ -104,19 +99,22 @@ public:
 */
 class Scene
 {
-public:
-   static const int WINDOW_HEIGHT, WINDOW_WIDTH;
-   static TracerType tracerType;
-   static bool supersample;
-   static bool montecarlo;
-   static bool boundingbox;
 private:
 	std::string m_Desc, m_Author;
 	SceneBackground m_Background;
+	RenderSettings m_Settings;
+	SamplerType m_SamplerType;
 	std::vector<SceneLight *> m_LightList;
 	std::vector<SceneMaterial *> m_MaterialList;
 	std::vector<SceneObject *> m_ObjectList;
-
+#ifdef _RT_USE_BVH
+	BVH m_ObjectBVH;
+#endif
+#ifdef _RT_USE_LIGHT_BVH
+	LightBVH m_LightBVH;
+#endif
+	// Meshes already loaded, by filename. Shared by every model using the same file
+	std::map<std::string, std::shared_ptr<TriangleMesh>> m_MeshCache;
 
 
 	// - Private utility Functions used by Load () -
@@ -138,15 +136,22 @@ private:
 					   float(atof(node.getAttribute("z"))));
 	}
 
+#ifdef _RT_USE_BVH
+	void BuildObjectBVH (void);
+#endif
+#ifdef _RT_USE_LIGHT_BVH
+	void BuildLightBVH (void);
+#endif
+
+	bool LoadMesh (const std::string & filename, TriangleMesh & mesh);
 	void ParseOBJCommand (char *line, int max, char *command, int &position);
 	Vector ParseOBJVector (char *str);
 	bool ParseOBJCoords (char *str, int &num, int v_index[3], int n_index[3]);
 public:
 	Camera m_Camera;
-	IntegerSampler lightSampler;
 
 	// -- Constructors & Destructors --
-	Scene (void) {}
+	Scene (void) : m_SamplerType (UNIFORM_SAMPLER) {}
 	~Scene (void)
 	{
 		// Free the memory allocated from the objects
@@ -198,6 +203,13 @@ public:
 	// - GetBackground - Returns the SceneBackground
 	const SceneBackground& GetBackground (void) const { return m_Background; }
 
+	// - GetSettings - Returns the render settings, from their defaults and the render_settings element of the scene
+	RenderSettings & GetSettings (void) { return m_Settings; }
+	const RenderSettings & GetSettings (void) const { return m_Settings; }
+
+	// - GetSamplerType - Returns the sequence used by the Monte Carlo tracers
+	SamplerType GetSamplerType (void) const { return m_SamplerType; }
+
 	// - GetNumLights - Returns the number of lights in the scene
 	unsigned int GetNumLights (void) { return (unsigned int)m_LightList.size (); }
 
@@ -227,17 +239,50 @@ public:
 	// - GetObject - Returns the nth object [NOTE: The Object will need to be type-casted afterwards]
 	SceneObject *GetObject (int objIndex) { return m_ObjectList[objIndex]; }
 
+#ifdef _RT_USE_BVH
+	// - GetObjectBVH - Returns the top level hierarchy over the objects world bounds
+	//   [NOTE: Its primitive indices are the object indices used by GetObject]
+	const BVH & GetObjectBVH (void) const { return m_ObjectBVH; }
+#endif
+
 	// - GetCamera - Returns the camera class
 	Camera GetCamera (void) { return m_Camera; }
 
-	SceneLight * SampleLight(float &pdf)
+	// - SampleLight - Chooses a light for the given point and normal, giving the probability of choosing it.
+	//   With the light hierarchy lights are chosen by their estimated contribution, uniformly otherwise.
+	//   Returns NULL if no light can reach the point
+	SceneLight * SampleLight(Vector & point, Vector & normal, float &pdf, PathSampler & sampler)
 	{
-		int indice = lightSampler.sampleRect();
+#ifdef _RT_USE_LIGHT_BVH
+		unsigned int indice;
+		if (!m_LightBVH.sample(point, normal, sampler.sampleRect(), indice, pdf))
+		{
+			pdf = 0.0f;
+			return NULL;
+		}
+#else
+		if (GetNumLights() == 0)
+		{
+			pdf = 0.0f;
+			return NULL;
+		}
+		unsigned int indice = sampler.sampleIndex(GetNumLights());
 
-		pdf = 1.0f / float(GetNumLights() - 1);
+		pdf = 1.0f / float(GetNumLights());
+#endif
 
 		return GetLight(indice);
 	}
+
+	// - PdfLight - Probability of SampleLight choosing the given light for the point and normal
+	float PdfLight(Vector & point, Vector & normal, SceneLight * light)
+	{
+#ifdef _RT_USE_LIGHT_BVH
+		return m_LightBVH.pmf(point, normal, light->index);
+#else
+		return 1.0f / float(GetNumLights());
+#endif
+	}
 };
 
 
@@ -3,40 +3,85 @@
 #include <iostream>
 
 
-Vector PointLight::sampleDirection(Vector & fromPoint, float &pdf)
+Vector PointLight::sampleDirection(Vector & fromPoint, float &pdf, Vector &lightNormal, PathSampler & sampler)
 {
 	pdf = 1.0f;
+	lightNormal = Vector(0.0f, 0.0f, 0.0f, 0.0f);
 	return (position - fromPoint);
 }
 
+LightBounds PointLight::getLightBounds()
+{
+	// Isotropic: the intensity over the whole sphere of directions
+	AABB bounds;
+	bounds.expand(position);
+	return LightBounds(bounds, DirectionCone::EntireSphere(), 4.0f * float(M_PI) * (color.x + color.y + color.z) / 3.0f);
+}
+
 // ======================================================================
 
 
-Vector AreaLight::sampleDirection(Vector &fromPoint, float &pdf)
+Vector AreaLight::sampleDirection(Vector &fromPoint, float &pdf, Vector &lightNormal, PathSampler & sampler)
 {
-	int indice = shapeSampler.sampleRect();
+	if (totalArea <= 0.0f)
+	{
+		pdf = 0.0f;
+		return Vector();
+	}
+
+	float shapePdf, u, v;
+	sampler.sample2D(u, v);
+	unsigned int indice = shapeTable.sample(u, v, shapePdf);
 	SceneObject * shape = shapes[indice];
 
 	float posPdf;
-	Vector pos = shape->sampleShape(posPdf);
+	Vector pos = shape->sampleShape(fromPoint, posPdf, lightNormal, sampler);
 
-	//uniform distributed pdf($) = 1 / (b - a)
-	//pdf(pos) = from shape->sampleShape
-	//pdf(choosen shape) = 1 / (shapes.length - 1) (or (shapes.lenght - 1) - 0)
+	//pdf(choosen shape) = shape area / total area
+	//pdf(pos) = from shape->sampleShape, per unit area (it may depend on the point to light)
 	//pdf = pdf(pos) * pdf(choosen shape)
-	float shapePdf = shapes.size() < 2 ? 1.0f : float(shapes.size() - 1);
-	pdf = posPdf * (1.0f / shapePdf);
+	pdf = posPdf * shapePdf;
 	return (pos - fromPoint);
 }
 
+float AreaLight::pdfArea(const Vector & fromPoint, const HitInfo & hit)
+{
+	if (totalArea <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	// Same as the table probability of the hit shape, as its weight is the area
+	return hit.object->pdfShape(fromPoint, hit) * (hit.object->area / totalArea);
+}
+
+LightBounds AreaLight::getLightBounds()
+{
+	AABB bounds;
+	DirectionCone normals;
+	for (unsigned int i = 0; i < shapes.size(); i++)
+	{
+		bounds.expand(shapes[i]->computeWorldBounds());
+		DirectionCone shapeNormals = shapes[i]->computeNormalBounds();
+		normals = (i == 0) ? shapeNormals : DirectionCone::Union(normals, shapeNormals);
+	}
+
+	// Lambertian emission from both sides of every shape
+	return LightBounds(bounds, normals, 2.0f * float(M_PI) * totalArea * (color.x + color.y + color.z) / 3.0f);
+}
+
 void AreaLight::addShapes(std::vector<SceneObject *> & objects)
 {
+	std::vector<float> areas;
+	totalArea = 0.0f;
 	for (SceneObject * obj : objects)
 	{
-		obj->setEmissive(color);
+		obj->setEmissive(color, this);
+		obj->initShapeSampling();
+		areas.push_back(obj->area);
+		totalArea += obj->area;
 	}
 
 	shapes = objects;
-
-	shapeSampler = IntegerSampler(0, unsigned int(shapes.size() - 1));
+	shapeTable.build(areas);
 }
\ No newline at end of file
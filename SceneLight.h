@@ -5,6 +5,7 @@
 #include "Utils.h"
 #include "Sampler.h"
 #include "SceneObject.h"
+#include "LightBVH.h"
 
 
 /*
@@ -14,36 +15,49 @@ The Scene class holds a list of these
 */
 class SceneLight
 {
-protected:
-	FloatSampler sample;
 public:
 	SceneLight() { }
 	~SceneLight() { }
-	virtual Vector sampleDirection(Vector &fromPoint, float &pdf) = 0;
+
+	// Vector from fromPoint to a sampled point of the light (not normalized). Gives the pdf of
+	// that point per unit area and the light surface normal there
+	virtual Vector sampleDirection(Vector &fromPoint, float &pdf, Vector &lightNormal, PathSampler & sampler) = 0;
+
+	// Pdf per unit area with which sampleDirection, called from fromPoint, would choose the hit point of the light
+	virtual float pdfArea(const Vector & fromPoint, const HitInfo & hit) { return 0.0f; }
+
+	// Lights reduced to a single point can't be hit by rays, only sampled
+	virtual bool IsDeltaLight(void) const { return false; }
+
+	// World space extent and total emitted power, used to choose lights by their contribution
+	virtual LightBounds getLightBounds() = 0;
 
 	float attenuationConstant, attenuationLinear, attenuationQuadratic;
 	Vector color;
 	Vector position;
 	unsigned int id;
+	unsigned int index;		// Position in the scene light list
 };
 
 class PointLight: public SceneLight
 {
 public:
 	PointLight() { }
-	Vector sampleDirection(Vector &fromPoint, float &pdf);
+	Vector sampleDirection(Vector &fromPoint, float &pdf, Vector &lightNormal, PathSampler & sampler);
+	bool IsDeltaLight(void) const { return true; }
+	LightBounds getLightBounds();
 };
 
 class AreaLight : public SceneLight
 {
 private:
-	IntegerSampler shapeSampler;
 	std::vector<SceneObject*> shapes;
-
-	std::default_random_engine engine;
-	std::uniform_int_distribution<unsigned int> d;
+	AliasTable shapeTable;		// Chooses shapes proportionally to their area
+	float totalArea;
 public:
-	AreaLight() { }
-	Vector sampleDirection(Vector &fromPoint, float &pdf);
+	AreaLight() :totalArea(0.0f) { }
+	Vector sampleDirection(Vector &fromPoint, float &pdf, Vector &lightNormal, PathSampler & sampler);
+	float pdfArea(const Vector & fromPoint, const HitInfo & hit);
+	LightBounds getLightBounds();
 	void addShapes(std::vector<SceneObject *> & objects);
 };
\ No newline at end of file
@@ -1,13 +1,45 @@
 #include "SceneObject.h"
+#include "PhysicalMaterial.h"
 
 #include <random>
 #include <time.h>
 
+#ifdef _RT_COUNT_INTERSECTIONS
+std::atomic<unsigned long long> IntersectionStats::nodeTests(0);
+std::atomic<unsigned long long> IntersectionStats::primitiveTests(0);
+std::atomic<unsigned long long> IntersectionStats::intervalRejects(0);
+std::atomic<unsigned long long> IntersectionStats::primitiveHits(0);
+
+void IntersectionStats::reset()
+{
+	nodeTests = 0;
+	primitiveTests = 0;
+	intervalRejects = 0;
+	primitiveHits = 0;
+}
+
+void IntersectionStats::print()
+{
+	std::cout << "Node tests: " << nodeTests << std::endl;
+	std::cout << "Primitive tests: " << primitiveTests << " (" << intervalRejects << " rejected by the ray interval, " << primitiveHits << " closer hits)" << std::endl;
+}
+#endif
+
 // ==========================================================
 
-void SceneSphere::testIntersection(Ray & ray, HitInfo & outHitInfo)
+void SceneObject::SetPhysicalMaterial(const std::string & materialName)
 {
-	outHitInfo.hit = false;
+	physicalMaterial = materialName;
+	bsdf = PhysicalMaterialTable::getInstance().getMaterialByName(materialName);
+}
+
+// ==========================================================
+
+// Finds the closest root inside (tMin, maxDistance). Only the ray parameter and the
+// hit point in the sphere space are computed
+bool SceneSphere::intersectRay(const Ray & ray, float maxDistance, float & distance, Vector & localHitPoint)
+{
+	_RT_COUNT_STAT(primitiveTests);
 
 	// Centro del emisor de rayos y direccin de este
 	Vector o = ray.getOrigin();
@@ -31,52 +63,66 @@ void SceneSphere::testIntersection(Ray & ray, HitInfo & outHitInfo)
 	float ac4 = div * OC.Dot(OC);
 	float squareRootResult = (squaredB - ac4 + (radius * radius));
 
-	float distance = -1.0f;
+	if (squareRootResult < 0.0f)
+	{
+		return false;
+	}
 
 	// Si el resultado de B^2 - 4AC es 0, significa que hemos intersectado la esfera
-	// en un slo punto
-	if (squareRootResult == 0.0f && (-B) > 0.0f)
+	// en un slo punto. Si no, nos quedamos con la raz ms cercana dentro del intervalo del rayo
+	// (la direccin no se normaliza al pasar a espacio local, por lo que t es el mismo en ambos espacios)
+	float squareRoot = sqrt(squareRootResult);
+
+	float case1 = ((-B - squareRoot) / div);
+	float case2 = ((-B + squareRoot) / div);
+
+	float tMin = ray.getTMin();
+	distance = (case1 > tMin && case1 < maxDistance) ? case1 : case2;
+	if (distance <= tMin || distance >= maxDistance)
 	{
-		distance = (-B / div);
+		_RT_COUNT_STAT(intervalRejects);
+		return false;
 	}
-	else if (squareRootResult > 0.0f)
-	{
-		float squareRoot = sqrt(squareRootResult);
 
-		float case1 = ((-B - squareRoot) / div);
-		float case2 = ((-B + squareRoot) / div);
+	localHitPoint = o + (l * distance);
+	return true;
+}
 
-		if (case1 <= 0.0f && case2 > 0.0f)
-		{
-			distance = case2;
-		}
-		else if (case2 <= 0.0f && case1 > 0.0f)
-		{
-			distance = case1;
-		}
-		else
-		{
-			distance = case1 <= case2 ? case1 : case2;
-		}
+bool SceneSphere::testIntersection(Ray & ray, HitInfo & outHitInfo)
+{
+	float distance;
+	Vector hitPoint;
+	if (!intersectRay(ray, ray.getTMax(), distance, hitPoint))
+	{
+		return false;
 	}
 
-	if (distance > 0.0f)
-	{
-		Vector hitPoint(o + (l * distance));
+	Vector tempCenter = center;
 #ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
-		hitPoint = localToWorldMatrix * hitPoint;
-		tempCenter = localToWorldMatrix *  tempCenter;
+	hitPoint = localToWorldMatrix * hitPoint;
+	tempCenter = localToWorldMatrix *  tempCenter;
 #endif
-		outHitInfo.hitPoint = hitPoint;
-		outHitInfo.hitNormal = ((hitPoint - tempCenter) / radius).Normalize();
-		outHitInfo.hittedMaterial = *material;
-		outHitInfo.physicalMaterial = physicalMaterial;
-		outHitInfo.inRay = ray;
-		outHitInfo.hit = true;
-		outHitInfo.isLight = isLight;
-		outHitInfo.emission = emission;
-		outHitInfo.inRay.setDistance((hitPoint - o).Magnitude());
-	}
+	ray.setTMax(distance);
+	_RT_COUNT_STAT(primitiveHits);
+
+	outHitInfo.hitPoint = hitPoint;
+	outHitInfo.hitNormal = ((hitPoint - tempCenter) / radius).Normalize();
+	outHitInfo.hittedMaterial = *material;
+	outHitInfo.inRay = ray;
+	outHitInfo.hit = true;
+	outHitInfo.isLight = isLight;
+	outHitInfo.emission = emission;
+	outHitInfo.object = this;
+	outHitInfo.primitive = 0;
+	outHitInfo.inRay.setDistance((hitPoint - ray.getOrigin()).Magnitude());
+	return true;
+}
+
+bool SceneSphere::occluded(const Ray & ray, float maxDistance)
+{
+	float distance;
+	Vector hitPoint;
+	return intersectRay(ray, maxDistance, distance, hitPoint);
 }
 
 void SceneSphere::applyAffineTransformations()
@@ -92,18 +138,139 @@ void SceneSphere::applyAffineTransformations()
 #endif
 }
 
-Vector SceneSphere::sampleShape(float &pdf)
+void SceneSphere::computeArea()
+{
+	float worldRadius = radius;
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	// Assumes an uniform scale, as the intersection test does
+	worldRadius = (localToWorldMatrix * Vector(radius, 0.0f, 0.0f, 0.0f)).Magnitude();
+#endif
+	area = 4.0f * float(M_PI) * worldRadius * worldRadius;
+}
+
+void SceneSphere::initShapeSampling()
 {
-	Vector sample = sampler.sampleSphere();
-	pdf = 1.0f / (float(M_PI) * 4.0f);
-	return (center + sample * radius); // In world space
+	worldCenter = center;
+	worldRadius = radius;
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	worldCenter = localToWorldMatrix * worldCenter;
+	worldRadius = (localToWorldMatrix * Vector(radius, 0.0f, 0.0f, 0.0f)).Magnitude();
+#endif
+	worldCenter.w = 1.0f;
+}
+
+float SceneSphere::computeCosThetaMax(const Vector & fromPoint, float & squaredDistance) const
+{
+	Vector toCenter = worldCenter;
+	toCenter = toCenter - fromPoint;
+	squaredDistance = toCenter.Dot(toCenter);
+
+	float squaredRadius = worldRadius * worldRadius;
+	if (squaredDistance <= squaredRadius)
+	{
+		return -1.0f;
+	}
+	return sqrtf(maxValue(0.0f, 1.0f - squaredRadius / squaredDistance));
+}
+
+Vector SceneSphere::sampleShape(const Vector & fromPoint, float &pdf, Vector &normal, PathSampler & sampler)
+{
+	float squaredDistance;
+	float cosThetaMax = computeCosThetaMax(fromPoint, squaredDistance);
+
+	// From inside every point can be seen: uniform point on the surface
+	if (cosThetaMax < 0.0f)
+	{
+		Vector sample = sampler.sampleSphere();
+		Vector point = worldCenter + sample * worldRadius;
+		point.w = 1.0f;
+		normal = Vector(sample.x, sample.y, sample.z, 0.0f);
+		pdf = 1.0f / area;
+		return point;
+	}
+
+	// Otherwise only the cap facing the point is visible. A direction is chosen uniformly inside the
+	// cone the sphere subtends, and mapped to the point of the sphere it sees first
+	// (PBRT, 4th edition, 6.2.4). The differences to one keep their precision for small cones
+	float a, b;
+	sampler.sample2D(a, b);
+
+	float sinThetaMax2 = worldRadius * worldRadius / squaredDistance;
+	float oneMinusCosThetaMax = sinThetaMax2 / (1.0f + cosThetaMax);
+	float oneMinusCosTheta = a * oneMinusCosThetaMax;
+	float cosTheta = 1.0f - oneMinusCosTheta;
+	float sinTheta2 = oneMinusCosTheta * (1.0f + cosTheta);
+
+	// Angle at the center between the point to light and the sampled point
+	float cosAlpha = sinTheta2 / sqrtf(sinThetaMax2) + cosTheta * sqrtf(maxValue(0.0f, 1.0f - sinTheta2 / sinThetaMax2));
+	float sinAlpha = sqrtf(maxValue(0.0f, 1.0f - cosAlpha * cosAlpha));
+	float phi = 2.0f * float(M_PI) * b;
+
+	Vector zVector = fromPoint;
+	zVector = zVector - worldCenter;
+	zVector.w = 0.0f;
+	zVector.Normalize();
+	Vector yVector, xVector;
+	ComputeOrthoNormalBasis(zVector, yVector, xVector);
+
+	normal = xVector * (sinAlpha * cosf(phi)) + yVector * (sinAlpha * sinf(phi)) + zVector * cosAlpha;
+	normal.w = 0.0f;
+	normal.Normalize();
+	Vector point = worldCenter + normal * worldRadius;
+	point.w = 1.0f;
+
+	// Uniform in the cone, converted to a pdf per unit area
+	Vector toPoint = point;
+	toPoint = toPoint - fromPoint;
+	float pointDistance2 = toPoint.Dot(toPoint);
+	float cosLight = fabsf(normal.Dot(toPoint)) / sqrtf(pointDistance2);
+	pdf = cosLight / (2.0f * float(M_PI) * oneMinusCosThetaMax * pointDistance2);
+	return point;
+}
+
+float SceneSphere::pdfShape(const Vector & fromPoint, const HitInfo & hit)
+{
+	float squaredDistance;
+	float cosThetaMax = computeCosThetaMax(fromPoint, squaredDistance);
+	if (cosThetaMax < 0.0f)
+	{
+		return 1.0f / area;
+	}
+
+	float oneMinusCosThetaMax = worldRadius * worldRadius / squaredDistance / (1.0f + cosThetaMax);
+	Vector toPoint = hit.hitPoint;
+	toPoint = toPoint - fromPoint;
+	float pointDistance2 = toPoint.Dot(toPoint);
+	float cosLight = fabsf(hit.hitNormal.Dot(toPoint)) / sqrtf(pointDistance2);
+	return cosLight / (2.0f * float(M_PI) * oneMinusCosThetaMax * pointDistance2);
+}
+
+AABB SceneSphere::computeWorldBounds()
+{
+	AABB box;
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	// Transform the local box corners, the result encloses the (possibly scaled and rotated) sphere
+	for (unsigned int i = 0; i < 8; i++)
+	{
+		Vector corner(center.x + ((i & 1) ? radius : -radius),
+			center.y + ((i & 2) ? radius : -radius),
+			center.z + ((i & 4) ? radius : -radius));
+		box.expand(localToWorldMatrix * corner);
+	}
+#else
+	box.expand(Vector(center.x - radius, center.y - radius, center.z - radius));
+	box.expand(Vector(center.x + radius, center.y + radius, center.z + radius));
+#endif
+	return box;
 }
 
 // =================================================================================
 
-void SceneTriangle::testIntersection(Ray & ray, HitInfo & outHitInfo)
+// Mller-Trumbore test against the edges precomputed by precompute(). Finds the hit inside
+// (tMin, maxDistance) and its barycentric coordinates, without computing any shading attribute
+bool SceneTriangle::intersectRay(const Ray & ray, float maxDistance, float & distance, float & a, float & b, float & c)
 {
-	outHitInfo.hit = false;
+	_RT_COUNT_STAT(primitiveTests);
 
 	// Punto desde donde se emite el rayo y su direccin
 	Vector center = ray.getOrigin();
@@ -118,69 +285,90 @@ void SceneTriangle::testIntersection(Ray & ray, HitInfo & outHitInfo)
 	dir = (tempDir - center);
 #endif
 
-	// Tras despejar la distancia t de la ecuacin de pertenencia de un punto
-	// a un plano, comprobamos que el divisor es distinto de 0 (igual a 0 significa
-	// que el rayo es paralelo al plano, y por lo tanto, nunca intersectaran)
+	// Si el determinante es 0, el rayo es paralelo al plano del tringulo
+	// y nunca intersectaran
+	Vector pVec = dir.Cross(edge2);
+	float det = edge1.Dot(pVec);
+	if (det == 0.0f)
+	{
+		return false;
+	}
+
+	float invDet = 1.0f / det;
 
-	Vector triangleNormal = (this->vertex[1] - this->vertex[0]).Cross(this->vertex[2] - this->vertex[0]);
+	// Coordenadas baricntricas (u, v) del punto de corte respecto a vertex[1] y vertex[2]
+	Vector tVec = center - vertex[0];
+	float u = tVec.Dot(pVec) * invDet;
+	if (u < 0.0f || u > 1.0f)
+	{
+		return false;
+	}
 
-	float tSurf = triangleNormal.Magnitude();
-	triangleNormal.Normalize();
+	Vector qVec = tVec.Cross(edge1);
 
-	float div = dir.Dot(triangleNormal);
-	if (div != 0.0f)
+	// Si la distancia obtenida queda fuera del intervalo del rayo, el tringulo
+	// est detrs del emisor de rayos o ms lejos que el impacto ms cercano encontrado
+	float t = edge2.Dot(qVec) * invDet;
+	if (t <= ray.getTMin() || t >= maxDistance)
 	{
-		// Completamos el resto de la ecuacin
-		float nc = triangleNormal.Dot(center);
-		float np = triangleNormal.Dot(vertex[0]);
-
-		// Si la distancia obtenida es negativa, significa que el tringulo
-		// est detrs del emisor de rayos
-		float planeIntersectResult = -((nc - np) / div);
-		if (planeIntersectResult > 0.0f)
-		{
-			// Una vez hemos encontrado un punto en el plano definido por el tringulo,
-			// comprobamos que est dentro de este.
-			Vector hittedPoint = center + (dir * planeIntersectResult);
+		_RT_COUNT_STAT(intervalRejects);
+		return false;
+	}
 
-			// Para comprobarlo, la suma de las reas de los 3 sub-tringulos formados por el punto 
-			// contenido dentro del tringulo debe ser igual a la del tringlo original
+	float v = dir.Dot(qVec) * invDet;
+	if (v < 0.0f || u + v > 1.0f)
+	{
+		return false;
+	}
 
-			float Ta = (vertex[1] - hittedPoint).Cross(vertex[2] - hittedPoint).Magnitude();
-			float Tb = (vertex[0] - hittedPoint).Cross(vertex[2] - hittedPoint).Magnitude();
-			float Tc = (vertex[0] - hittedPoint).Cross(vertex[1] - hittedPoint).Magnitude();
+	distance = t;
+	a = 1.0f - u - v;
+	b = u;
+	c = v;
+	return true;
+}
 
-			float a = Ta / tSurf;
-			float b = Tb / tSurf;
-			float c = Tc / tSurf;
+bool SceneTriangle::testIntersection(Ray & ray, HitInfo & outHitInfo)
+{
+	float planeIntersectResult, a, b, c;
+	if (!intersectRay(ray, ray.getTMax(), planeIntersectResult, a, b, c))
+	{
+		return false;
+	}
 
-			float total = a + b + c;
+	// The ray parameter is the same in local and world space, so the hit point is computed in world space directly
+	Vector hittedPoint = Vector(ray.getOrigin()) + Vector(ray.getDirection()) * planeIntersectResult;
 
-			if (abs(total - 1.0f) < _RT_BIAS)
-			{
-				Vector averageNormal(normal[0] * a + normal[1] * b + normal[2] * c);
-				averageNormal.Normalize();
+	Vector averageNormal(normal[0] * a + normal[1] * b + normal[2] * c);
+	averageNormal.Normalize();
 
 #ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
-				hittedPoint = localToWorldMatrix * hittedPoint;
-				averageNormal = localToWorldMatrix.Inverse().Transpose() * Vector(averageNormal.x, averageNormal.y, averageNormal.z, 0.0f);
+	averageNormal = normalMatrix * Vector(averageNormal.x, averageNormal.y, averageNormal.z, 0.0f);
 #endif
-				outHitInfo.hitPoint = hittedPoint;
-				outHitInfo.hitNormal = averageNormal;
-				outHitInfo.u = ((abs(u[0]) * a) + (abs(u[1]) * b) + (abs(u[2]) * c));
-				outHitInfo.v = ((abs(v[0]) * a) + (abs(v[1]) * b) + (abs(v[2]) * c));
-				outHitInfo.u -= floor(outHitInfo.u);
-				outHitInfo.v -= floor(outHitInfo.v);
-				outHitInfo.hittedMaterial = averageMaterials(a, b, c, outHitInfo.u, outHitInfo.v);
-				outHitInfo.physicalMaterial = physicalMaterial;
-				outHitInfo.inRay = ray;
-				outHitInfo.hit = true;
-				outHitInfo.isLight = isLight;
-				outHitInfo.emission = emission;
-				outHitInfo.inRay.setDistance((hittedPoint - center).Magnitude());
-			}
-		}
-	}
+	ray.setTMax(planeIntersectResult);
+	_RT_COUNT_STAT(primitiveHits);
+
+	outHitInfo.hitPoint = hittedPoint;
+	outHitInfo.hitNormal = averageNormal;
+	outHitInfo.u = ((abs(u[0]) * a) + (abs(u[1]) * b) + (abs(u[2]) * c));
+	outHitInfo.v = ((abs(v[0]) * a) + (abs(v[1]) * b) + (abs(v[2]) * c));
+	outHitInfo.u -= floor(outHitInfo.u);
+	outHitInfo.v -= floor(outHitInfo.v);
+	outHitInfo.hittedMaterial = averageMaterials(a, b, c, outHitInfo.u, outHitInfo.v);
+	outHitInfo.inRay = ray;
+	outHitInfo.hit = true;
+	outHitInfo.isLight = isLight;
+	outHitInfo.emission = emission;
+	outHitInfo.object = this;
+	outHitInfo.primitive = 0;
+	outHitInfo.inRay.setDistance((hittedPoint - ray.getOrigin()).Magnitude());
+	return true;
+}
+
+bool SceneTriangle::occluded(const Ray & ray, float maxDistance)
+{
+	float distance, a, b, c;
+	return intersectRay(ray, maxDistance, distance, a, b, c);
 }
 
 SceneMaterial SceneTriangle::averageMaterials(float u, float v, float w, float finalU, float finalV)
@@ -258,77 +446,231 @@ void SceneTriangle::applyAffineTransformations()
 	position = rotation = Vector();
 	scale = Vector(1.0f, 1.0f, 1.0f);
 #endif
+
+	precompute();
+}
+
+void SceneTriangle::precompute()
+{
+	edge1 = vertex[1] - vertex[0];
+	edge2 = vertex[2] - vertex[0];
 }
 
 void SceneTriangle::computeArea()
 {
-	Vector BA = vertex[1] - vertex[0];
-	Vector CA = vertex[2] - vertex[0];
+	Vector A = vertex[0];
+	Vector B = vertex[1];
+	Vector C = vertex[2];
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	// World space area, as the triangle may be scaled
+	A = localToWorldMatrix * A;
+	B = localToWorldMatrix * B;
+	C = localToWorldMatrix * C;
+#endif
 
-	area = 0.5f * BA.Cross(CA).Magnitude();
+	area = 0.5f * (B - A).Cross(C - A).Magnitude();
 }
 
-Vector SceneTriangle::sampleShape(float &pdf)
+Vector SceneTriangle::sampleShape(const Vector & fromPoint, float &pdf, Vector &normal, PathSampler & sampler)
 {
 	Vector sample = sampler.samplePlane();
+	Vector point = mapSquareSampleToTrianglePoint(sample, vertex[0], vertex[1], vertex[2]);
+	normal = edge1.Cross(edge2);
+	normal.w = 0.0f;
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	point.w = 1.0f;
+	point = localToWorldMatrix * point;
+	normal = normalMatrix * normal;
+#endif
+	normal.Normalize();
+
+	// Uniform point in the triangle
+	pdf = 1.0f / area;
+	return point;
+}
 
-	//uniform distributed pdf($) = 1 / (b - a)
-	//pdf(x) = 1 / (1 - 0) = 1
-	//pdf(y) = 1 / (1 - 0) = 1
-	//pdf = 1 * 1 = 1
-	pdf = 1.0f;
+float SceneTriangle::pdfShape(const Vector & fromPoint, const HitInfo & hit)
+{
+	return 1.0f / area;
+}
 
-	return mapSquareSampleToTrianglePoint(sample, vertex[0], vertex[1], vertex[2]);
+AABB SceneTriangle::computeWorldBounds()
+{
+	AABB box;
+	for (auto & vr : vertex)
+	{
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+		box.expand(localToWorldMatrix * vr);
+#else
+		box.expand(vr);
+#endif
+	}
+	return box;
+}
+
+DirectionCone SceneTriangle::computeNormalBounds()
+{
+	Vector normal = edge1.Cross(edge2);
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	normal = normalMatrix * normal;
+#endif
+	return DirectionCone(normal.Normalize(), 1.0f);
 }
 
 // =================================================================================
 
-void SceneModel::testIntersection(Ray & ray, HitInfo & outInfo)
+bool SceneModel::testIntersection(Ray & ray, HitInfo & outInfo)
 {
+	MeshHit closest;
+
+#ifndef _RT_USE_BVH
 #ifdef _RT_USE_BB
 	if (!bv->testIntersect(ray))
 	{
-		outInfo.hit = false;
-		return;
+		return false;
 	}
 #endif
+#endif
+
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	// Object space traversal, the ray is transformed once for the whole mesh
+	Ray localRay = toLocalSpace(ray);
+#else
+	Ray & localRay = ray;
+#endif
 
-	HitInfo closer;
-	closer.hit = false;
-	for (SceneTriangle & st : triangleList)
+#ifdef _RT_USE_BVH
+	// The root node bounds already act as the model bounding volume
+	ModelTriangleTest test(*mesh, closest);
+	if (!mesh->bvh.traverse(localRay, test))
 	{
-		st.testIntersection(ray, outInfo);
-		if (outInfo.hit)
+		return false;
+	}
+#else
+
+	// Every hit shrinks the ray interval, so the last one is the closest
+	bool hit = false;
+	const unsigned int numTriangles = mesh->GetNumTriangles();
+	for (unsigned int i = 0; i < numTriangles; i++)
+	{
+		float t;
+		if (mesh->intersectTriangle(i, localRay, localRay.getTMax(), t, closest.b1, closest.b2))
 		{
-			if (closer.hit)
-			{
-				float closerDist = (closer.hitPoint - ray.getOrigin()).Magnitude();
-				float currentDist = (outInfo.hitPoint - ray.getOrigin()).Magnitude();
-
-				if (closerDist <= currentDist)
-				{
-					continue;
-				}
-			}
-			closer = outInfo;
+			localRay.setTMax(t);
+			closest.triangle = i;
+			hit = true;
 		}
 	}
 
-	outInfo = closer;
+	if (!hit)
+	{
+		return false;
+	}
+#endif
+
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	ray.setTMax(localRay.getTMax());
+#endif
+
+	// Shading attributes are only computed for the closest triangle
+	fillHitInfo(ray, closest, outInfo);
+	return true;
 }
 
-void SceneModel::applyAffineTransformations()
+void SceneModel::fillHitInfo(const Ray & ray, const MeshHit & hit, HitInfo & outInfo)
+{
+	_RT_COUNT_STAT(primitiveHits);
+
+	outInfo.hitPoint = Vector(ray.getOrigin()) + Vector(ray.getDirection()) * ray.getTMax();
+	outInfo.hitNormal = mesh->interpolateNormal(hit.triangle, hit.b1, hit.b2);
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	outInfo.hitNormal = normalMatrix * Vector(outInfo.hitNormal.x, outInfo.hitNormal.y, outInfo.hitNormal.z, 0.0f);
+	outInfo.hitNormal.Normalize();
+#endif
+	mesh->interpolateTexCoords(hit.triangle, hit.b1, hit.b2, outInfo.u, outInfo.v);
+
+	// Same material on every vertex, so there is nothing to average besides the texture
+	SceneMaterial shaded;
+	shaded.emissive = material->emissive;
+	if (shaded.emissive.Magnitude() == 0.0f)
+	{
+		shaded.diffuse = material->diffuse * material->GetTextureColor(outInfo.u, outInfo.v);
+		shaded.reflective = material->reflective;
+		shaded.refraction_index = material->refraction_index;
+		shaded.shininess = material->shininess;
+		shaded.specular = material->specular;
+		shaded.transparent = material->transparent;
+	}
+
+	outInfo.hittedMaterial = shaded;
+	outInfo.inRay = ray;
+	outInfo.hit = true;
+	outInfo.isLight = isLight;
+	outInfo.emission = emission;
+	outInfo.object = this;
+	outInfo.primitive = hit.triangle;
+	outInfo.inRay.setDistance((outInfo.hitPoint - ray.getOrigin()).Magnitude());
+}
+
+bool SceneModel::occluded(const Ray & ray, float maxDistance)
 {
+#ifndef _RT_USE_BVH
+#ifdef _RT_USE_BB
+	if (!bv->testIntersect(ray))
+	{
+		return false;
+	}
+#endif
+#endif
 
-	for (auto & triangle : triangleList)
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	Ray localRay = toLocalSpace(ray);
+#else
+	const Ray & localRay = ray;
+#endif
+
+#ifdef _RT_USE_BVH
+	// Stops at the first triangle found inside the segment, whatever its distance
+	auto test = [this](unsigned int triangleIndex, const Ray & segment)
+	{
+		float t, b1, b2;
+		return mesh->intersectTriangle(triangleIndex, segment, segment.getTMax(), t, b1, b2);
+	};
+	return mesh->bvh.occluded(localRay, maxDistance, test);
+#else
+	const unsigned int numTriangles = mesh->GetNumTriangles();
+	for (unsigned int i = 0; i < numTriangles; i++)
 	{
-		triangle.position = position;
-		triangle.rotation = rotation;
-		triangle.scale = scale;
-		triangle.applyAffineTransformations();
+		float t, b1, b2;
+		if (mesh->intersectTriangle(i, localRay, maxDistance, t, b1, b2))
+		{
+			return true;
+		}
 	}
 
-#ifndef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	return false;
+#endif
+}
+
+void SceneModel::applyAffineTransformations()
+{
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	// The mesh stays in local space, rays are transformed once per model instead
+	computeMatrices();
+#else
+	// Bake the model transform into the shared vertices, so triangles are intersected
+	// in world space without any per triangle transform
+	Matrix translateM;
+	translateM.setTranslateMatrix(position);
+	Quaternion q(rotation);
+	Matrix rotationM = q.getRotationMatrix();
+	Matrix scaleM;
+	scaleM.setScaleMatrix(scale);
+
+	// The mesh loaded from the file may be shared, bake a private copy
+	mesh = std::make_shared<TriangleMesh>(*mesh);
+	mesh->transform(rotationM * translateM * scaleM);
+
 	position = rotation = Vector();
 	scale = Vector(1.0f, 1.0f, 1.0f);
 #endif
@@ -346,64 +688,155 @@ void SceneModel::initBoundingVolume(std::string type)
 		bv = new BoundingBox();
 	}
 
-	float hx, hy, hz;
-	hx = hy = hz = -std::numeric_limits<float>().max();
+	AABB box = computeWorldBounds();
+	bv->setCorners(box.getHighest(), box.getLowest());
+}
+#endif
 
-	float lx, ly, lz;
-	lx = ly = lz = std::numeric_limits<float>().max();
+#ifdef _RT_USE_BVH
+void SceneModel::buildBVH()
+{
+	// Shared meshes are only built by the first model using them
+	if (mesh->bvh.isEmpty())
+	{
+		mesh->buildBVH();
+	}
+}
 
-	for (auto & triangle : triangleList)
+bool SceneModel::ModelTriangleTest::operator()(unsigned int triangleIndex, Ray & ray)
+{
+	float t, b1, b2;
+	if (!mesh.intersectTriangle(triangleIndex, ray, ray.getTMax(), t, b1, b2))
 	{
-		for (auto & vr : triangle.vertex)
-		{
-			Vector v = triangle.localToWorldMatrix * vr;
-			if (v.x > hx)
-				hx = v.x;
-			if (v.x < lx)
-				lx = v.x;
-
-			if (v.y > hy)
-				hy = v.y;
-			if (v.y < ly)
-				ly = v.y;
-
-			if (v.z > hz)
-				hz = v.z;
-			if (v.z < lz)
-				lz = v.z;
-		}
+		return false;
 	}
 
-	Vector highest(hx, hy, hz);
-	Vector lowest(lx, ly, lz);
+	ray.setTMax(t);
+	closest.triangle = triangleIndex;
+	closest.b1 = b1;
+	closest.b2 = b2;
+	return true;
+}
+#endif
 
-	bv->setCorners(highest, lowest);
+AABB SceneModel::computeWorldBounds()
+{
+	AABB box;
+	for (auto & position : mesh->positions)
+	{
+		box.expand(position);
+	}
+
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	// Transform the local box corners, the result encloses the transformed mesh
+	AABB worldBox;
+	for (unsigned int i = 0; i < 8; i++)
+	{
+		Vector corner((i & 1) ? box.highest[0] : box.lowest[0],
+			(i & 2) ? box.highest[1] : box.lowest[1],
+			(i & 4) ? box.highest[2] : box.lowest[2]);
+		worldBox.expand(localToWorldMatrix * corner);
+	}
+	return worldBox;
+#else
+	return box;
+#endif
 }
+
+DirectionCone SceneModel::computeNormalBounds()
+{
+	const unsigned int numTriangles = mesh->GetNumTriangles();
+
+	DirectionCone normals;
+	bool first = true;
+	for (unsigned int i = 0; i < numTriangles; i++)
+	{
+		Vector A = mesh->GetVertex(i, 0);
+		Vector B = mesh->GetVertex(i, 1);
+		Vector C = mesh->GetVertex(i, 2);
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+		A = localToWorldMatrix * A;
+		B = localToWorldMatrix * B;
+		C = localToWorldMatrix * C;
 #endif
+		Vector normal = (B - A).Cross(C - A);
+		if (normal.Dot(normal) == 0.0f)
+		{
+			continue;
+		}
+
+		DirectionCone triangleNormal(normal.Normalize(), 1.0f);
+		normals = first ? triangleNormal : DirectionCone::Union(normals, triangleNormal);
+		first = false;
+		if (normals.cosTheta <= -1.0f)
+		{
+			break;
+		}
+	}
+	return normals;
+}
 
 void SceneModel::computeArea()
 {
 	area = 0.0f;
-	for (auto & triangle : triangleList)
+	const unsigned int numTriangles = mesh->GetNumTriangles();
+	for (unsigned int i = 0; i < numTriangles; i++)
 	{
-		triangle.computeArea();
-		area += triangle.area;
+		area += computeWorldTriangleArea(i);
 	}
 }
 
-void SceneModel::initSampler()
+float SceneModel::computeWorldTriangleArea(unsigned int triangle)
+{
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	// World space area, as the model may be scaled
+	Vector A = localToWorldMatrix * mesh->GetVertex(triangle, 0);
+	Vector B = localToWorldMatrix * mesh->GetVertex(triangle, 1);
+	Vector C = localToWorldMatrix * mesh->GetVertex(triangle, 2);
+	return 0.5f * (B - A).Cross(C - A).Magnitude();
+#else
+	return mesh->computeTriangleArea(triangle);
+#endif
+}
+
+void SceneModel::initShapeSampling()
 {
-	sampler = IntegerSampler(0, triangleList.size() - 1);
+	const unsigned int numTriangles = mesh->GetNumTriangles();
+	std::vector<float> triangleAreas(numTriangles);
+	for (unsigned int i = 0; i < numTriangles; i++)
+	{
+		triangleAreas[i] = computeWorldTriangleArea(i);
+	}
+	triangleTable.build(triangleAreas);
 }
 
-Vector SceneModel::sampleShape(float & pdf)
+Vector SceneModel::sampleShape(const Vector & fromPoint, float & pdf, Vector &normal, PathSampler & sampler)
 {
-	int choosenTriangle = sampler.sampleRect();
+	float trianglePdf, u, v;
+	sampler.sample2D(u, v);
+	unsigned int choosenTriangle = triangleTable.sample(u, v, trianglePdf);
 
-	SceneTriangle & st = triangleList[choosenTriangle];
-	float trianglePdf;
-	Vector triangleFinalSample = st.sampleShape(trianglePdf);
+	Vector sample = sampler.samplePlane();
+	Vector A = mesh->GetVertex(choosenTriangle, 0);
+	Vector B = mesh->GetVertex(choosenTriangle, 1);
+	Vector C = mesh->GetVertex(choosenTriangle, 2);
+#ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
+	A = localToWorldMatrix * A;
+	B = localToWorldMatrix * B;
+	C = localToWorldMatrix * C;
+#endif
+
+	normal = (B - A).Cross(C - A);
+	float triangleArea = 0.5f * normal.Magnitude();
+	normal.w = 0.0f;
+	normal.Normalize();
+
+	// Triangle proportional to its area, then uniform point in it: 1 / area for the whole model
+	pdf = trianglePdf / triangleArea;
+	return mapSquareSampleToTrianglePoint(sample, A, B, C);
+}
 
-	pdf = trianglePdf * (float(choosenTriangle) / float(triangleList.size() - 1));
-	return triangleFinalSample;
-}
\ No newline at end of file
+float SceneModel::pdfShape(const Vector & fromPoint, const HitInfo & hit)
+{
+	return triangleTable.pdf(hit.primitive) / computeWorldTriangleArea(hit.primitive);
+}
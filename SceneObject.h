@@ -1,11 +1,17 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 
 #include "Utils.h"
 #include "Ray.h"
 #include "Sampler.h"
 #include "BVH.h"
+#include "TriangleMesh.h"
+#include "LightBVH.h"
+
+class SceneLight;
+class PhysicalMaterial;
 
 namespace SceneObjectType
 {
@@ -27,22 +33,26 @@ class SceneObject
 protected:
 	bool isLight;
 	Vector emission;
+	SceneLight * light;		// Area light the object belongs to, if emissive
+	PhysicalMaterial * bsdf;	// Looked up once from physicalMaterial, so hits don't carry its name
 public:
 	std::string name;
 	SceneObjectType::ObjectType type;
 	Vector scale, rotation, position;
 
 	std::string physicalMaterial;
+	float area;				// Surface area in world space, set by computeArea
 
 #ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
 	Matrix worldToLocalMatrix;
 	Matrix localToWorldMatrix;
+	Matrix normalMatrix; // Inverse transpose of localToWorldMatrix
 #endif
 
 	// -- Constructors & Destructors --
-	SceneObject(void): isLight(false) { scale.x = 1.0f; scale.y = 1.0f; scale.z = 1.0f; }
-	SceneObject(SceneObjectType::ObjectType tp) : isLight(false),type(tp) { scale.x = 1.0f; scale.y = 1.0f; scale.z = 1.0f; }
-	SceneObject(std::string nm, SceneObjectType::ObjectType tp) : isLight(false),name(nm), type(tp) { scale.x = 1.0f; scale.y = 1.0f; scale.z = 1.0f; }
+	SceneObject(void): isLight(false), light(NULL), bsdf(NULL), area(0.0f) { scale.x = 1.0f; scale.y = 1.0f; scale.z = 1.0f; }
+	SceneObject(SceneObjectType::ObjectType tp) : isLight(false), light(NULL), bsdf(NULL), type(tp), area(0.0f) { scale.x = 1.0f; scale.y = 1.0f; scale.z = 1.0f; }
+	SceneObject(std::string nm, SceneObjectType::ObjectType tp) : isLight(false), light(NULL), bsdf(NULL), name(nm), type(tp), area(0.0f) { scale.x = 1.0f; scale.y = 1.0f; scale.z = 1.0f; }
 	~SceneObject() {}
 
 	// -- Object Type Checking Functions --
@@ -50,17 +60,51 @@ public:
 	bool IsTriangle(void) { return (type == SceneObjectType::Triangle); }
 	bool IsModel(void) { return (type == SceneObjectType::Model); }
 
-	void setEmissive(Vector em)
+	void setEmissive(Vector em, SceneLight * source)
 	{
 		emission = em;
 		isLight = true;
+		light = source;
 	}
 
 	virtual void computeArea() { }
 
-	virtual void testIntersection(Ray & ray, HitInfo & outInfo) = 0;
+	// Prepares whatever sampleShape needs beyond the area. Only called for the shapes of area lights
+	virtual void initShapeSampling() { }
+
+	bool IsLight(void) const { return isLight; }
+
+	// - GetLight - Returns the area light the object is part of (NULL if it is not emissive)
+	SceneLight * GetLight(void) const { return light; }
+
+	// - SetPhysicalMaterial - Sets the name of the physical material and looks it up in the material table
+	void SetPhysicalMaterial(const std::string & materialName);
+
+	// - GetPhysicalMaterial - Returns the physical material of the object (NULL if its name is not in the table)
+	PhysicalMaterial * GetPhysicalMaterial(void) const { return bsdf; }
+
+	// Tests the ray against the object. Only hits inside the ray [tMin, tMax] interval are accepted:
+	// on a hit, outInfo is filled, the ray tMax is shrunk to the hit and true is returned.
+	// outInfo is left untouched otherwise
+	virtual bool testIntersection(Ray & ray, HitInfo & outInfo) = 0;
+
+	// Any hit query for shadow rays: whether the object blocks the ray anywhere inside (tMin, maxDistance).
+	// Stops at the first blocker and never computes normals, texture coordinates or materials
+	virtual bool occluded(const Ray & ray, float maxDistance) = 0;
 	virtual void applyAffineTransformations() = 0;
-	virtual Vector sampleShape(float &pdf) = 0;
+
+	// Samples a point on the surface, in world space, to light fromPoint. Gives its geometric normal
+	// and the pdf of choosing it per unit of (world) area. Needs computeArea and initShapeSampling
+	virtual Vector sampleShape(const Vector & fromPoint, float &pdf, Vector &normal, PathSampler & sampler) = 0;
+
+	// Pdf per unit area with which sampleShape would have chosen the point of the given hit from fromPoint
+	virtual float pdfShape(const Vector & fromPoint, const HitInfo & hit) = 0;
+
+	// Axis aligned box enclosing the object in world space (after applyAffineTransformations)
+	virtual AABB computeWorldBounds() = 0;
+
+	// Cone holding the world space normals of the surface, or their opposite
+	virtual DirectionCone computeNormalBounds() { return DirectionCone::EntireSphere(); }
 
 #ifdef _RT_TRANSFORM_RAY_TO_LOCAL_SPACE
 	void computeMatrices()
@@ -81,6 +125,21 @@ public:
 		Matrix invR = rotationMatrix.Inverse();
 
 		worldToLocalMatrix = localToWorldMatrix.Inverse();//(invS * invT * invR);
+		normalMatrix = worldToLocalMatrix.Transpose();
+	}
+
+	// Ray in the object local space. The direction is not normalized, so the ray parameter
+	// (and the ray interval) is the same in both spaces
+	Ray toLocalSpace(const Ray & ray)
+	{
+		Vector origin = ray.getOrigin();
+		Vector direction = ray.getDirection();
+		origin.w = 1.0f;
+		direction.w = 0.0f;
+
+		Ray localRay(worldToLocalMatrix * origin, worldToLocalMatrix * direction, ray.getDepth());
+		localRay.setTMax(ray.getTMax());
+		return localRay;
 	}
 #endif
 };
@@ -92,21 +151,33 @@ Sphere object derived from the SceneObject
 */
 class SceneSphere : public SceneObject
 {
-private:
-	FloatSampler sampler;
 public:
 	SceneMaterial * material;
 	Vector center;
 	float radius;
-	float area;
 	
 	// -- Constructors & Destructors --
-	SceneSphere(void) : SceneObject("Sphere", SceneObjectType::Sphere) { }
-	SceneSphere(std::string nm) : SceneObject(nm, SceneObjectType::Sphere) { }
+	SceneSphere(void) : SceneObject("Sphere", SceneObjectType::Sphere), worldRadius(0.0f) { }
+	SceneSphere(std::string nm) : SceneObject(nm, SceneObjectType::Sphere), worldRadius(0.0f) { }
 
-	void testIntersection(Ray & ray, HitInfo & outInfo);
+	bool testIntersection(Ray & ray, HitInfo & outInfo);
+	bool occluded(const Ray & ray, float maxDistance);
 	void applyAffineTransformations();
-	Vector sampleShape(float &pdf);
+	void computeArea();
+	void initShapeSampling();
+	Vector sampleShape(const Vector & fromPoint, float &pdf, Vector &normal, PathSampler & sampler);
+	float pdfShape(const Vector & fromPoint, const HitInfo & hit);
+	AABB computeWorldBounds();
+
+private:
+	// World space sphere, prepared by initShapeSampling
+	Vector worldCenter;
+	float worldRadius;
+
+	// Cosine of the half angle of the cone the sphere subtends from fromPoint, -1 if the point is inside
+	float computeCosThetaMax(const Vector & fromPoint, float & squaredDistance) const;
+
+	bool intersectRay(const Ray & ray, float maxDistance, float & distance, Vector & localHitPoint);
 };
 
 /*
@@ -116,50 +187,77 @@ Single triangle object derived from the SceneObject
 */
 class SceneTriangle : public SceneObject
 {
-private:
-	FloatSampler sampler;
 public:
 	SceneMaterial * material[3];
 	Vector vertex[3];
 	Vector normal[3];
 	float u[3], v[3];
-	float area;
+
+	// Edges from vertex[0], in the same space as the vertices. Prepared by precompute()
+	Vector edge1, edge2;
 
 	// -- Constructors & Destructors --
 	SceneTriangle(void) : SceneObject("Triangle", SceneObjectType::Triangle) {}
 
 	SceneTriangle(std::string nm) : SceneObject(nm, SceneObjectType::Triangle) {}
 
-	void testIntersection(Ray & ray, HitInfo & outInfo);
+	bool testIntersection(Ray & ray, HitInfo & outInfo);
+	bool occluded(const Ray & ray, float maxDistance);
 	void applyAffineTransformations();
+	void precompute();
 	void computeArea();
-	Vector sampleShape(float &pdf);
+	Vector sampleShape(const Vector & fromPoint, float &pdf, Vector &normal, PathSampler & sampler);
+	float pdfShape(const Vector & fromPoint, const HitInfo & hit);
+	AABB computeWorldBounds();
+	DirectionCone computeNormalBounds();
 	
 private:
+	bool intersectRay(const Ray & ray, float maxDistance, float & distance, float & a, float & b, float & c);
 	SceneMaterial averageMaterials(float u, float v, float w, float finalU, float finalV);
 };
 
 /*
 SceneModel Class - The model scene object
 
-A model object consisting of a list of triangles derived from the SceneObject
+A model object consisting of an indexed triangle mesh derived from the SceneObject.
+With _RT_TRANSFORM_RAY_TO_LOCAL_SPACE the mesh stays in local space and rays are transformed
+once per model, so models loaded from the same file share a single mesh (instancing).
+Otherwise the model transform is baked into a private copy of the mesh at load time
 */
 class SceneModel : public SceneObject
 {
 private:
-	IntegerSampler sampler;
+	// Closest triangle hit. The ray interval keeps track of its distance
+	struct MeshHit
+	{
+		unsigned int triangle;
+		float b1, b2;
+	};
+
+#ifdef _RT_USE_BVH
+	// BVH traversal callback. Stores the closest triangle hit found so far
+	struct ModelTriangleTest
+	{
+		const TriangleMesh & mesh;
+		MeshHit & closest;
+
+		ModelTriangleTest(const TriangleMesh & mesh, MeshHit & closest) :mesh(mesh), closest(closest) {}
+		bool operator()(unsigned int triangleIndex, Ray & ray);
+	};
+#endif
 public:
 #ifdef _RT_USE_BB
 	BoundingVolume * bv;
 #endif
 	std::string filename;
-	std::vector<SceneTriangle> triangleList;
-	float area;
+	std::shared_ptr<TriangleMesh> mesh;
+	SceneMaterial * material;
+	AliasTable triangleTable;	// Chooses triangles proportionally to their world area, for sampleShape
 
 	// -- Constructors & Destructors --
-	SceneModel(void) : SceneObject("Model", SceneObjectType::Model) {}
-	SceneModel(std::string file) : SceneObject("Model", SceneObjectType::Model) { filename = file; }
-	SceneModel(std::string file, std::string nm) : SceneObject(nm, SceneObjectType::Model) { filename = file; 	}
+	SceneModel(void) : SceneObject("Model", SceneObjectType::Model), material(NULL) {}
+	SceneModel(std::string file) : SceneObject("Model", SceneObjectType::Model), material(NULL) { filename = file; }
+	SceneModel(std::string file, std::string nm) : SceneObject(nm, SceneObjectType::Model), material(NULL) { filename = file; 	}
 	~SceneModel()
 	{ 
 #ifdef _RT_USE_BB
@@ -169,18 +267,29 @@ public:
 
 	// -- Accessor Functions --
 	// - GetNumTriangles - Returns the number of triangles in the model
-	unsigned int GetNumTriangles(void) { return (unsigned int)triangleList.size(); }
-
-	// - GetTriangle - Gets the nth SceneTriangle
-	SceneTriangle *GetTriangle(int triIndex) { return &triangleList[triIndex]; }
+	unsigned int GetNumTriangles(void) { return mesh->GetNumTriangles(); }
 
-	void initSampler();
+	// - GetMesh - Gets the (possibly shared) triangle mesh of the model
+	const TriangleMesh & GetMesh(void) const { return *mesh; }
 
-	void testIntersection(Ray & ray, HitInfo & outInfo);
+	bool testIntersection(Ray & ray, HitInfo & outInfo);
+	bool occluded(const Ray & ray, float maxDistance);
 	void applyAffineTransformations();
 #ifdef _RT_USE_BB
 	void initBoundingVolume(std::string type);
+#endif
+#ifdef _RT_USE_BVH
+	void buildBVH();
 #endif
 	void computeArea();
-	Vector sampleShape(float &pdf);
+	void initShapeSampling();
+	Vector sampleShape(const Vector & fromPoint, float &pdf, Vector &normal, PathSampler & sampler);
+	float pdfShape(const Vector & fromPoint, const HitInfo & hit);
+	AABB computeWorldBounds();
+	DirectionCone computeNormalBounds();
+
+
+private:
+	void fillHitInfo(const Ray & ray, const MeshHit & hit, HitInfo & outInfo);
+	float computeWorldTriangleArea(unsigned int triangle);
 };
\ No newline at end of file
@@ -1,31 +1,58 @@
-
 #include "Threadpool.h"
 #include "Config.h"
 
 #include <iostream>
 
-ThreadPool::ThreadPool()
+ThreadPool::ThreadPool(unsigned int threadCount)
 {
-	init();
+	init(threadCount);
 	std::cout << "ThreadPool: Using " << poolSize << " thread(s)" << std::endl;
 }
 
-void ThreadPool::init()
+void ThreadPool::init(unsigned int threadCount)
 {
 	active = true;
-#ifdef _RT_USE_MULTITHREAD
-	poolSize = std::thread::hardware_concurrency();
-	poolSize = poolSize < 1 ? 1 : poolSize;
-#else
-	poolSize = 1;
-#endif
+	pendingTasks = 0;
+	nextQueue = 0;
+	poolSize = computePoolSize(threadCount);
+
+	// Every deque exists before any worker may try to steal from it
+	queues.clear();
+	for (unsigned i = 0; i < poolSize; i++)
+	{
+		queues.push_back(std::make_unique<WorkerQueue>());
+	}
+
 	for (unsigned i = 0; i < poolSize; i++)
 	{
-		std::thread t(&ThreadPool::pollTask, this);
+		std::thread t(&ThreadPool::pollTask, this, i);
 		pool.push_back(std::move(t));
 	}
 }
 
+void ThreadPool::resize(unsigned int threadCount)
+{
+	if (computePoolSize(threadCount) == poolSize)
+	{
+		return;
+	}
+
+	shutDown();
+	init(threadCount);
+	std::cout << "ThreadPool: Using " << poolSize << " thread(s)" << std::endl;
+}
+
+unsigned int ThreadPool::computePoolSize(unsigned int threadCount)
+{
+#ifdef _RT_USE_MULTITHREAD
+	unsigned int size = threadCount > 0 ? threadCount : _RT_THREAD_COUNT;
+	size = size > 0 ? size : std::thread::hardware_concurrency();
+	return size < 1 ? 1 : size;
+#else
+	return 1;
+#endif
+}
+
 ThreadPool::~ThreadPool()
 {
 	shutDown();
@@ -33,45 +60,104 @@ ThreadPool::~ThreadPool()
 
 void ThreadPool::shutDown()
 {
-	active = false;
 	std::unique_lock<std::mutex> lock(globalLock);
+	active = false;
 	monitor.notify_all();
 	lock.unlock();
 	for (auto & thread : pool)
 	{
 		thread.join();
 	}
+	pool.clear();
 }
 
 void ThreadPool::addTask(std::unique_ptr<Runnable> task)
 {
-	std::unique_lock<std::mutex> lock(globalLock);
-	tasks.push(std::move(task));
+	// Counted before it can be taken, so pendingTasks never goes below zero. Idle workers
+	// can't check it until the task is in its queue, as they need the global lock
+	std::unique_lock<std::mutex> globalGuard(globalLock);
+	pendingTasks++;
+
+	WorkerQueue & queue = *queues[nextQueue];
+	nextQueue = (nextQueue + 1) % poolSize;
+
+	std::unique_lock<std::mutex> lock(queue.lock);
+	queue.tasks.push_back(std::move(task));
 	lock.unlock();
-	monitor.notify_one();
+
+	monitor.notify_all();
 }
 
-void ThreadPool::pollTask()
+void ThreadPool::addTasks(std::vector<std::unique_ptr<Runnable>> & tasks)
 {
-	while (active)
+	const unsigned int count = (unsigned int)tasks.size();
+
+	// As in addTask
+	std::unique_lock<std::mutex> globalGuard(globalLock);
+	pendingTasks += count;
+
+	for (unsigned int worker = 0; worker < poolSize; worker++)
 	{
-		std::unique_lock<std::mutex> lock(globalLock);
-		while (tasks.empty() && active)
+		unsigned int start = (unsigned int)((unsigned long long)(count) * worker / poolSize);
+		unsigned int end = (unsigned int)((unsigned long long)(count) * (worker + 1) / poolSize);
+
+		std::unique_lock<std::mutex> lock(queues[worker]->lock);
+		for (unsigned int i = start; i < end; i++)
 		{
-			monitor.wait(lock);
+			queues[worker]->tasks.push_back(std::move(tasks[i]));
 		}
+	}
+	tasks.clear();
+
+	monitor.notify_all();
+}
 
-		if (!tasks.empty())
+std::unique_ptr<Runnable> ThreadPool::takeTask(unsigned int worker)
+{
+	std::unique_ptr<Runnable> task;
+
+	for (unsigned int i = 0; i < poolSize && !task; i++)
+	{
+		unsigned int victim = (worker + i) % poolSize;
+		WorkerQueue & queue = *queues[victim];
+
+		std::unique_lock<std::mutex> lock(queue.lock);
+		if (queue.tasks.empty())
 		{
-			std::unique_ptr<Runnable> task = std::move(tasks.front());
-			tasks.pop();
-			lock.unlock();
+			continue;
+		}
 
-			task->run();
+		if (victim == worker)
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
 		}
 		else
 		{
-			lock.unlock();
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
 		}
 	}
-}
\ No newline at end of file
+
+	if (task)
+	{
+		pendingTasks--;
+	}
+	return task;
+}
+
+void ThreadPool::pollTask(unsigned int worker)
+{
+	while (active)
+	{
+		std::unique_ptr<Runnable> task = takeTask(worker);
+		if (task)
+		{
+			task->run();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(globalLock);
+		monitor.wait(lock, [this]() { return pendingTasks > 0 || !active; });
+	}
+}
@@ -3,34 +3,65 @@
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <atomic>
 #include <list>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <memory>
 
 class Runnable
 {
 public:
+	virtual ~Runnable() {}
 	virtual void run() = 0;
 };
 
+/*
+ThreadPool Class - Worker threads with a task deque each, and work stealing
+
+Tasks are spread over the deques of the workers in contiguous blocks, so neighbour tasks stay on the
+same worker. A worker takes its tasks from the front of its own deque, and once it runs out, steals
+them from the back of the deques of the others. Every deque has its own lock, only held to push or
+pop a task, and idle workers sleep until new tasks are added
+*/
 class ThreadPool
 {
 private:
+	struct WorkerQueue
+	{
+		std::mutex lock;
+		std::deque<std::unique_ptr<Runnable>> tasks;
+	};
+
 	std::list<std::thread> pool;
-	std::queue<std::unique_ptr<Runnable>> tasks;
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::atomic<unsigned int> pendingTasks;	// Tasks added and not taken yet by any worker
+	unsigned int nextQueue;					// Deque of the next task added alone
 
-	std::mutex globalLock;
+	std::mutex globalLock;					// Held by idle workers to wait for tasks, and while tasks are added
 	std::condition_variable monitor;
 
-	bool active;
+	std::atomic<bool> active;
 	unsigned int poolSize;
 public:
-	ThreadPool();
+	ThreadPool(unsigned int threadCount = 0);	// 0 for _RT_THREAD_COUNT
 	~ThreadPool();
 
 	unsigned int getPoolSize() { return poolSize; }
 	bool isActive() { return active; }
-	void init();
+	void init(unsigned int threadCount = 0);
+
+	// Restarts the workers if the pool does not have the threads asked for (0 for _RT_THREAD_COUNT)
+	void resize(unsigned int threadCount);
 	void addTask(std::unique_ptr<Runnable> task);
+
+	// Adds the tasks in order, split in as many contiguous blocks as workers
+	void addTasks(std::vector<std::unique_ptr<Runnable>> & tasks);
 	void shutDown();
-	void pollTask();
-};
\ No newline at end of file
+	void pollTask(unsigned int worker);
+
+private:
+	// Next task of the worker: its own first one, or else the last one of another worker
+	std::unique_ptr<Runnable> takeTask(unsigned int worker);
+	static unsigned int computePoolSize(unsigned int threadCount);
+};
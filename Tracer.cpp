@@ -1,88 +1,227 @@
-#include <time.h>
-
 #include "Tracer.h"
 #include "Config.h"
 #include "PhysicalMaterial.h"
 
+#include <cfloat>
+#include <algorithm>
+
+// =====================================================================
+
+// Pixels darker than this are given the error allowed at this luminance
+static const double ADAPTIVE_MIN_LUMINANCE = 0.1;
+
+// Sample index of the first pilot sample of adaptive sampling, far from the ones of the image
+static const unsigned int ADAPTIVE_PILOT_FIRST_SAMPLE = 1u << 24;
+
+void PixelVariance::addSample(Vector & color)
+{
+	double luminance = 0.2126 * color.x + 0.7152 * color.y + 0.0722 * color.z;
+
+	count++;
+	double delta = luminance - mean;
+	mean += delta / double(count);
+	squaredDeviations += delta * (luminance - mean);
+}
+
+// Standard error of the mean of count samples, relative to the mean
+static float relativeStandardError(double variance, double mean, unsigned int count)
+{
+	double standardError = sqrt(variance / double(count));
+	return float(standardError / (mean > ADAPTIVE_MIN_LUMINANCE ? mean : ADAPTIVE_MIN_LUMINANCE));
+}
+
+float PixelVariance::relativeError() const
+{
+	if (count < 2)
+	{
+		return FLT_MAX;
+	}
+	return relativeStandardError(getVariance(), mean, count);
+}
+
 // =====================================================================
 
 // Computes the necessary data to cast rays from camera before starting rendering
 void Tracer::init()
 {
-	wrapper.wrap(scene->GetCamera(), Scene::WINDOW_WIDTH, Scene::WINDOW_HEIGHT);
+	Camera camera = scene->GetCamera();
+	wrapper.wrap(camera, settings.width, settings.height);
+	sampleCounts.assign(settings.width * settings.height, 0);
+
+#ifdef _RT_ADAPTIVE_SAMPLING
+	unsigned int tilesX = (settings.width + _RT_ADAPTIVE_TILE_SIZE - 1) / _RT_ADAPTIVE_TILE_SIZE;
+	unsigned int tilesY = (settings.height + _RT_ADAPTIVE_TILE_SIZE - 1) / _RT_ADAPTIVE_TILE_SIZE;
+	pilots.assign(settings.width * settings.height, PixelVariance());
+	tileErrors.assign(tilesX * tilesY, 0.0f);
+	tilePilotsTraced.reset(new std::once_flag[tilesX * tilesY]);
+#endif
 }
 
-// Checks whether the given ray intersect with any scene geometry
-HitInfo Tracer::intersect(Ray & ray)
+Vector Tracer::tracePixelSamples(int screenX, int screenY, unsigned int sampleCount, unsigned int maxSamples)
 {
-	HitInfo info;
+	unsigned int count = sampleCount;
+
+#ifdef _RT_ADAPTIVE_SAMPLING
+	// The pilot samples of the whole tile are traced by the first of its pixels
+	unsigned int tileX = (unsigned int)(screenX) / _RT_ADAPTIVE_TILE_SIZE;
+	unsigned int tileY = (unsigned int)(screenY) / _RT_ADAPTIVE_TILE_SIZE;
+	unsigned int tile = tileY * ((settings.width + _RT_ADAPTIVE_TILE_SIZE - 1) / _RT_ADAPTIVE_TILE_SIZE) + tileX;
+	std::call_once(tilePilotsTraced[tile], [this, tileX, tileY]() { traceTilePilots(tileX, tileY); });
+
+	// A few pilot samples easily miss rare bright paths (small lights, caustics), so a pixel is
+	// never trusted to be less noisy than its tile. The error falls with the square root of the
+	// number of samples. Counts are rounded up to whole batches, so the low discrepancy samplers
+	// end with well spread samples
+	const PixelVariance & pilot = pilots[screenY * settings.width + screenX];
+	float error = pilot.relativeError();
+	error = error > tileErrors[tile] ? error : tileErrors[tile];
+	float errorRatio = error / settings.adaptiveErrorThreshold;
+	float needed = clampValue(float(pilot.getCount()) * errorRatio * errorRatio, float(settings.adaptiveMinSamples), float(maxSamples));
+	count = (unsigned int)(ceil(needed / settings.adaptiveBatchSamples)) * settings.adaptiveBatchSamples;
+	count = count < maxSamples ? count : maxSamples;
+#else
+	(void)maxSamples;	// Only adaptive sampling takes other counts than sampleCount
+#endif
 
-	// Initialize to false. If no objects are hit, it will remain as no hit at the end
-	HitInfo closer;
-	closer.hit = false;
+	Vector color;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		color = color + traceSample(screenX, screenY, i);
+	}
 
-	Vector camPos = scene->GetCamera().GetPosition();
+	recordSampleCount(screenX, screenY, count);
+	return color / float(count);
+}
 
-	// Iterate over all scene objects
-	for (unsigned int i = 0; i < scene->GetNumObjects(); i++)
+void Tracer::renderTile(const ImageTile & tile, FrameBuffer & frameBuffer)
+{
+	for (unsigned int i = tile.yStart; i < tile.yEnd; i++)
 	{
-		SceneObject * object = scene->GetObject(i);
+		for (unsigned int j = tile.xStart; j < tile.xEnd; j++)
+		{
+			frameBuffer.setPixel(j, i, doTrace(j, i));
+		}
+	}
+}
 
-		object->testIntersection(ray, info);
-		if (info.hit)
+void Tracer::accumulateTileSamples(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount, Vector * sums)
+{
+	for (unsigned int i = tile.yStart; i < tile.yEnd; i++)
+	{
+		Vector * rowSum = &sums[i * settings.width];
+		for (unsigned int j = tile.xStart; j < tile.xEnd; j++)
 		{
-			if (closer.hit)
+			for (unsigned int sampleIndex = firstSample; sampleIndex < firstSample + sampleCount; sampleIndex++)
 			{
-				// After 2+ hits, check to keep the closer one
-				float closerDist = (camPos - closer.hitPoint).Magnitude();
-				float currentDist = (camPos - info.hitPoint).Magnitude();
+				rowSum[j] = rowSum[j] + traceSample(j, i, sampleIndex);
+			}
+		}
+	}
+}
 
-				if (closerDist <= currentDist)
-				{
-					continue;
-				}
+#ifdef _RT_ADAPTIVE_SAMPLING
+// The pilot samples only estimate the variance. If the image samples chose their own count,
+// pixels whose first paths were dark (and so not very noisy) would stop with a darker mean
+void Tracer::traceTilePilots(unsigned int tileX, unsigned int tileY)
+{
+	unsigned int startX = tileX * _RT_ADAPTIVE_TILE_SIZE;
+	unsigned int startY = tileY * _RT_ADAPTIVE_TILE_SIZE;
+	unsigned int endX = startX + _RT_ADAPTIVE_TILE_SIZE < settings.width ? startX + _RT_ADAPTIVE_TILE_SIZE : settings.width;
+	unsigned int endY = startY + _RT_ADAPTIVE_TILE_SIZE < settings.height ? startY + _RT_ADAPTIVE_TILE_SIZE : settings.height;
+
+	double varianceSum = 0.0;
+	double meanSum = 0.0;
+	for (unsigned int y = startY; y < endY; y++)
+	{
+		for (unsigned int x = startX; x < endX; x++)
+		{
+			PixelVariance & pilot = pilots[y * settings.width + x];
+			for (unsigned int i = 0; i < settings.adaptivePilotSamples; i++)
+			{
+				Vector sample = traceSample(x, y, ADAPTIVE_PILOT_FIRST_SAMPLE + i);
+				pilot.addSample(sample);
 			}
-			closer = info;
+			varianceSum += pilot.getVariance();
+			meanSum += pilot.getMean();
 		}
 	}
 
-	return closer;
+	// Variance inside the pixels (not between them), averaged over the tile
+	double pixels = double((endX - startX) * (endY - startY));
+	unsigned int tileIndex = tileY * ((settings.width + _RT_ADAPTIVE_TILE_SIZE - 1) / _RT_ADAPTIVE_TILE_SIZE) + tileX;
+	tileErrors[tileIndex] = relativeStandardError(varianceSum / pixels, meanSum / pixels, settings.adaptivePilotSamples);
 }
+#endif
 
-// Checks whether the light can be seen from the hitPoint contained in the HitInfo struct
-Vector Tracer::lightContribution(HitInfo & info, Vector & lightVector, SceneLight * light)
+#ifdef _RT_USE_BVH
+// Top level BVH callback. Dispatches the ray to the object intersection routine,
+// which keeps the closest hit by shrinking the ray interval
+struct SceneObjectTest
 {
-	float distToLight = lightVector.Magnitude();
-	lightVector = lightVector.Normalize();
+	Scene * scene;
+	HitInfo & closest;
 
-	const unsigned int sceneObjectCount = scene->GetNumObjects();
+	SceneObjectTest(Scene * scene, HitInfo & closest) :scene(scene), closest(closest) {}
 
-	Ray lightVisibilityTest(info.hitPoint + lightVector * _RT_BIAS, lightVector);
-	HitInfo visibilityInfo;
-	bool visible = true;
-	// Iterate over all scene objects to check for occlusions
-	for (unsigned int i = 0; i < sceneObjectCount && visible; i++)
+	bool operator()(unsigned int objectIndex, Ray & ray)
 	{
-		SceneObject * so = scene->GetObject(i);
+		return scene->GetObject(objectIndex)->testIntersection(ray, closest);
+	}
+};
 
-		so->testIntersection(lightVisibilityTest, visibilityInfo);
-		
-		if (visibilityInfo.isLight)
-			continue;
+// Top level BVH any hit callback for shadow rays. Emissive objects never occlude
+struct SceneOcclusionTest
+{
+	Scene * scene;
 
-		if (visibilityInfo.hit)
-		{
-			// check whether light or occluder is closer
-			float distanceToHit = (visibilityInfo.hitPoint - info.hitPoint).Magnitude();
-			if (distanceToHit < distToLight)
-			{
-				visible = false;
-			}
-		}
+	SceneOcclusionTest(Scene * scene) :scene(scene) {}
+
+	bool operator()(unsigned int objectIndex, const Ray & segment)
+	{
+		SceneObject * object = scene->GetObject(objectIndex);
+		return !object->IsLight() && object->occluded(segment, segment.getTMax());
 	}
+};
+#endif
+
+// Checks whether the given ray intersect with any scene geometry
+HitInfo Tracer::intersect(Ray & ray)
+{
+	HitInfo closer;
+	intersect(ray, closer);
+	return closer;
+}
+
+bool Tracer::intersect(Ray & ray, HitInfo & closer)
+{
+	// Initialize to false. If no objects are hit, it will remain as no hit at the end
+	closer.hit = false;
+	closer.rayBias = settings.bias;
+	closer.maxSurvival = settings.russianRouletteMaxSurvival;
+
+#ifdef _RT_USE_BVH
+	SceneObjectTest test(scene, closer);
+	scene->GetObjectBVH().traverse(ray, test);
+#else
+	// Iterate over all scene objects. Every hit shrinks the ray interval,
+	// so the last one is the closest
+	for (unsigned int i = 0; i < scene->GetNumObjects(); i++)
+	{
+		scene->GetObject(i)->testIntersection(ray, closer);
+	}
+#endif
+
+	return closer.hit;
+}
+
+// Checks whether the light can be seen from the hitPoint contained in the HitInfo struct
+Vector Tracer::lightContribution(HitInfo & info, Vector & lightVector, SceneLight * light)
+{
+	float distToLight = lightVector.Magnitude();
+	lightVector = lightVector.Normalize();
 
 	// If visible, return attenuated light color
-	if (visible)
+	if (isVisible(info.hitPoint, lightVector, distToLight))
 	{
 		float squaredDist = distToLight * distToLight;
 		return (light->color / (light->attenuationConstant + light->attenuationLinear * distToLight + light->attenuationQuadratic * squaredDist));
@@ -93,13 +232,42 @@ Vector Tracer::lightContribution(HitInfo & info, Vector & lightVector, SceneLigh
 	}
 }
 
+// Shadow ray test: whether anything but lights lies between fromPoint and the given distance along direction
+bool Tracer::isVisible(Vector & fromPoint, Vector & direction, float distance)
+{
+	// Only occluders between the hit point and the light matter
+	Ray lightVisibilityTest(fromPoint + direction * settings.bias, direction);
+
+#ifdef _RT_USE_BVH
+	SceneOcclusionTest test(scene);
+	return !scene->GetObjectBVH().occluded(lightVisibilityTest, distance, test);
+#else
+	const unsigned int sceneObjectCount = scene->GetNumObjects();
+
+	// Iterate over all scene objects until an occluder is found
+	for (unsigned int i = 0; i < sceneObjectCount; i++)
+	{
+		SceneObject * so = scene->GetObject(i);
+
+		if (so->IsLight())
+			continue;
+
+		if (so->occluded(lightVisibilityTest, distance))
+		{
+			return false;
+		}
+	}
+	return true;
+#endif
+}
+
 // =====================================================================
 
 // Launchs a ray from the camara given the screen pixel coordinates
 Vector RayTracer::doTrace(int screenX, int screenY)
 {
-	float t = float(screenX) / float(Scene::WINDOW_WIDTH);
-	float s = float(screenY) / float(Scene::WINDOW_HEIGHT);
+	float t = float(screenX) / float(settings.width);
+	float s = float(screenY) / float(settings.height);
 
 	Ray ray = wrapper.getRayForPixel(t, s);
 
@@ -113,7 +281,7 @@ Vector RayTracer::shade(Ray & ray)
 	HitInfo info;
 
 	// Check whether this ray has already reached max depth
-	if (ray.getDepth() < _RT_MAX_BOUNCES && (info = intersect(ray)).hit)
+	if (ray.getDepth() < settings.maxBounces && (info = intersect(ray)).hit)
 	{
 		SceneMaterial averageMaterialAtPoint = info.hittedMaterial;
 		Vector Lr;
@@ -121,7 +289,7 @@ Vector RayTracer::shade(Ray & ray)
 		Vector lightVector;
 		Vector I;
 
-		PhysicalMaterial * BRDF = PhysicalMaterialTable::getInstance().getMaterialByName(info.physicalMaterial);
+		PhysicalMaterial * BRDF = info.object->GetPhysicalMaterial();
 		if (BRDF == NULL)
 		{
 			// Clearly signal an object without proper material
@@ -193,30 +361,25 @@ Vector BBTracer::shade(Ray & ray)
 
 // =====================================================================
 
-// Ray tracing but tracing 100 rays per pixel using a non uniform random "sampler"
+// Ray tracing but tracing 100 rays per pixel (fewer where adaptive sampling sees they are not needed) using a non uniform random "sampler"
 Vector SuperSamplingRayTracer::doTrace(int screenX, int screenY)
 {
-	srand(unsigned int(time(NULL)));
+	return tracePixelSamples(screenX, screenY, getPixelSamples(), getPixelSamples());
+}
 
-	Vector color;
-	Ray ray;
+Vector SuperSamplingRayTracer::traceSample(int screenX, int screenY, unsigned int sampleIndex)
+{
 	static float max = 1.0 - FLT_EPSILON;
-	float rand1, rand2, t, s;
-
-	for (unsigned int pass = 0; pass < _RT_SUPERSAMPLING_SAMPLES; pass++)
-	{
-		rand1 = float(rand() % _RT_RAND_PRECISSION) / float(_RT_RAND_PRECISSION);
-		rand2 = float(rand() % _RT_RAND_PRECISSION) / float(_RT_RAND_PRECISSION);
 
-		t = (float(screenX) + rand1 * max) / float(Scene::WINDOW_WIDTH);
-		s = (float(screenY) + rand2 * max) / float(Scene::WINDOW_HEIGHT);
+	PathSampler sampler(screenX, screenY, sampleIndex, scene->GetSamplerType());
+	float rand1 = sampler.sampleRect();
+	float rand2 = sampler.sampleRect();
 
-		ray = wrapper.getRayForPixel(t, s);
+	float t = (float(screenX) + rand1 * max) / float(settings.width);
+	float s = (float(screenY) + rand2 * max) / float(settings.height);
 
-		color = color + shade(ray);
-	}
-
-	return (color / float(_RT_SUPERSAMPLING_SAMPLES));
+	Ray ray = wrapper.getRayForPixel(t, s);
+	return shade(ray);
 }
 
 // =============================================================================
@@ -229,49 +392,47 @@ Vector MonteCarloRayTracer::doTrace(int screenX, int screenY)
 	Ray ray;
 
 	// Monte carlo AA
-	for (unsigned int i = 0; i < _RT_MC_PIXEL_SAMPLES; i++)
+	for (unsigned int i = 0; i < settings.monteCarloPixelSamples; i++)
 	{
-		samplePixel(screenX, screenY, st, ss, pdf);
+		PathSampler sampler(screenX, screenY, i, scene->GetSamplerType());
+		samplePixel(screenX, screenY, st, ss, pdf, sampler);
 		ray = wrapper.getRayForPixel(st, ss);
 
-		pixelColor = pixelColor + shade(ray) / pdf;
+		pixelColor = pixelColor + shade(ray, sampler) / pdf;
 	}
 
-	pixelColor = pixelColor / _RT_MC_PIXEL_SAMPLES;
+	pixelColor = pixelColor / settings.monteCarloPixelSamples;
 
 	return pixelColor;
 }
 
-Vector MonteCarloRayTracer::shade(Ray & ray)
+Vector MonteCarloRayTracer::shade(Ray & ray, PathSampler & sampler)
 {
-	if (ray.getDepth() > _RT_RUSSIAN_ROULETE_MIN_BOUNCE && ray.getCosineWeight() >= 0.0f)
+	// Russian roulette with the survival probability given by the material that scattered the ray.
+	// Surviving rays are divided by it, so the estimate stays unbiased
+	float survival = 1.0f;
+	if (ray.getDepth() > settings.russianRouletteMinBounce && ray.getWeight() >= 0.0f)
 	{
-		float p = russianRouletteSampler.sampleRect();
+		float p = sampler.sampleRect();
 
-		if (p > ray.getCosineWeight())
+		if (p >= ray.getWeight())
 		{
 			return Vector();
 		}
+		survival = ray.getWeight();
 	}
 
 	HitInfo info;
 
-	if (ray.getDepth() < _RT_MAX_BOUNCES && (info = intersect(ray)).hit)
+	if (ray.getDepth() < settings.maxBounces && (info = intersect(ray)).hit)
 	{
 		// If its a light, return the color and stop bouncing
 		if (info.isLight)
 		{
-			return info.emission;
+			return info.emission / survival;
 		}
 
 		SceneMaterial averageMaterialAtPoint = info.hittedMaterial;
-		Vector diffuseC = averageMaterialAtPoint.diffuse;
-
-		// If this ray passed the roulette test, divide by its probability
-		if (ray.getCosineWeight() > 0.0f)
-		{
-			diffuseC = diffuseC / ray.getCosineWeight();
-		}
 
 		Vector Lr;
 		Ray scattered;
@@ -279,58 +440,56 @@ Vector MonteCarloRayTracer::shade(Ray & ray)
 		Vector I;
 
 		// Purple color to identify wrong setted scene objects
-		PhysicalMaterial * BRDF = PhysicalMaterialTable::getInstance().getMaterialByName(info.physicalMaterial);
+		PhysicalMaterial * BRDF = info.object->GetPhysicalMaterial();
 		if (BRDF == NULL)
 		{
 			return Vector(1.0, 0.0, 1.0);
 		}
 
-		// Direct lighting
-		for (unsigned int i = 0; i < scene->GetNumLights(); i++)
+		// Direct lighting from a single light, chosen by its estimated contribution
+		float selectionPdf;
+		SceneLight * sl = scene->SampleLight(info.hitPoint, info.hitNormal, selectionPdf, sampler);
+		if (sl != NULL)
 		{
 			// Get light vector by sampling a point in the light
 			// (for point light its always the same point)
-			Vector diffuseC, specularC;
-			SceneLight * sl = scene->GetLight(i);
-
 			float dirPdf;
-			lightVector = sl->sampleDirection(info.hitPoint, dirPdf);
+			Vector lightNormal;
+			lightVector = sl->sampleDirection(info.hitPoint, dirPdf, lightNormal, sampler);
 
-			if (dirPdf == 0.0f)
+			if (dirPdf > 0.0f)
 			{
-				continue;
-			}
+				I = lightContribution(info, lightVector, sl);
+				info.lightVector = lightVector;
+				float cosValue = clampValue(info.hitNormal.Dot(lightVector), 0.0f, 1.0f);
 
-			I = lightContribution(info, lightVector, sl);
-			info.lightVector = lightVector;
-			float cosValue = clampValue(info.hitNormal.Dot(lightVector), 0.0f, 1.0f);
+				// Diffuse reflectance
+				Vector diffuseC = BRDF->computeDiffuseRadiance(info);
 
-			// Diffuse reflectance
-			diffuseC = BRDF->computeDiffuseRadiance(info);
+				// Only direct lighting is multiplied by cosine because it has been optimized to reduce
+				// computation needed for diffuse and indirect lighting pdf's.
+				// The light is shaded as a point at the sampled position, so its area pdf is not applied
+				Lr = (I * cosValue * diffuseC) / selectionPdf;
+			}
+		}
 
-			// Diffuse - Diffuse light transport
-			Vector indirectLighting;
-			for (unsigned int s = 0; s < _RT_MC_BOUNCES_SAMPLES; s++)
+		// Diffuse - Diffuse light transport
+		Vector indirectLighting;
+		for (unsigned int s = 0; s < settings.monteCarloBounceSamples; s++)
+		{
+			float dPdf;
+			Vector scatteredResult (1.0f, 1.0f, 1.0f);
+			if(BRDF->sampleDiffuseRadiance(info, scattered, scatteredResult, dPdf, sampler))
 			{
-				float dPdf;
-				Vector scatteredResult (1.0f, 1.0f, 1.0f);
-				if(BRDF->sampleDiffuseRadiance(info, scattered, scatteredResult, dPdf))
-				{
-					indirectLighting = indirectLighting + (scatteredResult * shade(scattered) / dPdf);
-				}
+				indirectLighting = indirectLighting + (scatteredResult * shade(scattered, sampler) / dPdf);
 			}
+		}
 
-			//diffuseC = diffuseC + (specularContribution / _RT_MC_BOUNCES_SAMPLES);
-
-			indirectLighting = indirectLighting / _RT_MC_BOUNCES_SAMPLES;
+		indirectLighting = indirectLighting / settings.monteCarloBounceSamples;
 
-			// Compute total radiance. Only direct lighting is multiplied by cosine because
-			// it has been optimized to reduce computation needed for diffuse and indirect lighting pdf's
-			//
-			Lr = (Lr + ((I * cosValue * diffuseC) + indirectLighting) / (dirPdf));
-			//Lr = (Lr + (((I * cosValue) + indirectLighting) * diffuseC) / (dirPdf));
-			fixGammut(Lr);
-		}
+		// Compute total radiance
+		Lr = Lr + indirectLighting;
+		fixGammut(Lr);
 
 		// REFLECTION AND REFRACTION
 		float kr, RPdf, kt, TPdf;
@@ -338,47 +497,48 @@ Vector MonteCarloRayTracer::shade(Ray & ray)
 		BRDF->sampleScatterReflexionAndRefraction(info, reflected, kr, RPdf, refracted, kt, TPdf);
 
 		// Russian roulette depth reached and material has both reflection and refraction
-		if (ray.getDepth() > _RT_RUSSIAN_ROULETE_MIN_BOUNCE && kr > 0.0f && kt > 0.0f)
+		if (ray.getDepth() > settings.russianRouletteMinBounce && kr > 0.0f && kt > 0.0f)
 		{
-			float reflectiveProbability = russianRouletteSampler.sampleRect();
+			float reflectiveProbability = sampler.sampleRect();
 			if (kr > reflectiveProbability)
 			{
-				Lr = Lr + (averageMaterialAtPoint.reflective * kr) * shade(reflected) / kr;
+				Lr = Lr + (averageMaterialAtPoint.reflective * kr) * shade(reflected, sampler) / kr;
 			}
 			else
 			{
-				Lr = Lr + (averageMaterialAtPoint.transparent * kt) * shade(refracted) / (1 - kr);
+				Lr = Lr + (averageMaterialAtPoint.transparent * kt) * shade(refracted, sampler) / (1 - kr);
 			}
 		}
 		else  // No depth enough to apply russian roulette
 		{
 			if (kr > 0.0f)
 			{
-				Lr = Lr + (averageMaterialAtPoint.reflective * kr) * shade(reflected);
+				Lr = Lr + (averageMaterialAtPoint.reflective * kr) * shade(reflected, sampler);
 			}
 			
 			if(kt > 0.0f)
 			{
-				Lr = Lr + (averageMaterialAtPoint.transparent * kt) * shade(refracted);
+				Lr = Lr + (averageMaterialAtPoint.transparent * kt) * shade(refracted, sampler);
 			}
 		}
 
-		return Lr;
+		return Lr / survival;
 	}
 	else
 	{
-		return scene->GetBackground().color;
+		Vector background = scene->GetBackground().color;
+		return background / survival;
 	}
 }
 
-void MonteCarloRayTracer::samplePixel(int x, int y, float &st, float &ss, float &pdf)
+void MonteCarloRayTracer::samplePixel(int x, int y, float &st, float &ss, float &pdf, PathSampler & sampler)
 {
-	Vector sample = pixelSampler.samplePlane();
+	Vector sample = sampler.samplePlane();
 	float sampledPixelX = float(x) + ((sample.x * 2.0f) - 1.0f);
 	float sampledPixelY = float(y) + ((sample.y * 2.0f) - 1.0f);
 
-	st = float(sampledPixelX) / float(Scene::WINDOW_WIDTH);
-	ss = float(sampledPixelY) / float(Scene::WINDOW_HEIGHT);
+	st = float(sampledPixelX) / float(settings.width);
+	ss = float(sampledPixelY) / float(settings.height);
 
 	//uniform distributed pdf($) = 1 / (b - a)
 	//pdf(x) = 1 / (1 - 0) = 1
@@ -391,112 +551,487 @@ void MonteCarloRayTracer::samplePixel(int x, int y, float &st, float &ss, float
 
 Vector PathTracer::doTrace(int screenX, int screenY)
 {
-	Vector pixelColor;
+	return tracePixelSamples(screenX, screenY, getPixelSamples(), settings.adaptiveMaxSamples);
+}
+
+Vector PathTracer::traceSample(int screenX, int screenY, unsigned int sampleIndex)
+{
 	float st, ss;
 	float pdf;
-	Ray ray;
 
 	// Monte carlo AA
-	for (unsigned int i = 0; i < _RT_PATHTRACER_PIXEL_SAMPLES; i++)
+	PathSampler sampler(screenX, screenY, sampleIndex, scene->GetSamplerType());
+	samplePixel(screenX, screenY, st, ss, pdf, sampler);
+	Ray ray = wrapper.getRayForPixel(st, ss);
+
+	return shade(ray, sampler) / pdf;
+}
+
+// Dimension of every decision of a bounce, relative to the first dimension of the bounce.
+// Fixed, so a decision uses the same dimension whether or not the previous ones were taken
+enum PathTracerDimension
+{
+	RUSSIAN_ROULETTE_DIMENSION = 0,
+	LIGHT_CHOICE_DIMENSION = 1,
+	LIGHT_SAMPLE_DIMENSION = 2,	// Up to three: shape, triangle and point in it
+	BSDF_DIMENSION = 5,
+	BRANCH_DIMENSION = 6
+};
+
+// Power heuristic (beta = 2) weight of a sample taken with pdf fPdf, when gPdf could have taken it too
+static float powerHeuristic(float fPdf, float gPdf)
+{
+	float f2 = fPdf * fPdf;
+	float g2 = gPdf * gPdf;
+	return f2 > 0.0f ? f2 / (f2 + g2) : 0.0f;
+}
+
+// Branch left for later by a vertex that follows both reflection and transmission
+struct PendingBranch
+{
+	Ray ray;
+	Vector throughput;
+};
+
+Vector PathTracer::shade(Ray & cameraRay, PathSampler & sampler)
+{
+	// Depth first, so the waiting branches come from vertices of increasing depth along the current path. Only
+	// vertices up to pathTracerReflexTransmissionBounces deep split, which bounds how many wait at once
+	std::vector<PendingBranch> pending;
+
+	// The path is followed one bounce after the other. Throughput is the product of the BSDF * cos / pdf
+	// of the vertices so far, which weights whatever radiance is found from here on
+	Vector radiance;
+	Vector throughput(1.0f, 1.0f, 1.0f);
+	Ray ray = cameraRay;
+	HitInfo info;
+
+	for (;;)
 	{
-		samplePixel(screenX, screenY, st, ss, pdf);
-		ray = wrapper.getRayForPixel(st, ss);
+		// Bounces of the current branch, until it leaves the scene, reaches a light or is terminated
+		for (;;)
+		{
+			const unsigned int depth = ray.getDepth();
 
-		pixelColor = pixelColor + shade(ray) / pdf;
+			// Same dimensions for the same bounce on every sample of the pixel. The first one is the pixel position
+			const unsigned int firstDimension = 1 + depth * _RT_PATHTRACER_DIMENSIONS_PER_BOUNCE;
+
+			// Russian roulette with the throughput as survival probability: paths that can't carry much more energy
+			// are the likeliest to stop. Survivors are divided by it, so the estimate stays unbiased
+			if (depth > settings.pathTracerRussianRouletteBounces)
+			{
+				float survival = throughput.x > throughput.y ? (throughput.x > throughput.z ? throughput.x : throughput.z) : (throughput.y > throughput.z ? throughput.y : throughput.z);
+				survival = survival < settings.russianRouletteMaxSurvival ? survival : settings.russianRouletteMaxSurvival;
+
+				sampler.startDimension(firstDimension + RUSSIAN_ROULETTE_DIMENSION);
+				if (sampler.sampleRect() >= survival)
+				{
+					break;
+				}
+				throughput = throughput / survival;
+			}
+
+			if (depth >= settings.pathTracerBounces || !intersect(ray, info))
+			{
+				radiance = radiance + throughput * scene->GetBackground().color;
+				break;
+			}
+
+			// If its a light, add its emission and stop bouncing
+			if (info.isLight)
+			{
+#ifdef _RT_PATHTRACER_NEXT_EVENT_ESTIMATION
+				radiance = radiance + throughput * info.emission * emissionWeight(ray, info);
+#else
+				radiance = radiance + throughput * info.emission;
+#endif
+				break;
+			}
+
+			// Purple color to identify wrong setted scene objects
+			PhysicalMaterial * BRDF = info.object->GetPhysicalMaterial();
+			if (BRDF == NULL)
+			{
+				radiance = radiance + throughput * Vector(1.0, 0.0, 1.0);
+				break;
+			}
+
+			// The light sample is one bounce longer, so it is left out where scattered rays could not reach the light
+#ifdef _RT_PATHTRACER_NEXT_EVENT_ESTIMATION
+			if (BRDF->hasBSDFEvaluation() && scene->GetNumLights() > 0 && depth + 1 < settings.pathTracerBounces)
+			{
+				radiance = radiance + throughput * sampleDirectLighting(info, BRDF, sampler, firstDimension);
+			}
+#endif
+
+			Ray reflected, transmitted;
+			float kr, kt;
+			float RPdf, TPdf;
+			Vector Rresult, Tresult;
+			sampler.startDimension(firstDimension + BSDF_DIMENSION);
+			BRDF->sampleMaterial(info, reflected, kr, RPdf, transmitted, kt, TPdf, Rresult, Tresult, sampler);
+
+			if (kr != 0.0f && kt == 0.0f)
+			{
+				throughput = throughput * Rresult / RPdf;
+				ray = reflected;
+			}
+			else if (kt != 0.0f && kr == 0.0f)
+			{
+				throughput = throughput * Tresult / TPdf;
+				ray = transmitted;
+			}
+			else if (kr > 0.0f && kt > 0.0f)
+			{
+				if (depth > settings.pathTracerReflexTransmissionBounces)
+				{
+					sampler.startDimension(firstDimension + BRANCH_DIMENSION);
+					float reflectiveProbability = sampler.sampleRect();
+					if (kr > reflectiveProbability)
+					{
+						throughput = throughput * Rresult / kr;
+						ray = reflected;
+					}
+					else
+					{
+						throughput = throughput * Tresult / (1 - kr);
+						ray = transmitted;
+					}
+				}
+				else  // No depth enough to apply russian roulette: both are followed, the transmission afterwards
+				{
+					if (pending.capacity() == 0)	// Only paths that split pay for the stack
+					{
+						pending.reserve(settings.pathTracerReflexTransmissionBounces + 1);
+					}
+					pending.push_back({ transmitted, throughput * Tresult });
+
+					throughput = throughput * Rresult;
+					ray = reflected;
+				}
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		if (pending.empty())
+		{
+			return radiance;
+		}
+
+		ray = pending.back().ray;
+		throughput = pending.back().throughput;
+		pending.pop_back();
 	}
+}
 
-	pixelColor = pixelColor / _RT_PATHTRACER_PIXEL_SAMPLES;
+Vector PathTracer::sampleDirectLighting(HitInfo & info, PhysicalMaterial * BRDF, PathSampler & sampler, unsigned int firstDimension)
+{
+	float selectionPdf;
+	sampler.startDimension(firstDimension + LIGHT_CHOICE_DIMENSION);
+	SceneLight * light = scene->SampleLight(info.hitPoint, info.hitNormal, selectionPdf, sampler);
+	if (light == NULL)
+	{
+		return Vector();
+	}
 
-	return pixelColor;
+	sampler.startDimension(firstDimension + LIGHT_SAMPLE_DIMENSION);
+	float lightPdf;
+	Vector lightNormal;
+	Vector lightVector = light->sampleDirection(info.hitPoint, lightPdf, lightNormal, sampler);
+	if (lightPdf <= 0.0f)
+	{
+		return Vector();
+	}
+
+	// Point lights can't be reached by BSDF sampling, so they take the whole contribution
+	if (light->IsDeltaLight())
+	{
+		Vector I = lightContribution(info, lightVector, light);
+		return BRDF->evaluateBSDF(info, lightVector) * I / selectionPdf;
+	}
+
+	float distance = lightVector.Magnitude();
+	Vector lightDir = lightVector / distance;
+	float cosLight = fabsf(lightNormal.Dot(lightDir));
+	Vector f = BRDF->evaluateBSDF(info, lightDir);
+	if (cosLight <= 0.0f || (f.x <= 0.0f && f.y <= 0.0f && f.z <= 0.0f) || !isVisible(info.hitPoint, lightDir, distance))
+	{
+		return Vector();
+	}
+
+	// Area pdf to solid angle pdf, as seen from the hit point
+	float solidAnglePdf = selectionPdf * lightPdf * distance * distance / cosLight;
+	float weight = powerHeuristic(solidAnglePdf, BRDF->evaluatePdf(info, lightDir));
+
+	Vector emission = light->color;
+	return f * emission * (weight / solidAnglePdf);
 }
 
-Vector PathTracer::shade(Ray & ray)
+float PathTracer::emissionWeight(Ray & ray, HitInfo & info)
 {
-	if (ray.getDepth() > _RT_PATHTRACER_RR_BOUNCES && ray.getCosineWeight() >= 0.0f)
+	// Camera rays and rays from specular vertices could not have sampled the light
+	SceneLight * light = info.object->GetLight();
+	if (ray.getScatterPdf() <= 0.0f || light == NULL)
 	{
-		float p = russianRouletteSampler.sampleRect();
+		return 1.0f;
+	}
 
-		if (p > ray.getCosineWeight())
-		{
-			return Vector();
-		}
+	// The vertex that scattered the ray, without the offset that avoids self intersections
+	Vector direction = ray.getDirection();
+	Vector origin = ray.getOrigin();
+	Vector vertex = origin - direction * settings.bias;
+	Vector vertexNormal = ray.getScatterNormal();
+
+	Vector toLight = info.hitPoint - vertex;
+	float squaredDistance = toLight.Dot(toLight);
+	float cosLight = fabsf(info.hitNormal.Dot(direction));
+	if (cosLight <= 0.0f)
+	{
+		return 1.0f;
 	}
 
-	HitInfo info;
+	float selectionPdf = scene->PdfLight(vertex, vertexNormal, light);
+	float lightPdf = selectionPdf * light->pdfArea(vertex, info) * squaredDistance / cosLight;
+	return powerHeuristic(ray.getScatterPdf(), lightPdf);
+}
+// ================================================================
+
+void WavefrontPathTracer::renderTile(const ImageTile & tile, FrameBuffer & frameBuffer)
+{
+	const unsigned int tileWidth = tile.xEnd - tile.xStart;
+	const unsigned int tileHeight = tile.yEnd - tile.yStart;
+	const unsigned int pixelSamples = getPixelSamples();
+	const unsigned int batchSamples = getBatchSamples(tileWidth * tileHeight);
 
-	if (ray.getDepth() < _RT_PATHTRACER_BOUNCES && (info = intersect(ray)).hit)
+	std::vector<Vector> sums(tileWidth * tileHeight);
+	for (unsigned int firstSample = 0; firstSample < pixelSamples; firstSample += batchSamples)
 	{
-		// If its a light, return the color and stop bouncing
-		if (info.isLight)
+		unsigned int sampleCount = pixelSamples - firstSample < batchSamples ? pixelSamples - firstSample : batchSamples;
+		traceBatch(tile, firstSample, sampleCount, sums.data(), tileWidth);
+	}
+
+	for (unsigned int i = tile.yStart; i < tile.yEnd; i++)
+	{
+		for (unsigned int j = tile.xStart; j < tile.xEnd; j++)
 		{
-			return info.emission;
+			frameBuffer.setPixel(j, i, sums[(i - tile.yStart) * tileWidth + (j - tile.xStart)] / float(pixelSamples));
+			recordSampleCount(j, i, pixelSamples);
 		}
+	}
+}
 
-		SceneMaterial averageMaterialAtPoint = info.hittedMaterial;
-		Vector diffuseC = averageMaterialAtPoint.diffuse;
+// Sized for full tiles, since every tile of a pass takes the same samples
+unsigned int WavefrontPathTracer::getPassSamples() const
+{
+	return getBatchSamples(settings.tileSize * settings.tileSize);
+}
+
+void WavefrontPathTracer::accumulateTileSamples(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount, Vector * sums)
+{
+	traceBatch(tile, firstSample, sampleCount, &sums[tile.yStart * settings.width + tile.xStart], settings.width);
+}
+
+unsigned int WavefrontPathTracer::getBatchSamples(unsigned int tilePixels) const
+{
+	unsigned int batchSamples = settings.wavefrontBatchSize / tilePixels;
+	return batchSamples > 0 ? batchSamples : 1;
+}
 
-		// If this ray passed the roulette test, divide by its probability
-		if (ray.getCosineWeight() > 0.0f)
+void WavefrontPathTracer::traceBatch(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount, Vector * sums, unsigned int sumsStride)
+{
+	PhysicalMaterialTable & materialTable = PhysicalMaterialTable::getInstance();
+	const unsigned int materialCount = materialTable.getMaterialCount();
+	const unsigned int batchSize = (tile.xEnd - tile.xStart) * (tile.yEnd - tile.yStart) * sampleCount;
+
+	std::vector<WavefrontSample> samples;
+	std::vector<WavefrontRay> rays, nextRays;
+	samples.reserve(batchSize);
+	rays.reserve(batchSize);
+	nextRays.reserve(batchSize);
+
+	// Camera rays, a sample of every pixel after the other, so the pixels add their samples in order
+	for (unsigned int sampleIndex = firstSample; sampleIndex < firstSample + sampleCount; sampleIndex++)
+	{
+		for (unsigned int i = tile.yStart; i < tile.yEnd; i++)
 		{
-			diffuseC = diffuseC / ray.getCosineWeight();
+			for (unsigned int j = tile.xStart; j < tile.xEnd; j++)
+			{
+				samples.push_back(WavefrontSample(j, i, sampleIndex, scene->GetSamplerType(), (i - tile.yStart) * sumsStride + (j - tile.xStart)));
+
+				float st, ss;
+				float pdf;
+				samplePixel(j, i, st, ss, pdf, samples.back().sampler);
+
+				WavefrontRay camera;
+				camera.ray = wrapper.getRayForPixel(st, ss);
+				camera.throughput = Vector(1.0f, 1.0f, 1.0f) / pdf;
+				camera.sample = (unsigned int)(samples.size() - 1);
+				rays.push_back(camera);
+			}
 		}
+	}
 
-		// Purple color to identify wrong setted scene objects
-		PhysicalMaterial * BRDF = PhysicalMaterialTable::getInstance().getMaterialByName(info.physicalMaterial);
-		if (BRDF == NULL)
+	// Reused by every bounce
+	std::vector<HitInfo> hits;
+	std::vector<PhysicalMaterial *> hitMaterials;
+	std::vector<unsigned int> queueStarts(materialCount + 1);
+	std::vector<unsigned int> queueEnds(materialCount);
+	std::vector<unsigned int> queues;
+
+	while (!rays.empty())
+	{
+		hits.resize(rays.size());
+		hitMaterials.resize(rays.size());
+		for (unsigned int r = 0; r < rays.size(); r++)
 		{
-			return Vector(1.0, 0.0, 1.0);
+			hitMaterials[r] = intersectPath(rays[r], samples[rays[r].sample], hits[r]);
 		}
 
-		Ray reflected, transmitted;
-		float kr, kt;
-		float RPdf, TPdf;
-		Vector Rresult, Tresult;
-		BRDF->sampleMaterial(info, reflected, kr, RPdf, transmitted, kt, TPdf, Rresult, Tresult);
-
-		if (kr != 0.0f && kt == 0.0f)
+		// Counting sort of the hits by material, which keeps the order of the rays inside every queue
+		std::fill(queueStarts.begin(), queueStarts.end(), 0);
+		for (PhysicalMaterial * material : hitMaterials)
 		{
-			//fixGammut(Rresult);
-			return Rresult * shade(reflected) / RPdf;
+			if (material != NULL)
+			{
+				queueStarts[material->getId() + 1]++;
+			}
 		}
-		else if (kt != 0.0f && kr == 0.0f)
+		for (unsigned int m = 0; m < materialCount; m++)
 		{
-			return Tresult * shade(transmitted) / TPdf;
+			queueStarts[m + 1] += queueStarts[m];
+			queueEnds[m] = queueStarts[m];
 		}
-		else
+
+		queues.resize(queueStarts[materialCount]);
+		for (unsigned int r = 0; r < rays.size(); r++)
 		{
-			if (ray.getDepth() > _RT_PATHTRACER_RR_REFLEX_TRANSMISSION_BOUNCES && kr > 0.0f && kt > 0.0f)
+			if (hitMaterials[r] != NULL)
 			{
-				float reflectiveProbability = russianRouletteSampler.sampleRect();
-				if (kr > reflectiveProbability)
-				{
-					return Rresult * shade(reflected) / kr;
-				}
-				else
-				{
-					return Tresult * shade(transmitted) / (1 - kr);
-				}
+				queues[queueEnds[hitMaterials[r]->getId()]++] = r;
 			}
-			else  // No depth enough to apply russian roulette
+		}
+
+		// A material at a time, so the rays of a queue run the same shading code one after the other
+		nextRays.clear();
+		for (unsigned int m = 0; m < materialCount; m++)
+		{
+			for (unsigned int q = queueStarts[m]; q < queueStarts[m + 1]; q++)
 			{
-				Vector accumulated;
-				if (kr > 0.0f)
-				{
-					accumulated = accumulated + Rresult * shade(reflected);
-				}
+				const WavefrontRay & path = rays[queues[q]];
+				shadePath(path, samples[path.sample], hits[queues[q]], hitMaterials[queues[q]], nextRays);
+			}
+		}
 
-				if (kt > 0.0f)
-				{
-					accumulated = accumulated + Tresult * shade(transmitted);
-				}
+		rays.swap(nextRays);
+	}
 
-				return accumulated;
-			}
+	for (const WavefrontSample & sample : samples)
+	{
+		sums[sample.pixel] = sums[sample.pixel] + sample.radiance;
+	}
+}
+
+PhysicalMaterial * WavefrontPathTracer::intersectPath(WavefrontRay & path, WavefrontSample & sample, HitInfo & hit)
+{
+	const unsigned int depth = path.ray.getDepth();
+	const unsigned int firstDimension = 1 + depth * _RT_PATHTRACER_DIMENSIONS_PER_BOUNCE;
+
+	// Russian roulette, as in PathTracer::shade
+	if (depth > settings.pathTracerRussianRouletteBounces)
+	{
+		const Vector & throughput = path.throughput;
+		float survival = throughput.x > throughput.y ? (throughput.x > throughput.z ? throughput.x : throughput.z) : (throughput.y > throughput.z ? throughput.y : throughput.z);
+		survival = survival < settings.russianRouletteMaxSurvival ? survival : settings.russianRouletteMaxSurvival;
+
+		sample.sampler.startDimension(firstDimension + RUSSIAN_ROULETTE_DIMENSION);
+		if (sample.sampler.sampleRect() >= survival)
+		{
+			return NULL;
 		}
+		path.throughput = path.throughput / survival;
 	}
-	else
+
+	if (depth >= settings.pathTracerBounces || !intersect(path.ray, hit))
 	{
-		//std::cout << "Return black with depth " << ray.getDepth() << std::endl;
-		return scene->GetBackground().color;
+		sample.radiance = sample.radiance + path.throughput * scene->GetBackground().color;
+		return NULL;
+	}
+
+	if (hit.isLight)
+	{
+#ifdef _RT_PATHTRACER_NEXT_EVENT_ESTIMATION
+		sample.radiance = sample.radiance + path.throughput * hit.emission * emissionWeight(path.ray, hit);
+#else
+		sample.radiance = sample.radiance + path.throughput * hit.emission;
+#endif
+		return NULL;
 	}
-}
\ No newline at end of file
+
+	// Purple color to identify wrong setted scene objects
+	PhysicalMaterial * BRDF = hit.object->GetPhysicalMaterial();
+	if (BRDF == NULL)
+	{
+		sample.radiance = sample.radiance + path.throughput * Vector(1.0, 0.0, 1.0);
+	}
+	return BRDF;
+}
+
+void WavefrontPathTracer::shadePath(const WavefrontRay & path, WavefrontSample & sample, HitInfo & hit, PhysicalMaterial * BRDF, std::vector<WavefrontRay> & nextRays)
+{
+	const unsigned int depth = path.ray.getDepth();
+	const unsigned int firstDimension = 1 + depth * _RT_PATHTRACER_DIMENSIONS_PER_BOUNCE;
+
+#ifdef _RT_PATHTRACER_NEXT_EVENT_ESTIMATION
+	if (BRDF->hasBSDFEvaluation() && scene->GetNumLights() > 0 && depth + 1 < settings.pathTracerBounces)
+	{
+		sample.radiance = sample.radiance + path.throughput * sampleDirectLighting(hit, BRDF, sample.sampler, firstDimension);
+	}
+#endif
+
+	WavefrontRay reflected, transmitted;
+	float kr, kt;
+	float RPdf, TPdf;
+	Vector Rresult, Tresult;
+	sample.sampler.startDimension(firstDimension + BSDF_DIMENSION);
+	BRDF->sampleMaterial(hit, reflected.ray, kr, RPdf, transmitted.ray, kt, TPdf, Rresult, Tresult, sample.sampler);
+	reflected.sample = transmitted.sample = path.sample;
+
+	if (kr != 0.0f && kt == 0.0f)
+	{
+		reflected.throughput = path.throughput * Rresult / RPdf;
+		nextRays.push_back(reflected);
+	}
+	else if (kt != 0.0f && kr == 0.0f)
+	{
+		transmitted.throughput = path.throughput * Tresult / TPdf;
+		nextRays.push_back(transmitted);
+	}
+	else if (kr > 0.0f && kt > 0.0f)
+	{
+		if (depth > settings.pathTracerReflexTransmissionBounces)
+		{
+			sample.sampler.startDimension(firstDimension + BRANCH_DIMENSION);
+			float reflectiveProbability = sample.sampler.sampleRect();
+			if (kr > reflectiveProbability)
+			{
+				reflected.throughput = path.throughput * Rresult / kr;
+				nextRays.push_back(reflected);
+			}
+			else
+			{
+				transmitted.throughput = path.throughput * Tresult / (1 - kr);
+				nextRays.push_back(transmitted);
+			}
+		}
+		else  // Both are followed, in the same batch
+		{
+			reflected.throughput = path.throughput * Rresult;
+			transmitted.throughput = path.throughput * Tresult;
+			nextRays.push_back(reflected);
+			nextRays.push_back(transmitted);
+		}
+	}
+}
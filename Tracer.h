@@ -3,7 +3,22 @@
 #include "Utils.h"
 #include "Ray.h"
 #include "Scene.h"
+#include "FrameBuffer.h"
+
+class PhysicalMaterial;
 #include <random>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+// =================================================================================
+
+// Rectangle of pixels, rendered by a single task
+struct ImageTile
+{
+	unsigned int xStart, xEnd;
+	unsigned int yStart, yEnd;
+};
 
 // =================================================================================
 class CameraWrapper
@@ -24,20 +39,83 @@ public:
 
 // =================================================================================
 
+// Running mean and variance of the luminance of the samples of a pixel (Welford's algorithm)
+class PixelVariance
+{
+private:
+	unsigned int count;
+	double mean;
+	double squaredDeviations;
+public:
+	PixelVariance() :count(0), mean(0.0), squaredDeviations(0.0) {}
+
+	void addSample(Vector & color);
+	unsigned int getCount() const { return count; }
+	double getMean() const { return mean; }
+	double getVariance() const { return count > 1 ? squaredDeviations / double(count - 1) : 0.0; }
+
+	// Standard error of the mean luminance, relative to the luminance. Dark pixels are
+	// compared against a minimum luminance instead, or they would never converge
+	float relativeError() const;
+};
+
+// =================================================================================
+
 class Tracer
 {
 protected:
 	Scene * scene;
+	const RenderSettings settings;			// Copied when the tracer is created, for the whole render
 	CameraWrapper wrapper;
+	std::vector<unsigned int> sampleCounts;	// Samples taken by every pixel, by tracers that choose them per pixel
+#ifdef _RT_ADAPTIVE_SAMPLING
+	std::vector<PixelVariance> pilots;		// Pilot samples of every pixel
+	std::vector<float> tileErrors;			// Relative error of the pilots of every tile, as a whole
+	std::unique_ptr<std::once_flag[]> tilePilotsTraced;
+#endif
 public:
-	Tracer(Scene * scene) :scene(scene) {}
+	Tracer(Scene * scene, const RenderSettings & settings) :scene(scene), settings(settings) {}
+	virtual ~Tracer() {}
 
 	void init();
 
 	virtual Vector doTrace(int screenX, int screenY) = 0;
+
+	// Samples taken by the pixel in the last render (0 if the tracer does not record them)
+	unsigned int getSampleCount(int screenX, int screenY) const { return sampleCounts[screenY * settings.width + screenX]; }
+
+	// Samples doTrace averages for every pixel. Tracers that take more than one can also be asked for
+	// each of them with traceSample, so images can be rendered one sample per pixel at a time
+	virtual unsigned int getPixelSamples() const { return 1; }
+
+	// One camera sample of the pixel, for tracers that take several of them
+	virtual Vector traceSample(int screenX, int screenY, unsigned int sampleIndex) { return Vector(); }
+
+	// Every pixel of the tile, written to the frame buffer. Tracers that trace whole tiles at once
+	// override it and the next two, the rest take the pixels one by one
+	virtual void renderTile(const ImageTile & tile, FrameBuffer & frameBuffer);
+
+	// Samples of every pixel a progressive pass asks for at once
+	virtual unsigned int getPassSamples() const { return 1; }
+
+	// Samples firstSample to firstSample + sampleCount - 1 of every pixel of the tile, added to sums (one per
+	// pixel of the image, row by row)
+	virtual void accumulateTileSamples(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount, Vector * sums);
 protected:
+	// Average of sampleCount samples of the pixel. With adaptive sampling, a few pilot samples estimate its
+	// variance (and the one of its tile) instead, and it takes as many as it needs to reach the adaptive error threshold
+	// (up to maxSamples)
+	Vector tracePixelSamples(int screenX, int screenY, unsigned int sampleCount, unsigned int maxSamples);
+#ifdef _RT_ADAPTIVE_SAMPLING
+	void traceTilePilots(unsigned int tileX, unsigned int tileY);
+#endif
+	void recordSampleCount(int screenX, int screenY, unsigned int count) { sampleCounts[screenY * settings.width + screenX] = count; }
+
 	HitInfo intersect(Ray & ray);
+	// Same, filling the given info, so a caller that traces many rays can keep reusing one
+	bool intersect(Ray & ray, HitInfo & closer);
 	Vector lightContribution(HitInfo & info, Vector & lightVector, SceneLight * light);
+	bool isVisible(Vector & fromPoint, Vector & direction, float distance);
 	float getLightAttenuation(Ray & ray)
 	{
 		return (0.15f + 0.03f * ray.getDistance());
@@ -49,7 +127,7 @@ protected:
 class RayTracer : public Tracer
 {
 public:
-	RayTracer(Scene * scene) :Tracer(scene) {}
+	RayTracer(Scene * scene, const RenderSettings & settings) :Tracer(scene, settings) {}
 	virtual Vector doTrace(int screenX, int screenY);
 protected:
 	virtual Vector shade(Ray & ray);
@@ -60,7 +138,7 @@ protected:
 class BBTracer : public RayTracer
 {
 public:
-	BBTracer(Scene * scene):RayTracer(scene){}
+	BBTracer(Scene * scene, const RenderSettings & settings):RayTracer(scene, settings){}
 protected:
 	Vector shade(Ray & ray);
 };
@@ -70,8 +148,10 @@ protected:
 class SuperSamplingRayTracer : public RayTracer
 {
 public:
-	SuperSamplingRayTracer(Scene * scene) : RayTracer(scene) {}
+	SuperSamplingRayTracer(Scene * scene, const RenderSettings & settings) : RayTracer(scene, settings) {}
 	Vector doTrace(int screenX, int screenY);
+	unsigned int getPixelSamples() const { return settings.supersamplingSamples; }
+	Vector traceSample(int screenX, int screenY, unsigned int sampleIndex);
 };
 
 // =================================================================================
@@ -79,21 +159,22 @@ public:
 class MonteCarloRayTracer : public RayTracer
 {
 protected:
-	FloatSampler pixelSampler;
-	FloatSampler russianRouletteSampler;
 	float pdfArea;
 
 public:
-	MonteCarloRayTracer(Scene * scene) :RayTracer(scene) 
+	MonteCarloRayTracer(Scene * scene, const RenderSettings & settings) :RayTracer(scene, settings) 
 	{ 
-		pdfArea = 1.0f / (Scene::WINDOW_HEIGHT * Scene::WINDOW_WIDTH);
+		pdfArea = 1.0f / (settings.height * settings.width);
 	}
 
 	virtual Vector doTrace(int screenX, int screenY);
-	virtual Vector shade(Ray & ray);
+
+	// Every camera sample gets its own sampler, seeded from the pixel and the sample index,
+	// which is used by every random decision along its path
+	virtual Vector shade(Ray & ray, PathSampler & sampler);
 
 protected:
-	void samplePixel(int x, int y, float &st, float &ss, float &pdf);
+	void samplePixel(int x, int y, float &st, float &ss, float &pdf, PathSampler & sampler);
 };
 
 // =================================================================================
@@ -101,7 +182,78 @@ protected:
 class PathTracer : public MonteCarloRayTracer
 {
 public:
-	PathTracer(Scene * scene) : MonteCarloRayTracer(scene){}
+	PathTracer(Scene * scene, const RenderSettings & settings) : MonteCarloRayTracer(scene, settings){}
 	Vector doTrace(int screenX, int screenY);
-	Vector shade(Ray & ray);
-};
\ No newline at end of file
+	unsigned int getPixelSamples() const { return settings.pathTracerSamples; }
+	Vector traceSample(int screenX, int screenY, unsigned int sampleIndex);
+
+	// Radiance along the camera ray. The path is extended in a loop that keeps its throughput, instead of a call
+	// per bounce, so long paths need no stack and nothing is allocated along them
+	Vector shade(Ray & cameraRay, PathSampler & sampler);
+
+protected:
+	// Next event estimation: radiance reaching the hit point from a light sampled explicitly
+	Vector sampleDirectLighting(HitInfo & info, PhysicalMaterial * BRDF, PathSampler & sampler, unsigned int firstDimension);
+
+	// MIS weight of the emission found by a BSDF sampled ray, which the previous vertex could also have sampled
+	float emissionWeight(Ray & ray, HitInfo & info);
+};
+// =================================================================================
+
+/*
+WavefrontPathTracer Class - Path tracer that extends many paths a bounce at a time
+
+Instead of following one path to its end, a whole batch of camera samples of a tile is traced together.
+Every bounce intersects all the rays in flight, sorts the hits into a queue per physical material, shades
+each queue in turn (the same sampling code for every ray of it) and gathers the rays of the next bounce.
+Tiles are still the tasks of the thread pool, so the batches scale with it.
+
+The estimate is the one of PathTracer: same russian roulette, same sampler dimensions, and both
+reflection and transmission followed under pathTracerReflexTransmissionBounces. Pixels take a fixed
+number of samples (no adaptive sampling). Progressive passes take as many samples of every pixel as
+fit in a batch too, so they trace batches of the same size
+*/
+class WavefrontPathTracer : public PathTracer
+{
+private:
+	// A camera sample, with the radiance its rays have gathered so far
+	struct WavefrontSample
+	{
+		PathSampler sampler;
+		Vector radiance;
+		unsigned int pixel;		// Offset of the pixel in the sums
+
+		WavefrontSample(unsigned int x, unsigned int y, unsigned int sampleIndex, SamplerType type, unsigned int pixel) :
+			sampler(x, y, sampleIndex, type), pixel(pixel) {}
+	};
+
+	// A ray in flight, and the throughput of the path that led to it
+	struct WavefrontRay
+	{
+		Ray ray;
+		Vector throughput;
+		unsigned int sample;	// Index of its camera sample
+	};
+
+public:
+	WavefrontPathTracer(Scene * scene, const RenderSettings & settings) : PathTracer(scene, settings) {}
+
+	void renderTile(const ImageTile & tile, FrameBuffer & frameBuffer);
+	unsigned int getPassSamples() const;
+	void accumulateTileSamples(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount, Vector * sums);
+
+private:
+	// Samples of every pixel of a tile of tilePixels pixels that fit in a batch, at least one
+	unsigned int getBatchSamples(unsigned int tilePixels) const;
+
+	// Samples firstSample to firstSample + sampleCount - 1 of every pixel of the tile, as a single batch. They are
+	// added to sums, where the pixels of a row are consecutive and rows are sumsStride apart
+	void traceBatch(const ImageTile & tile, unsigned int firstSample, unsigned int sampleCount, Vector * sums, unsigned int sumsStride);
+
+	// Russian roulette and intersection of the ray. Returns the material to shade the hit with, or NULL if the
+	// path ends here (the emission or background it found is added to its sample)
+	PhysicalMaterial * intersectPath(WavefrontRay & path, WavefrontSample & sample, HitInfo & hit);
+
+	// Light sample and scattered rays of a hit, which are added to nextRays
+	void shadePath(const WavefrontRay & path, WavefrontSample & sample, HitInfo & hit, PhysicalMaterial * BRDF, std::vector<WavefrontRay> & nextRays);
+};
@@ -0,0 +1,171 @@
+#include "TriangleMesh.h"
+
+// =================================================================================
+
+void TriangleMesh::transform(const Matrix & localToWorld)
+{
+	Matrix toWorld = localToWorld;
+	Matrix normalMatrix = toWorld.Inverse().Transpose();
+
+	for (auto & position : positions)
+	{
+		position.w = 1.0f;
+		position = toWorld * position;
+	}
+
+	for (auto & normal : normals)
+	{
+		normal = normalMatrix * Vector(normal.x, normal.y, normal.z, 0.0f);
+		normal.Normalize();
+	}
+
+	precompute();
+}
+
+void TriangleMesh::precompute()
+{
+	const unsigned int numTriangles = GetNumTriangles();
+
+	triangles.resize(numTriangles);
+	for (unsigned int i = 0; i < numTriangles; i++)
+	{
+		MeshTriangle & triangle = triangles[i];
+		triangle.vertex0 = GetVertex(i, 0);
+		triangle.edge1 = GetVertex(i, 1) - triangle.vertex0;
+		triangle.edge2 = GetVertex(i, 2) - triangle.vertex0;
+	}
+	triangles.shrink_to_fit();
+}
+
+bool TriangleMesh::intersectTriangle(unsigned int triIndex, const Ray & ray, float maxDistance, float & t, float & b1, float & b2) const
+{
+	_RT_COUNT_STAT(primitiveTests);
+
+	const MeshTriangle & triangle = triangles[triIndex];
+	const Vector & vertex0 = triangle.vertex0;
+	const Vector & edge1 = triangle.edge1;
+	const Vector & edge2 = triangle.edge2;
+
+	Vector origin = ray.getOrigin();
+	Vector dir = ray.getDirection();
+
+	// A zero determinant means the ray is parallel to the triangle plane
+	Vector pVec = dir.Cross(edge2);
+	float det = edge1.Dot(pVec);
+	if (det == 0.0f)
+	{
+		return false;
+	}
+
+	float invDet = 1.0f / det;
+
+	Vector tVec = origin - vertex0;
+	b1 = tVec.Dot(pVec) * invDet;
+	if (b1 < 0.0f || b1 > 1.0f)
+	{
+		return false;
+	}
+
+	Vector qVec = tVec.Cross(edge1);
+
+	t = edge2.Dot(qVec) * invDet;
+	if (t <= ray.getTMin() || t >= maxDistance)
+	{
+		_RT_COUNT_STAT(intervalRejects);
+		return false;
+	}
+
+	b2 = dir.Dot(qVec) * invDet;
+	if (b2 < 0.0f || b1 + b2 > 1.0f)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+Vector TriangleMesh::interpolateNormal(unsigned int triIndex, float b1, float b2) const
+{
+	const unsigned int * triangle = &indices[triIndex * 3];
+
+	if (normals.empty())
+	{
+		// Flat shading, with the winding used by the .3ds loader
+		Vector v0 = positions[triangle[0]];
+		Vector v1 = positions[triangle[1]];
+		Vector v2 = positions[triangle[2]];
+		return (v0 - v1).Cross(v2 - v1).Normalize();
+	}
+
+	Vector normal = normals[triangle[0]] * (1.0f - b1 - b2) + normals[triangle[1]] * b1 + normals[triangle[2]] * b2;
+	return normal.Normalize();
+}
+
+void TriangleMesh::interpolateTexCoords(unsigned int triIndex, float b1, float b2, float & u, float & v) const
+{
+	if (texCoords.empty())
+	{
+		u = v = 0.0f;
+		return;
+	}
+
+	const unsigned int * triangle = &indices[triIndex * 3];
+	const MeshTexCoord & uv0 = texCoords[triangle[0]];
+	const MeshTexCoord & uv1 = texCoords[triangle[1]];
+	const MeshTexCoord & uv2 = texCoords[triangle[2]];
+
+	float b0 = 1.0f - b1 - b2;
+	u = (abs(uv0.u) * b0) + (abs(uv1.u) * b1) + (abs(uv2.u) * b2);
+	v = (abs(uv0.v) * b0) + (abs(uv1.v) * b1) + (abs(uv2.v) * b2);
+	u -= floor(u);
+	v -= floor(v);
+}
+
+#ifdef _RT_USE_BVH
+void TriangleMesh::buildBVH()
+{
+	const unsigned int numTriangles = GetNumTriangles();
+
+	std::vector<AABB> triangleBounds;
+	triangleBounds.reserve(numTriangles);
+
+	for (unsigned int i = 0; i < numTriangles; i++)
+	{
+		triangleBounds.push_back(computeTriangleBounds(i));
+	}
+
+	bvh.build(triangleBounds);
+}
+#endif
+
+AABB TriangleMesh::computeTriangleBounds(unsigned int triIndex) const
+{
+	AABB box;
+	for (unsigned int corner = 0; corner < 3; corner++)
+	{
+		box.expand(GetVertex(triIndex, corner));
+	}
+	return box;
+}
+
+float TriangleMesh::computeTriangleArea(unsigned int triIndex) const
+{
+	Vector v0 = GetVertex(triIndex, 0);
+	Vector BA = GetVertex(triIndex, 1) - v0;
+	Vector CA = GetVertex(triIndex, 2) - v0;
+
+	return 0.5f * BA.Cross(CA).Magnitude();
+}
+
+size_t TriangleMesh::getMemoryUsage() const
+{
+	size_t bytes = positions.capacity() * sizeof(Vector)
+		+ normals.capacity() * sizeof(Vector)
+		+ texCoords.capacity() * sizeof(MeshTexCoord)
+		+ indices.capacity() * sizeof(unsigned int)
+		+ triangles.capacity() * sizeof(MeshTriangle);
+#ifdef _RT_USE_BVH
+	bytes += bvh.getMemoryUsage();
+#endif
+	return bytes;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+
+#include "Utils.h"
+#include "Ray.h"
+#include "BVH.h"
+
+/*
+MeshTexCoord Struct - Texture coordinates of a mesh vertex
+*/
+struct MeshTexCoord
+{
+	float u, v;
+} typedef MeshTexCoord;
+
+/*
+MeshTriangle Struct - First vertex and edges of a triangle, as the intersection test uses them
+*/
+struct MeshTriangle
+{
+	Vector vertex0;
+	Vector edge1, edge2;
+};
+
+/*
+TriangleMesh Class - Indexed triangle storage
+
+Vertices are shared between the triangles that use them, and every triangle is just three
+indices into the vertex arrays. Normals and texture coordinates are optional: without normals
+the mesh is flat shaded, without texture coordinates (0, 0) is used.
+The intersection test reads the edges of every triangle from their own array, built by precompute
+once the positions are final, instead of gathering three positions through the indices.
+A mesh (and its BVH) can be shared by several models, each one with its own transform
+*/
+class TriangleMesh
+{
+public:
+	std::vector<Vector> positions;
+	std::vector<Vector> normals;			// Empty, or one per position
+	std::vector<MeshTexCoord> texCoords;	// Empty, or one per position
+	std::vector<unsigned int> indices;		// Three per triangle
+	std::vector<MeshTriangle> triangles;	// One per triangle, built by precompute
+#ifdef _RT_USE_BVH
+	BVH bvh;								// Over the triangles, in the mesh space
+#endif
+
+	TriangleMesh() {}
+
+	// -- Accessor Functions --
+	// - GetNumTriangles - Returns the number of triangles in the mesh
+	unsigned int GetNumTriangles(void) const { return (unsigned int)(indices.size() / 3); }
+
+	// - GetNumVertices - Returns the number of shared vertices in the mesh
+	unsigned int GetNumVertices(void) const { return (unsigned int)positions.size(); }
+
+	// - GetVertex - Gets the position of the nth corner (0, 1 or 2) of a triangle
+	const Vector & GetVertex(unsigned int triIndex, unsigned int corner) const { return positions[indices[triIndex * 3 + corner]]; }
+
+	// Applies an affine transform to the positions and normals (and precomputes the triangles again)
+	void transform(const Matrix & localToWorld);
+
+	// Builds the triangles from the indexed positions. Called once the mesh is loaded
+	void precompute();
+
+	// Moller-Trumbore test. Gives the ray parameter and the barycentric coordinates (b1, b2) of vertices 1 and 2
+	// for a hit inside (tMin, maxDistance), without computing any shading attribute
+	bool intersectTriangle(unsigned int triIndex, const Ray & ray, float maxDistance, float & t, float & b1, float & b2) const;
+
+	// Shading normal and texture coordinates at the given barycentric coordinates
+	Vector interpolateNormal(unsigned int triIndex, float b1, float b2) const;
+	void interpolateTexCoords(unsigned int triIndex, float b1, float b2, float & u, float & v) const;
+
+#ifdef _RT_USE_BVH
+	void buildBVH();
+#endif
+
+	AABB computeTriangleBounds(unsigned int triIndex) const;
+	float computeTriangleArea(unsigned int triIndex) const;
+
+	// Memory used by the vertex and index arrays (and the BVH), in bytes
+	size_t getMemoryUsage() const;
+};
@@ -76,31 +76,31 @@ public:
 
 	// NOTE: The following arithmetic operator overloads DO NOT change the value of the current vector
 	// - Add Operator - Returns the sum of vectors
-	Vector operator + (const Vector vec2)
+	Vector operator + (const Vector vec2) const
 	{
 		return Vector (x + vec2.x, y + vec2.y, z + vec2.z, w + vec2.w);
 	}
 
 	// - Subtract Operator - Returns the difference of vectors
-	Vector operator - (const Vector vec2)
+	Vector operator - (const Vector vec2) const
 	{
 		return Vector (x - vec2.x, y - vec2.y, z - vec2.z, w - vec2.w);
 	}
 
 	// - Multiply Operator - Returns the vector scaled by a factor
-	Vector operator * (const float scaleFactor)
+	Vector operator * (const float scaleFactor) const
 	{
 		return Vector (x * scaleFactor, y * scaleFactor, z * scaleFactor, w * scaleFactor);
 	}
 
 	// - Divide Operator - Returns the vectors scaled by a factor
-	Vector operator / (const float scaleFactor)
+	Vector operator / (const float scaleFactor) const
 	{
 		return Vector (x / scaleFactor, y / scaleFactor, z / scaleFactor, w / scaleFactor);
 	}
 
 	// - Vector Multiply Operator -
-	Vector operator * (const Vector scaleVector)
+	Vector operator * (const Vector scaleVector) const
 	{
 		return Vector (x * scaleVector.x, y * scaleVector.y, z * scaleVector.z, w * scaleVector.w);
 	}
@@ -0,0 +1,125 @@
+/*
+  Headless renderer
+
+  Renders a scene without a window and writes the image to a file, for machines without a display.
+
+  Usage: headless scenefile [options]
+	-o file          Output image: .png, .jpg or .hdr (default render.png)
+	-t tracer        rt, ss, mc, bb, pt or wf
+	-r WxH           Resolution
+	-s spp           Samples per pixel of the ss, pt and wf tracers
+	-j threads       Worker threads (0 for one per hardware thread)
+	--name value     Any other render setting, by the name it has in the render_settings element
+
+  The options change the render settings of the scene file, which start from the defaults of Config.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+
+#include "Scene.h"
+#include "RayTrace.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double millisecondsBetween(Clock::time_point start, Clock::time_point end)
+{
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static void printUsage(const char * program)
+{
+	printf("usage: %s scenefile [-o output.png|.jpg|.hdr] [-t rt|ss|mc|bb|pt|wf] [-r WIDTHxHEIGHT] [-s spp] [-j threads] [--setting value]...\n", program);
+}
+
+// Changes the render settings from one command line option
+static bool applyOption(RenderSettings & settings, const char * option, const char * value)
+{
+	if (strcmp(option, "-t") == 0)
+	{
+		return settings.set("tracer", value);
+	}
+	else if (strcmp(option, "-r") == 0)
+	{
+		// WIDTHxHEIGHT, each checked as the width and height settings
+		const char * separator = strchr(value, 'x');
+		if (separator == NULL)
+		{
+			return false;
+		}
+		std::string width(value, separator);
+		return settings.set("width", width.c_str()) && settings.set("height", separator + 1);
+	}
+	else if (strcmp(option, "-s") == 0)
+	{
+		return settings.set("supersamplingSamples", value) && settings.set("pathTracerSamples", value);
+	}
+	else if (strcmp(option, "-j") == 0)
+	{
+		return settings.set("threads", value);
+	}
+	else if (strncmp(option, "--", 2) == 0)
+	{
+		return settings.set(option + 2, value);
+	}
+	return false;
+}
+
+int main(int argc, char ** argv)
+{
+	Clock::time_point processStart = Clock::now();
+
+	if (argc < 2 || argc % 2 != 0)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	char * sceneFile = argv[1];
+	const char * outputFile = "render.png";
+
+	RayTrace rayTrace;
+	if (!rayTrace.m_Scene.Load(sceneFile))
+	{
+		printf("failed to load scene\n");
+		return 1;
+	}
+
+	// The command line has the last word over the scene file
+	RenderSettings & settings = rayTrace.m_Scene.GetSettings();
+	for (int i = 2; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-o") == 0)
+		{
+			outputFile = argv[i + 1];
+		}
+		else if (!applyOption(settings, argv[i], argv[i + 1]))
+		{
+			printf("invalid option %s %s\n", argv[i], argv[i + 1]);
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+	settings.print();
+
+	Clock::time_point renderStart = Clock::now();
+	rayTrace.Render();
+	Clock::time_point renderEnd = Clock::now();
+
+	if (!rayTrace.saveImage(outputFile))
+	{
+		printf("failed to write %s\n", outputFile);
+		return 1;
+	}
+	printf("Image written to %s (%ux%u)\n", outputFile, settings.width, settings.height);
+
+	Clock::time_point processEnd = Clock::now();
+	printf("Startup: %.1f ms\n", millisecondsBetween(processStart, renderStart));
+	printf("Render: %.1f ms\n", millisecondsBetween(renderStart, renderEnd));
+	printf("Total: %.1f ms\n", millisecondsBetween(processStart, processEnd));
+
+	return 0;
+}
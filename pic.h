@@ -47,4 +47,8 @@ public:
 Pic *pic_alloc( int nx, int ny, int bytes_per_pixel, Pic *opic );
 void pic_free( Pic *p );
 Pic* ReadJPEG( const char* i_path );
-bool WriteJPEG( const char* i_path, const Pic* i_pic );
\ No newline at end of file
+bool WriteJPEG( const char* i_path, const Pic* i_pic );
+bool WritePNG( const char* i_path, const Pic* i_pic );
+/* Radiance HDR from float pixels of at least 3 channels. i_rowStride is the number of floats from the
+   first (top) row to the next one, negative for images stored from the bottom row */
+bool WriteHDR( const char* i_path, int i_width, int i_height, const float* i_firstRow, int i_channels, int i_rowStride );
\ No newline at end of file
@@ -34,29 +34,15 @@
 #include "RayTrace.h"
 #include "NormalRenderer.h"
 
-/*
-	!!!NOTE!!!
-
-	The Width & Height have been reduced to help you debug
-	more quickly by reducing the resolution to a quarter of
-	the original size (640 x 480). Your code should work for
-	any dimension, but more importantly this should be set back
-	to the original resolution before you render your submissions.
-*/
-const int Scene::WINDOW_WIDTH = 512;// 320;
-const int Scene::WINDOW_HEIGHT = 512;// 240;
-
-TracerType Scene::tracerType = TracerType::RAY_TRACE;
-
-bool Scene::supersample = false;
-bool Scene::montecarlo = false;
-bool Scene::boundingbox = false;
-
 /* --- Global State Variables --- */
 
 /* - Menu State Identifier - */
 int g_iMenuId;
 
+/* - Window Size, the resolution of the render settings of the scene - */
+int g_iWindowWidth = 0;
+int g_iWindowHeight = 0;
+
 /* - Mouse State Variables - */
 int g_vMousePos[2] = {0, 0};
 int g_iLeftMouseButton = 0;    /* 1 if pressed, 0 if not */
@@ -69,12 +55,10 @@ RayTrace g_RayTrace;
 /* - NormalRenderer Variable for drawing with OpenGL calls instead of the RayTracer - */
 NormalRenderer g_NormalRenderer;
 
-/* - RayTrace Buffer - */
-Vector g_ScreenBuffer[Scene::WINDOW_HEIGHT][Scene::WINDOW_WIDTH]; 
-
 unsigned int g_X = 0, g_Y = 0;
 bool g_bRayTrace = false;
 bool g_bRenderNormal = true;
+bool g_bRenderInProgress = false;
 
 /*
 	saveScreenshot - Writes a screenshot to the specified filename in JPEG
@@ -87,14 +71,14 @@ void saveScreenshot (char *filename)
 		return;
 
 	/* Allocate a picture buffer */
-	in = pic_alloc (Scene::WINDOW_WIDTH, Scene::WINDOW_HEIGHT, 3, NULL);
+	in = pic_alloc (g_iWindowWidth, g_iWindowHeight, 3, NULL);
 
 	printf("File to save to: %s\n", filename);
 
 	/* Loop over each row of the image and copy into the image */
-	for (int i = Scene::WINDOW_HEIGHT - 1; i >= 0; i--)
+	for (int i = g_iWindowHeight - 1; i >= 0; i--)
 	{
-		glReadPixels(0, Scene::WINDOW_HEIGHT - 1 - i, Scene::WINDOW_WIDTH, 1, GL_RGB,
+		glReadPixels(0, g_iWindowHeight - 1 - i, g_iWindowWidth, 1, GL_RGB,
 						GL_UNSIGNED_BYTE, &in->pix[i*in->m_width*in->m_channels]);
 	}
 
@@ -172,7 +156,7 @@ void myinit()
 	// Default to these camera settings
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity ();
-	glOrtho(0, Scene::WINDOW_WIDTH, 0, Scene::WINDOW_HEIGHT, 1, -1);
+	glOrtho(0, g_iWindowWidth, 0, g_iWindowHeight, 1, -1);
 
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
@@ -183,6 +167,29 @@ void myinit()
 	glClearColor(0, 0, 0, 0);
 }
 
+/*
+	drawFrameBuffer - Draws the image of the ray tracer straight from its frame buffer
+*/
+void drawFrameBuffer()
+{
+#ifdef _RT_PROGRESSIVE_RENDERING
+	// The render may be running in the background, and only the image of a completed pass is shown
+	std::unique_lock<std::mutex> imageLock = g_RayTrace.lockImage();
+	if (g_RayTrace.getCompletedPasses() == 0)
+		return;
+#endif
+
+	const FrameBuffer & frameBuffer = g_RayTrace.getFrameBuffer();
+	if (frameBuffer.isEmpty())
+		return;
+
+	// Both go from the bottom row, but the rows of the frame buffer are padded
+	glRasterPos2i(0, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, frameBuffer.getStride());
+	glDrawPixels(frameBuffer.getWidth(), frameBuffer.getHeight(), GL_RGBA, GL_FLOAT, frameBuffer.getRow(0));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
 /*
   display - Function to modify with your ray-tracing rendering code 
 */
@@ -197,26 +204,14 @@ void display()
 		// Set up the camera to render pixel-by-pixel
 		glMatrixMode(GL_PROJECTION);
 		glLoadIdentity ();
-		glOrtho(0, Scene::WINDOW_WIDTH, 0, Scene::WINDOW_HEIGHT, 1, -1);
+		glOrtho(0, g_iWindowWidth, 0, g_iWindowHeight, 1, -1);
 
 		glMatrixMode(GL_MODELVIEW);
 		glLoadIdentity();
 
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		glBegin(GL_POINTS);
-		{
-			for (int y = 0; y < Scene::WINDOW_HEIGHT; y++)
-			{
-				for (int x = 0; x < Scene::WINDOW_WIDTH; x++)
-				{
-					glColor3f(g_ScreenBuffer[y][x].x, g_ScreenBuffer[y][x].y, g_ScreenBuffer[y][x].z);
-					glVertex2i(x, y);
-				}
-			}
-		}
-
-		glEnd();
+		drawFrameBuffer();
 	}
 
 	glFlush();
@@ -241,33 +236,38 @@ void menufunc(int value)
 		// Start the Ray Tracing
 		g_bRayTrace = true;
 		g_bRenderNormal = false;
-		Scene::tracerType = TracerType::RAY_TRACE;
+		g_RayTrace.m_Scene.GetSettings().tracerType = TracerType::RAY_TRACE;
 		break;
 	case 2:
 		// Start the Ray Tracing with supersampling
 		g_bRayTrace = true;
 		g_bRenderNormal = false;
 //		g_RayTrace.preRenderInit();
-		Scene::tracerType = TracerType::SUPER_SAMPLING_RAY_TRACE;
+		g_RayTrace.m_Scene.GetSettings().tracerType = TracerType::SUPER_SAMPLING_RAY_TRACE;
 		break;
    case 3:
 		// Start the Ray Tracing with Monte Carlo
 		g_bRayTrace = true;
 		g_bRenderNormal = false;
 //		g_RayTrace.preRenderInit();
-		Scene::tracerType = TracerType::MONTE_CARLO_RAY_TRACE;
+		g_RayTrace.m_Scene.GetSettings().tracerType = TracerType::MONTE_CARLO_RAY_TRACE;
 		break;
    case 4:
 	   g_bRayTrace = true;
 	   g_bRenderNormal = false;
-	   Scene::tracerType = TracerType::BB_RAY_TRACE;
+	   g_RayTrace.m_Scene.GetSettings().tracerType = TracerType::BB_RAY_TRACE;
 	   break;
    case 5:
 	   g_bRayTrace = true;
 	   g_bRenderNormal = false;
-	   Scene::tracerType = TracerType::PATH_TRACE;
+	   g_RayTrace.m_Scene.GetSettings().tracerType = TracerType::PATH_TRACE;
 	   break;
-	case 6:
+   case 6:
+	   g_bRayTrace = true;
+	   g_bRenderNormal = false;
+	   g_RayTrace.m_Scene.GetSettings().tracerType = TracerType::WAVEFRONT_PATH_TRACE;
+	   break;
+	case 7:
 		// Quit Program
 		exit(0);
 		break;
@@ -282,19 +282,23 @@ void menufunc(int value)
 */
 void doIdle()
 {
+#ifdef _RT_PROGRESSIVE_RENDERING
+	// The render runs in the background, and the screen shows its last completed pass
+	if (g_bRayTrace)
+	{
+		g_RayTrace.startRender();
+		g_bRayTrace = false;
+		g_bRenderInProgress = true;
+	}
+	else if (g_bRenderInProgress)
+	{
+		g_bRenderInProgress = g_RayTrace.isRendering();
+	}
+	glutPostRedisplay();
+#else
 	if (g_bRayTrace)
 	{
 		g_RayTrace.Render();
-		Vector ** buffer = g_RayTrace.getBuffer();
-		
-		for (int i = 0; i < Scene::WINDOW_HEIGHT; i++)
-		{
-			
-			for (int j = 0; j < Scene::WINDOW_WIDTH; j++)
-			{
-				memcpy(&g_ScreenBuffer[i], buffer[i], sizeof(Vector) * Scene::WINDOW_WIDTH);
-			}
-		}
 
 		g_bRayTrace = false;
 		glutPostRedisplay();
@@ -303,7 +307,7 @@ void doIdle()
 
 		// Move to the next pixel
 		g_X++;
-		if (g_X >= Scene::WINDOW_WIDTH)
+		if (g_X >= g_iWindowWidth)
 		{
 			// Move to the next row
 			g_X = 0;
@@ -315,7 +319,7 @@ void doIdle()
 		}
 
 		// Check for the end of the screen
-		if (g_Y >= Scene::WINDOW_HEIGHT)
+		if (g_Y >= g_iWindowHeight)
 		{
 			g_bRayTrace = false;
 			glutPostRedisplay ();
@@ -325,6 +329,7 @@ void doIdle()
 	{
 		glutPostRedisplay ();
 	}
+#endif
 }
 
 /*
@@ -480,13 +485,16 @@ int main (int argc, char ** argv)
 		exit(1);
 	}
 
+	g_iWindowWidth = (int)(g_RayTrace.m_Scene.GetSettings().width);
+	g_iWindowHeight = (int)(g_RayTrace.m_Scene.GetSettings().height);
+
 	printf ("Right-click and choose Render to begin Ray-tracing...\n");
 
 	glutInit(&argc,argv);
 
 	/* create a window */
 	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
-	glutInitWindowSize(Scene::WINDOW_WIDTH, Scene::WINDOW_HEIGHT);
+	glutInitWindowSize(g_iWindowWidth, g_iWindowHeight);
 
 	glutCreateWindow("Trazador de rayos");
 
@@ -502,7 +510,8 @@ int main (int argc, char ** argv)
 	glutAddMenuEntry("Render Ray Tracing Monte Carlo",3);
 	glutAddMenuEntry("Render Ray Tracing Bounding Boxes",4);
 	glutAddMenuEntry("Render Path Tracing", 5);
-	glutAddMenuEntry("Quit", 6);
+	glutAddMenuEntry("Render Wavefront Path Tracing", 6);
+	glutAddMenuEntry("Quit", 7);
 	glutAttachMenu(GLUT_RIGHT_BUTTON);
 
 	/* replace with any animate code */
@@ -45,6 +45,8 @@
 #ifdef _WIN32
 	#define strncasecmp _strnicmp
 	#define strcasecmp _stricmp
+#else
+	#include <strings.h>
 #endif
 
 #ifdef _UNICODE